@@ -1,10 +1,30 @@
 #include "controller.h"
 
 #include <nacs-utils/log.h>
+#include <nacs-utils/timer.h>
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace NaCs {
 namespace Pulser {
 
+// Returns `false` if the value had already changed and the thread didn't sleep.
+static inline bool
+futexWait(std::atomic<uint32_t> &addr, uint32_t val)
+{
+    return (syscall(SYS_futex, &addr, FUTEX_WAIT_PRIVATE, val,
+                    nullptr, nullptr, 0) == 0 || errno != EAGAIN);
+}
+
+static inline void
+futexWake(std::atomic<uint32_t> &addr, int n)
+{
+    syscall(SYS_futex, &addr, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+}
+
 NACS_EXPORT() void
 Controller::init()
 {
@@ -23,16 +43,63 @@ Controller::init()
     fprintf(log_f, "\n");
 }
 
+/**
+ * One of the requests in the group finished.
+ */
+NACS_EXPORT() void
+ReqGroup::done()
+{
+    auto prev = m_pending.fetch_sub(1, std::memory_order_acq_rel);
+    if (prev == (waitFlag | 1)) {
+        futexWake(m_pending, 1);
+    }
+}
+
+/**
+ * Wait for all requests in the group to finish.
+ */
+NACS_EXPORT() void
+ReqGroup::wait()
+{
+    auto pending = m_pending.load(std::memory_order_acquire);
+    while ((pending & ~waitFlag) != 0) {
+        if (!(pending & waitFlag) &&
+            !m_pending.compare_exchange_weak(pending, pending | waitFlag,
+                                             std::memory_order_acquire)) {
+            continue;
+        }
+        // Returns immediately if another request finished in the mean time
+        futexWait(m_pending, pending | waitFlag);
+        pending = m_pending.load(std::memory_order_acquire);
+    }
+}
+
 /**
  * Wait for the request to finish.
  */
 NACS_EXPORT() void
 Controller::wait(const Request &req)
 {
-    std::unique_lock<std::mutex> locker(m_cond_locks[req.cond_id]);
-    m_cond_vars[req.cond_id].wait(locker, [&] {
-            return req.ready;
-        });
+    // Most requests finish within a few microseconds,
+    // spin for a short time before going to sleep.
+    static constexpr int spin_count = 128;
+    for (int i = 0;i < spin_count;i++) {
+        if (req.ready())
+            return;
+        CPU::pause();
+    }
+    auto state = req.state.load(std::memory_order_acquire);
+    while (state != Request::Ready) {
+        // Tell `setRes` that it needs to wake us up.
+        if (state == Request::Pending &&
+            !req.state.compare_exchange_weak(state, Request::Waiting,
+                                             std::memory_order_acquire)) {
+            continue;
+        }
+        if (futexWait(req.state, Request::Waiting))
+            m_num_wakeups.fetch_add(1, std::memory_order_relaxed);
+        state = req.state.load(std::memory_order_acquire);
+    }
 }
 
 /**
@@ -42,12 +109,20 @@ Controller::wait(const Request &req)
 NACS_EXPORT() void
 Controller::setRes(Request &req, uint32_t res)
 {
-    {
-        std::lock_guard<std::mutex> locker(m_cond_locks[req.cond_id]);
-        req.res = res;
-        req.ready = true;
+    req.res = res;
+    m_num_completions.fetch_add(1, std::memory_order_relaxed);
+    // The request can be destructed as soon as the state is set to `Ready`.
+    // A wake up on a reused address is harmless since every waiter
+    // checks its state again after waking up.
+    // Read the group before the request might be destructed.
+    auto group = req.group;
+    if (req.state.exchange(Request::Ready,
+                           std::memory_order_acq_rel) == Request::Waiting) {
+        futexWake(req.state, 1);
+    }
+    if (group) {
+        group->done();
     }
-    m_cond_vars[req.cond_id].notify_all();
 }
 
 /**
@@ -123,6 +198,14 @@ Controller::popRemaining()
     return n_read;
 }
 
+NACS_EXPORT() void
+Controller::setThreadConfig(const ThreadConfig &reader,
+                            const ThreadConfig &writer)
+{
+    reader.apply(m_reader_thread, "Controller reader");
+    writer.apply(m_writer_thread, "Controller writer");
+}
+
 /**
  * Wait for event or timeout to thread the result buffer from FPGA
  */
@@ -130,10 +213,48 @@ NACS_EXPORT() void
 Controller::runReader()
 {
     while (!m_quit) {
-        std::unique_lock<std::mutex> locker(m_reader_lock);
-        // Sleep for a shorter time if there's pending requests
-        m_reader_cond.wait_for(locker, m_req_queue.size() ? 200us : 2000us);
-        popRemaining();
+        {
+            std::unique_lock<std::mutex> locker(m_reader_lock);
+            // Sleep for a shorter time if there's pending requests
+            m_reader_cond.wait_for(locker,
+                                   m_req_queue.size() ? 200us : 2000us);
+            popRemaining();
+        }
+        // Not holding the lock since the destructor needs it to quit.
+        if (auto budget = readerSpin()) {
+            spinReader(budget);
+        }
+    }
+}
+
+/**
+ * Busy poll the result buffer until nothing happens for @budget ns.
+ * Sequential requests (e.g. reading DDS registers) are then picked up without
+ * waiting for the reader to wake up.
+ */
+void
+Controller::spinReader(uint64_t budget)
+{
+    auto deadline = getTime() + budget;
+    auto num_written = m_num_written.load(std::memory_order_relaxed);
+    while (!m_quit) {
+        auto written = m_num_written.load(std::memory_order_relaxed);
+        bool active = written != num_written;
+        num_written = written;
+        if (int(written - m_num_read.load(std::memory_order_relaxed)) > 0 &&
+            numResults()) {
+            popResults();
+            active = true;
+        }
+        dumpNotifyQueue();
+        auto now = getTime();
+        if (active || m_req_queue.size()) {
+            deadline = now + budget;
+        }
+        else if (now > deadline) {
+            break;
+        }
+        CPU::pause();
     }
 }
 
@@ -177,8 +298,10 @@ Controller::writeRequests(uint32_t max_num, bool notify, uint32_t flags)
                 // If notify is enabled for the writer thread (i.e. this is
                 // not a RT thread), notify the requester directly.
                 setRes(*req, 0);
-            } else {
-                m_notify_queue.push(req);
+            } else if (!m_notify_queue.tryPush(req)) {
+                // Don't wait for the reader thread or allocate
+                // if the queue is full.
+                setRes(*req, 0);
             }
         }
     }
@@ -194,6 +317,24 @@ Controller::writeRequests(uint32_t max_num, bool notify, uint32_t flags)
     return total_time;
 }
 
+NACS_EXPORT() void
+Controller::runReqs(Request *reqs, size_t n)
+{
+    for (size_t i = 0;i < n;i++) {
+        auto &req = reqs[i];
+        if (!req.has_res) {
+            shortPulse(req.ctrl, req.op);
+            setRes(req, 0);
+            continue;
+        }
+        m_res_queue.push(&req);
+        waitForResSpace(1);
+        shortPulse(req.ctrl, req.op);
+        m_num_written.fetch_add(1, std::memory_order_relaxed);
+        m_reader_cond.notify_all();
+    }
+}
+
 /**
  * Write requests
  */
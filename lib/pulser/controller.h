@@ -3,6 +3,7 @@
 
 #include "driver.h"
 #include "commands.h"
+#include "thread_config.h"
 
 #include <nacs-utils/container.h>
 #include <nacs-utils/utils.h>
@@ -13,6 +14,7 @@
 #include <thread>
 #include <chrono>
 #include <array>
+#include <vector>
 
 #include <assert.h>
 
@@ -23,29 +25,86 @@ class Controller;
 
 using namespace std::literals;
 
+/**
+ * Completion counter for a group of requests (see `RequestBatch`).
+ * Only the last request to finish wakes up the waiter.
+ */
+class ReqGroup {
+    ReqGroup(const ReqGroup&) = delete;
+    void operator=(const ReqGroup&) = delete;
+    // Set when the waiter is (about to be) sleeping on the futex
+    static constexpr uint32_t waitFlag = 1u << 31;
+    // Number of pending requests and `waitFlag`
+    std::atomic<uint32_t> m_pending;
+public:
+    ReqGroup()
+        : m_pending(0)
+    {}
+    // Must be called before the request is submitted.
+    inline void
+    add(uint32_t n=1)
+    {
+        m_pending.fetch_add(n, std::memory_order_relaxed);
+    }
+    inline bool
+    ready() const
+    {
+        return (m_pending.load(std::memory_order_acquire) & ~waitFlag) == 0;
+    }
+    void done();
+    void wait();
+};
+
 /**
  * Each request should be writing two 32-bit words to the FIFO (slave reg 31)
  * and should last for no more than 500ns, the precise length of the pulse
  * is stored in `length` (< `Seq::PulseTime::_DDS`) in unit of FPGA clock (10ns)
  */
 struct Request {
-    bool ready: 1;
-    const bool has_res: 1;
+    enum : uint32_t {
+        Pending = 0,
+        // Pending and the requester is (about to be) sleeping on the futex
+        Waiting = 1,
+        Ready = 2,
+    };
+    /**
+     * Completion state. The requester waits on it with a futex
+     * (see `Controller::wait`) so that finishing a request only wakes up
+     * the thread waiting for it.
+     */
+    mutable std::atomic<uint32_t> state;
+    const bool has_res;
     const uint8_t length;
-    const uint8_t cond_id;
     // Result
     uint32_t res;
     // Keep this as is until we have variable length requests
     const uint32_t ctrl;
     const uint32_t op;
+    // Also notified when the request finishes
+    ReqGroup *const group;
     Request(Controller&, uint32_t ctrl, uint32_t op,
-            uint8_t len, bool _has_res);
+            uint8_t len, bool _has_res, ReqGroup *group=nullptr);
     template<typename Cmd, class=std::enable_if_t<isSimpleCmd<Cmd> > >
-    Request(Controller &ctrl, Cmd &&cmd)
+    Request(Controller &ctrl, Cmd &&cmd, ReqGroup *group=nullptr)
         : Request(ctrl, cmd.control(), cmd.operand(),
-                  uint8_t(cmd.length()), cmd.has_res)
+                  uint8_t(cmd.length()), cmd.has_res, group)
+    {}
+    // Only for creating arrays of requests before they are submitted.
+    Request(const Request &other)
+        : state(other.state.load(std::memory_order_relaxed)),
+          has_res(other.has_res),
+          length(other.length),
+          res(other.res),
+          ctrl(other.ctrl),
+          op(other.op),
+          group(other.group)
     {}
     Request() = delete;
+    inline bool
+    ready() const
+    {
+        return state.load(std::memory_order_acquire) == Ready;
+    }
 };
 
 template<typename T, typename Lock=SpinLock>
@@ -60,6 +119,7 @@ class FIFO {
     mutable Lock m_lock;
     size_t m_read_p; // always less than m_alloc
     size_t m_write_p; // always less than m_alloc
+    size_t m_grow_count;
     inline void
     doPush(const T *v)
     {
@@ -93,6 +153,7 @@ class FIFO {
             m_write_p += m_alloc;
         }
         m_alloc *= 2;
+        m_grow_count++;
     }
 public:
     inline
@@ -101,7 +162,8 @@ public:
           m_buff((T*)malloc(sizeof(T) * m_alloc)),
           m_lock(),
           m_read_p(0),
-          m_write_p(0)
+          m_write_p(0),
+          m_grow_count(0)
     {
     }
     inline size_t
@@ -109,6 +171,12 @@ public:
     {
         return m_alloc;
     }
+    // Number of times the buffer was reallocated.
+    inline size_t
+    growCount() const
+    {
+        return m_grow_count;
+    }
     template<bool lock=true>
     inline size_t
     size() const
@@ -205,12 +273,544 @@ public:
     }
 };
 
+/**
+ * Lock policies for `FIFO` that use atomic read and write indices instead
+ * of a lock.
+ *
+ * @SPSCLockFree: single producer and single consumer.
+ * @MPSCLockFree: multiple producers and single consumer.
+ *
+ * Unlike the locked version, the buffer has a fixed size. `tryPush` fails
+ * when the buffer is full and `push` waits for the consumer instead of
+ * growing the buffer. The `lock` template parameter of the member functions
+ * is accepted for compatibility and ignored.
+ */
+struct SPSCLockFree {};
+struct MPSCLockFree {};
+
+// Keep the indices written by different threads on different cache lines.
+static constexpr size_t fifoAlign = 64;
+
+template<typename T>
+class FIFO<T, SPSCLockFree> {
+    FIFO(const FIFO&) = delete;
+    void operator=(const FIFO&) = delete;
+    // m_alloc is always a power of 2
+    const size_t m_alloc;
+    T *const m_buff;
+    // The indices are never wrapped, only the index into the buffer is.
+    // Written by the consumer.
+    alignas(fifoAlign) std::atomic<size_t> m_read_p;
+    // Cache of `m_write_p` for the consumer
+    size_t m_write_cache;
+    // Written by the producer.
+    alignas(fifoAlign) std::atomic<size_t> m_write_p;
+    // Cache of `m_read_p` for the producer
+    size_t m_read_cache;
+    inline void
+    copyIn(size_t pos, const T *v, size_t len)
+    {
+        const auto start_p = pos & (m_alloc - 1);
+        const auto start_len = min(len, m_alloc - start_p);
+        memcpy(m_buff + start_p, v, start_len * sizeof(T));
+        if (start_len < len) {
+            memcpy(m_buff, v + start_len, (len - start_len) * sizeof(T));
+        }
+    }
+    inline void
+    copyOut(size_t pos, T *v, size_t len) const
+    {
+        const auto start_p = pos & (m_alloc - 1);
+        const auto start_len = min(len, m_alloc - start_p);
+        memcpy(v, m_buff + start_p, start_len * sizeof(T));
+        if (start_len < len) {
+            memcpy(v + start_len, m_buff, (len - start_len) * sizeof(T));
+        }
+    }
+public:
+    inline
+    FIFO(size_t size=256)
+        : m_alloc(1 << max(getBits(size) - 1, 2)),
+          m_buff((T*)malloc(sizeof(T) * m_alloc)),
+          m_read_p(0),
+          m_write_cache(0),
+          m_write_p(0),
+          m_read_cache(0)
+    {
+    }
+    ~FIFO()
+    {
+        free(m_buff);
+    }
+    inline size_t
+    capacity() const
+    {
+        return m_alloc;
+    }
+    inline size_t
+    growCount() const
+    {
+        return 0;
+    }
+    template<bool=true>
+    inline size_t
+    size() const
+    {
+        // Load the read index first so that the difference never underflows
+        auto read_p = m_read_p.load(std::memory_order_acquire);
+        return m_write_p.load(std::memory_order_acquire) - read_p;
+    }
+    template<bool=true>
+    inline size_t
+    spaceLeft() const
+    {
+        return capacity() - size();
+    }
+    // Producer
+    template<bool=true>
+    inline size_t
+    tryPush(const T *v, size_t len=1)
+    {
+        const auto write_p = m_write_p.load(std::memory_order_relaxed);
+        if (write_p + len - m_read_cache > m_alloc)
+            m_read_cache = m_read_p.load(std::memory_order_acquire);
+        len = min(m_alloc - (write_p - m_read_cache), len);
+        if (len > 0) {
+            copyIn(write_p, v, len);
+            m_write_p.store(write_p + len, std::memory_order_release);
+        }
+        return len;
+    }
+    template<bool=true>
+    inline bool
+    tryPush(const T &v)
+    {
+        return tryPush(&v, 1) != 0;
+    }
+    template<bool=true>
+    inline void
+    push(const T *v, size_t len=1)
+    {
+        while (true) {
+            auto pushed = tryPush(v, len);
+            v += pushed;
+            len -= pushed;
+            if (!len)
+                return;
+            std::this_thread::yield();
+        }
+    }
+    template<bool=true>
+    inline void
+    push(const T &v)
+    {
+        push(&v, 1);
+    }
+    // Consumer
+    template<bool=true>
+    inline T
+    pop()
+    {
+        // This function has no protection for overflowing
+        const auto read_p = m_read_p.load(std::memory_order_relaxed);
+        if (read_p == m_write_cache)
+            m_write_cache = m_write_p.load(std::memory_order_acquire);
+        T v = m_buff[read_p & (m_alloc - 1)];
+        m_read_p.store(read_p + 1, std::memory_order_release);
+        return v;
+    }
+    template<bool=true>
+    inline size_t
+    pop(T *v, size_t len=1)
+    {
+        const auto read_p = m_read_p.load(std::memory_order_relaxed);
+        if (read_p + len > m_write_cache)
+            m_write_cache = m_write_p.load(std::memory_order_acquire);
+        len = min(m_write_cache - read_p, len);
+        if (!len)
+            return 0;
+        copyOut(read_p, v, len);
+        m_read_p.store(read_p + len, std::memory_order_release);
+        return len;
+    }
+    inline size_t
+    tryPop(T *v, size_t len=1)
+    {
+        return pop(v, len);
+    }
+};
+
+template<typename T>
+class FIFO<T, MPSCLockFree> {
+    FIFO(const FIFO&) = delete;
+    void operator=(const FIFO&) = delete;
+    struct Cell {
+        // `pos + 1` when the value for `pos` is ready to be read.
+        std::atomic<size_t> seq;
+        T val;
+    };
+    // m_alloc is always a power of 2
+    const size_t m_alloc;
+    Cell *const m_cells;
+    // Written by the consumer.
+    alignas(fifoAlign) std::atomic<size_t> m_read_p;
+    // Written (reserved) by the producers.
+    alignas(fifoAlign) std::atomic<size_t> m_write_p;
+public:
+    inline
+    FIFO(size_t size=256)
+        : m_alloc(1 << max(getBits(size) - 1, 2)),
+          m_cells(new Cell[m_alloc]),
+          m_read_p(0),
+          m_write_p(0)
+    {
+        for (size_t i = 0;i < m_alloc;i++) {
+            m_cells[i].seq.store(0, std::memory_order_relaxed);
+        }
+    }
+    ~FIFO()
+    {
+        delete[] m_cells;
+    }
+    inline size_t
+    capacity() const
+    {
+        return m_alloc;
+    }
+    inline size_t
+    growCount() const
+    {
+        return 0;
+    }
+    // Includes the elements that are reserved but not ready yet.
+    template<bool=true>
+    inline size_t
+    size() const
+    {
+        // Load the read index first so that the difference never underflows
+        auto read_p = m_read_p.load(std::memory_order_acquire);
+        return m_write_p.load(std::memory_order_acquire) - read_p;
+    }
+    template<bool=true>
+    inline size_t
+    spaceLeft() const
+    {
+        return capacity() - size();
+    }
+    // Producers
+    // The elements pushed in one call are reserved with a single atomic
+    // operation and will be consecutive in the queue.
+    template<bool=true>
+    inline size_t
+    tryPush(const T *v, size_t len=1)
+    {
+        auto write_p = m_write_p.load(std::memory_order_relaxed);
+        size_t n;
+        do {
+            auto read_p = m_read_p.load(std::memory_order_acquire);
+            n = min(m_alloc - (write_p - read_p), len);
+            if (!n) {
+                return 0;
+            }
+        } while (!m_write_p.compare_exchange_weak(write_p, write_p + n,
+                                                  std::memory_order_relaxed));
+        for (size_t i = 0;i < n;i++) {
+            auto pos = write_p + i;
+            auto &cell = m_cells[pos & (m_alloc - 1)];
+            cell.val = v[i];
+            cell.seq.store(pos + 1, std::memory_order_release);
+        }
+        return n;
+    }
+    template<bool=true>
+    inline bool
+    tryPush(const T &v)
+    {
+        return tryPush(&v, 1) != 0;
+    }
+    // Unlike `tryPush`, this may split the elements if there isn't enough
+    // space to push all of them at once.
+    template<bool=true>
+    inline void
+    push(const T *v, size_t len=1)
+    {
+        while (true) {
+            auto pushed = tryPush(v, len);
+            v += pushed;
+            len -= pushed;
+            if (!len)
+                return;
+            std::this_thread::yield();
+        }
+    }
+    template<bool=true>
+    inline void
+    push(const T &v)
+    {
+        push(&v, 1);
+    }
+    // Consumer
+    template<bool=true>
+    inline T
+    pop()
+    {
+        // This function has no protection for overflowing
+        // but waits for the producer to finish writing the element.
+        const auto read_p = m_read_p.load(std::memory_order_relaxed);
+        auto &cell = m_cells[read_p & (m_alloc - 1)];
+        while (cell.seq.load(std::memory_order_acquire) != read_p + 1)
+            std::this_thread::yield();
+        T v = cell.val;
+        m_read_p.store(read_p + 1, std::memory_order_release);
+        return v;
+    }
+    template<bool=true>
+    inline size_t
+    pop(T *v, size_t len=1)
+    {
+        const auto read_p = m_read_p.load(std::memory_order_relaxed);
+        size_t n = 0;
+        for (;n < len;n++) {
+            auto pos = read_p + n;
+            auto &cell = m_cells[pos & (m_alloc - 1)];
+            if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+                break;
+            v[n] = cell.val;
+        }
+        if (n)
+            m_read_p.store(read_p + n, std::memory_order_release);
+        return n;
+    }
+    inline size_t
+    tryPop(T *v, size_t len=1)
+    {
+        return pop(v, len);
+    }
+};
+
+/**
+ * Single producer single consumer FIFO backed by a linked list of fixed size
+ * pages from a pool allocated by the constructor. The consumer returns
+ * finished pages to a free list which the producer reuses so that the queue
+ * never copies any element or calls the allocator after it is created.
+ * The free list has only one pusher (the consumer) and one popper (the
+ * producer) so it does not suffer from the ABA problem.
+ *
+ * The constructor allocates enough pages for `size` elements.
+ * When the pool is exhausted `tryPush` fails and `push` waits for the
+ * consumer. `growCount` is the number of `tryPush` calls that failed
+ * because the queue would have needed more pages.
+ */
+template<size_t PageSize=64>
+struct SPSCPaged {
+    static_assert((PageSize & (PageSize - 1)) == 0,
+                  "Page size must be a power of 2");
+};
+
+template<typename T, size_t PageSize>
+class FIFO<T, SPSCPaged<PageSize> > {
+    FIFO(const FIFO&) = delete;
+    void operator=(const FIFO&) = delete;
+    struct Page {
+        std::atomic<Page*> next;
+        T data[PageSize];
+    };
+    // Free list
+    std::atomic<Page*> m_free;
+    const size_t m_npages;
+    std::atomic<size_t> m_grow_count;
+    // Consumer
+    alignas(fifoAlign) std::atomic<size_t> m_read_p;
+    Page *m_head;
+    // Producer
+    alignas(fifoAlign) std::atomic<size_t> m_write_p;
+    Page *m_tail;
+    inline void
+    freePage(Page *page)
+    {
+        auto top = m_free.load(std::memory_order_relaxed);
+        do {
+            page->next.store(top, std::memory_order_relaxed);
+        } while (!m_free.compare_exchange_weak(top, page,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+    // Returns `nullptr` if the pool is exhausted.
+    inline Page*
+    newPage()
+    {
+        auto top = m_free.load(std::memory_order_acquire);
+        while (top) {
+            auto next = top->next.load(std::memory_order_relaxed);
+            if (m_free.compare_exchange_weak(top, next,
+                                             std::memory_order_acquire)) {
+                top->next.store(nullptr, std::memory_order_relaxed);
+                break;
+            }
+        }
+        return top;
+    }
+    // Push as many elements as there are space for.
+    inline size_t
+    doPush(const T *v, size_t len)
+    {
+        auto write_p = m_write_p.load(std::memory_order_relaxed);
+        const auto start_p = write_p;
+        const auto end_p = write_p + len;
+        while (write_p < end_p) {
+            auto offset = write_p & (PageSize - 1);
+            if (offset == 0 && write_p != 0) {
+                auto page = newPage();
+                if (unlikely(!page))
+                    break;
+                // Published to the consumer by the store to `m_write_p`
+                m_tail->next.store(page, std::memory_order_relaxed);
+                m_tail = page;
+            }
+            auto n = min(PageSize - offset, end_p - write_p);
+            memcpy(m_tail->data + offset, v, n * sizeof(T));
+            v += n;
+            write_p += n;
+        }
+        if (write_p != start_p)
+            m_write_p.store(write_p, std::memory_order_release);
+        return write_p - start_p;
+    }
+public:
+    inline
+    FIFO(size_t size=256)
+        : m_free(nullptr),
+          // The consumer might still hold one page while the producer fills
+          // the rest of the buffer.
+          m_npages((size + PageSize - 1) / PageSize + 1),
+          m_grow_count(0),
+          m_read_p(0),
+          m_write_p(0)
+    {
+        for (size_t i = 0;i < m_npages;i++)
+            freePage(new Page);
+        m_head = m_tail = newPage();
+    }
+    ~FIFO()
+    {
+        for (auto page = m_head;page;) {
+            auto next = page->next.load(std::memory_order_relaxed);
+            delete page;
+            page = next;
+        }
+        for (auto page = m_free.load(std::memory_order_relaxed);page;) {
+            auto next = page->next.load(std::memory_order_relaxed);
+            delete page;
+            page = next;
+        }
+    }
+    inline size_t
+    capacity() const
+    {
+        return m_npages * PageSize;
+    }
+    inline size_t
+    growCount() const
+    {
+        return m_grow_count.load(std::memory_order_relaxed);
+    }
+    template<bool=true>
+    inline size_t
+    size() const
+    {
+        // Load the read index first so that the difference never underflows
+        auto read_p = m_read_p.load(std::memory_order_acquire);
+        return m_write_p.load(std::memory_order_acquire) - read_p;
+    }
+    template<bool=true>
+    inline size_t
+    spaceLeft() const
+    {
+        auto sz = size();
+        auto cap = capacity();
+        return cap > sz ? cap - sz : 0;
+    }
+    // Producer
+    template<bool=true>
+    inline size_t
+    tryPush(const T *v, size_t len=1)
+    {
+        auto pushed = doPush(v, len);
+        if (unlikely(pushed < len))
+            m_grow_count.fetch_add(1, std::memory_order_relaxed);
+        return pushed;
+    }
+    template<bool=true>
+    inline bool
+    tryPush(const T &v)
+    {
+        return tryPush(&v, 1) != 0;
+    }
+    template<bool=true>
+    inline void
+    push(const T *v, size_t len=1)
+    {
+        while (true) {
+            auto pushed = doPush(v, len);
+            v += pushed;
+            len -= pushed;
+            if (!len)
+                return;
+            std::this_thread::yield();
+        }
+    }
+    template<bool=true>
+    inline void
+    push(const T &v)
+    {
+        push(&v, 1);
+    }
+    // Consumer
+    template<bool=true>
+    inline size_t
+    pop(T *v, size_t len=1)
+    {
+        auto read_p = m_read_p.load(std::memory_order_relaxed);
+        len = min(m_write_p.load(std::memory_order_acquire) - read_p, len);
+        if (!len)
+            return 0;
+        const auto end_p = read_p + len;
+        while (read_p < end_p) {
+            auto offset = read_p & (PageSize - 1);
+            if (offset == 0 && read_p != 0) {
+                auto page = m_head;
+                m_head = page->next.load(std::memory_order_relaxed);
+                freePage(page);
+            }
+            auto n = min(PageSize - offset, end_p - read_p);
+            memcpy(v, m_head->data + offset, n * sizeof(T));
+            v += n;
+            read_p += n;
+        }
+        m_read_p.store(end_p, std::memory_order_release);
+        return len;
+    }
+    template<bool=true>
+    inline T
+    pop()
+    {
+        // This function has no protection for overflowing
+        T v;
+        while (!pop(&v, 1))
+            std::this_thread::yield();
+        return v;
+    }
+    inline size_t
+    tryPop(T *v, size_t len=1)
+    {
+        return pop(v, len);
+    }
+};
+
 /**
  * This is the object that manages the threads that talks to the FPGA.
  */
 class Controller: public Driver {
-    static constexpr unsigned numLocks = 32;
-    static constexpr unsigned numLocksMask = numLocks - 1;
     template<typename Cmd, size_t... I, size_t... ResI>
     inline auto
     _reqSyncComposite(Cmd &&cmd, std::index_sequence<I...>,
@@ -253,15 +853,21 @@ class Controller: public Driver {
             std::get<ResI>(cmdTuple).convertRes(reqs[ResNum].res)...);
     }
 public:
-    Controller(volatile void *base)
+    /**
+     * @notify_size: number of write only requests the RT writer can have
+     *     waiting for the reader to notify the requesters
+     *     (see `notifyQueueFullCount`).
+     */
+    Controller(volatile void *base, size_t notify_size=1024)
         : Driver(base),
           m_num_read(0),
           m_num_written(0),
           m_res_queue(64),
-          m_req_queue(64),
-          m_notify_queue(64),
-          m_cond_vars(),
-          m_cond_locks(),
+          m_req_queue(1024),
+          m_notify_queue(notify_size),
+          m_num_wakeups(0),
+          m_num_completions(0),
+          m_reader_spin(0),
           m_quit(false),
           m_reader_cond(),
           m_reader_lock(),
@@ -284,25 +890,73 @@ public:
         m_writer_thread.join();
     }
     void init();
+    // Scheduling of the helper threads reading from and writing to the FPGA.
+    void setThreadConfig(const ThreadConfig &reader,
+                         const ThreadConfig &writer);
+
+    // For requester
+    void wait(const Request &req);
 
-    // For creating requests
-    inline uint8_t
-    getCondId()
+    /**
+     * Statistics of the request notification.
+     *
+     * @numWakeups: number of times a requester woke up from sleeping in `wait`
+     * @numCompletions: number of requests finished (`setRes` calls)
+     */
+    inline uint64_t
+    numWakeups() const
     {
-        return uint8_t(m_cond_id.fetch_add(1, std::memory_order_relaxed) & numLocksMask);
+        return m_num_wakeups.load(std::memory_order_relaxed);
+    }
+    inline uint64_t
+    numCompletions() const
+    {
+        return m_num_completions.load(std::memory_order_relaxed);
     }
 
-    // For requester
-    void wait(const Request &req);
+    /**
+     * How long (in ns) the reader thread keeps polling the FPGA after the
+     * last request or result before going back to sleep.
+     * `0` (default) sleeps as soon as there's no outstanding result,
+     * a new request then waits for the reader to wake up (up to 200us
+     * for requests written by a RT thread).
+     */
+    inline void
+    setReaderSpin(uint64_t ns)
+    {
+        m_reader_spin.store(ns, std::memory_order_relaxed);
+    }
+    inline uint64_t
+    readerSpin() const
+    {
+        return m_reader_spin.load(std::memory_order_relaxed);
+    }
 
     inline void
     pushReq(Request &req)
     {
-        {
-            std::lock_guard<std::mutex> locker(m_writer_lock);
-            m_req_queue.push(&req);
+        Request *reqp = &req;
+        pushReqs(&reqp, 1);
+    }
+    // The requests are pushed to the queue with a single atomic operation
+    // (as long as there's enough space in the queue) and the writer thread
+    // is notified only once.
+    // A batch larger than the space left in the queue is pushed in parts,
+    // the writer is notified after each of them so that it can make room
+    // for the rest.
+    inline void
+    pushReqs(Request *const *reqs, size_t n)
+    {
+        while (true) {
+            auto pushed = m_req_queue.tryPush(reqs, n);
+            if (pushed)
+                notifyWriter();
+            reqs += pushed;
+            n -= pushed;
+            if (!n)
+                return;
+            std::this_thread::yield();
         }
-        m_writer_cond.notify_all();
     }
 
     // Send a request and wait for it to finish
@@ -397,6 +1051,14 @@ public:
                              std::make_index_sequence<
                              std::decay_t<Cmd>::numRes>());
     }
+    /**
+     * Write the requests directly, the counterpart of `pushReqs` for the thread
+     * holding the controller lock (see `run`). Up to the size of the result
+     * buffer are in flight at the same time instead of one per round trip.
+     * Requests without results are finished after they are written,
+     * the ones with results finish asynchronously as usual.
+     */
+    void runReqs(Request *reqs, size_t n);
     inline int32_t
     resBuffSpace()
     {
@@ -418,6 +1080,23 @@ public:
     }
     uint64_t writeRequests(uint32_t max_num, bool notify, uint32_t flags=0);
     inline void
+    notifyWriter()
+    {
+        // The writer checks the queue with the lock held, taking the lock
+        // here makes sure it won't miss the notification.
+        {
+            std::lock_guard<std::mutex> locker(m_writer_lock);
+        }
+        m_writer_cond.notify_all();
+    }
+    // Number of times the notification queue was full and the RT writer
+    // had to notify the requester itself.
+    inline size_t
+    notifyQueueFullCount() const
+    {
+        return m_notify_queue.growCount();
+    }
+    inline void
     waitFinish()
     {
         releaseHold();
@@ -429,6 +1108,7 @@ private:
     uint32_t popResults();
     void dumpNotifyQueue();
     uint32_t popRemaining();
+    void spinReader(uint64_t budget);
     void runReader();
 
     /**
@@ -456,34 +1136,38 @@ private:
 
     /**
      * @m_res_queue: queue of written requests
+     *     Pushed by the thread holding `m_lock` and popped by the reader.
+     *     It never has more than the size of the result buffer
+     *     (see `resBuffSpace`) so the fixed size ring is never full.
      * @m_req_queue: queue of requests to be written
+     *     Pushed by any requester and popped by the thread holding `m_lock`.
      */
-    FIFO<Request*> m_res_queue;
-    FIFO<Request*> m_req_queue;
+    FIFO<Request*, SPSCLockFree> m_res_queue;
+    FIFO<Request*, MPSCLockFree> m_req_queue;
     /**
      * @m_notify_queue: For write only request, the time it cost to do a
      *     notify might be a little too expensive for the real time writer
      *     thread. Therefore, although the request is technically done when it
      *     is written to the FPGA, we push it to a queue and let the reader
      *     thread send the notification.
+     *     Pushed by the thread holding `m_lock` and popped by the reader.
+     *     Nothing limits how far the writer gets ahead of the reader.
+     *     The pages are all allocated by the constructor and the writer
+     *     notifies the requester itself when they are used up.
      */
-    FIFO<Request*> m_notify_queue;
+    FIFO<Request*, SPSCPaged<> > m_notify_queue;
 
     /**
-     * @m_cond_vars
-     * @m_cond_locks
-     *     Condition variables to notify the requester of finished request
-     *     Split into multiple bins so that we don't need to create a new
-     *     condition variable (and mutex) for each single request, which can
-     *     be too expensive for RT thread or wake up everyone for every events
-     *     when there are more then one pending requests.
+     * @m_num_wakeups
+     * @m_num_completions
+     *     See `numWakeups` and `numCompletions`.
      */
-    mutable std::condition_variable m_cond_vars[numLocks];
-    mutable std::mutex m_cond_locks[numLocks];
+    std::atomic<uint64_t> m_num_wakeups;
+    std::atomic<uint64_t> m_num_completions;
     /**
-     * m_cond_id: counter to assign condition variables.
+     * @m_reader_spin: See `setReaderSpin`.
      */
-    mutable std::atomic<uint8_t> m_cond_id;
+    std::atomic<uint64_t> m_reader_spin;
 
     /**
      * @m_quit: the controller is (being) destructed and the helper thread(s)
@@ -530,17 +1214,181 @@ private:
 typedef std::lock_guard<Controller> CtrlLocker;
 
 inline
-Request::Request(Controller &ctrl, uint32_t _ctrl, uint32_t _op,
-                 uint8_t len, bool _has_res)
-    : ready(false),
+Request::Request(Controller&, uint32_t _ctrl, uint32_t _op,
+                 uint8_t len, bool _has_res, ReqGroup *_group)
+    : state(Pending),
       has_res(_has_res),
       length(len),
-      cond_id(ctrl.getCondId()),
       res(0),
       ctrl(_ctrl),
-      op(_op)
+      op(_op),
+      group(_group)
 {}
 
+/**
+ * A group of commands that are submitted to the controller together
+ * (asynchronous version of `Controller::reqSync`).
+ *
+ * `add` returns a handle to the result of the command, which is available
+ * after the whole batch finishes. The batch must outlive the handles and no
+ * command can be added after the batch is submitted.
+ *
+ *     RequestBatch batch(ctrl);
+ *     auto freq = batch.add(DDSGetFreqF(0));
+ *     auto amp = batch.add(DDSGetAmpF(0));
+ *     batch.submit(); // or `batch.run()` with the controller locked
+ *     // Waits for the whole batch
+ *     use(freq.get(), amp.get());
+ */
+class RequestBatch {
+    RequestBatch(const RequestBatch&) = delete;
+    void operator=(const RequestBatch&) = delete;
+    template<typename Cmd>
+    inline void
+    addReq(Cmd &&cmd)
+    {
+        assert(!m_submitted);
+        m_group.add();
+        m_reqs.emplace_back(m_ctrl, std::forward<Cmd>(cmd), &m_group);
+    }
+    template<typename Cmd, size_t... I>
+    inline void
+    addComposite(const Cmd &cmd, std::index_sequence<I...>)
+    {
+        typedef typename Cmd::tupleType TupleType;
+        const TupleType &cmdTuple = cmd;
+        (void)std::initializer_list<int>{(addReq(std::get<I>(cmdTuple)), 0)...};
+    }
+    template<typename Cmd>
+    inline auto
+    convertRes(const Cmd &cmd, size_t idx) const
+        -> std::enable_if_t<isSimpleCmd<Cmd>,
+                            decltype(cmd.convertRes(std::declval<uint32_t>()))>
+    {
+        return cmd.convertRes(m_reqs[idx].res);
+    }
+    template<typename Cmd, size_t... ResI>
+    inline auto
+    convertComposite(const Cmd &cmd, size_t idx,
+                     std::index_sequence<ResI...>) const
+    {
+        typedef typename Cmd::tupleType TupleType;
+        const TupleType &cmdTuple = cmd;
+        return cmd.convertRes(
+            std::get<ResI>(cmdTuple).convertRes(m_reqs[idx + ResI].res)...);
+    }
+    template<typename Cmd, class=std::enable_if_t<isCompositeCmd<Cmd> > >
+    inline auto
+    convertRes(const Cmd &cmd, size_t idx) const
+    {
+        return convertComposite(cmd, idx, typename Cmd::resIndexes());
+    }
+public:
+    template<typename Cmd>
+    class Result {
+        const RequestBatch *m_batch;
+        size_t m_idx;
+        Cmd m_cmd;
+    public:
+        Result(const RequestBatch &batch, size_t idx, const Cmd &cmd)
+            : m_batch(&batch),
+              m_idx(idx),
+              m_cmd(cmd)
+        {}
+        inline bool
+        ready() const
+        {
+            return m_batch->ready();
+        }
+        // Wait for the batch to finish if it hasn't.
+        inline auto
+        get() const
+        {
+            m_batch->wait();
+            return m_batch->convertRes(m_cmd, m_idx);
+        }
+    };
+
+    RequestBatch(Controller &ctrl, size_t reserve=16)
+        : m_ctrl(ctrl),
+          m_submitted(false)
+    {
+        m_reqs.reserve(reserve);
+    }
+    ~RequestBatch()
+    {
+        // The requests are referenced by the controller until they finish.
+        if (m_submitted) {
+            wait();
+        }
+    }
+
+    template<typename Cmd>
+    inline std::enable_if_t<isSimpleCmd<Cmd>, Result<std::decay_t<Cmd> > >
+    add(Cmd &&cmd)
+    {
+        auto idx = m_reqs.size();
+        addReq(cmd);
+        return Result<std::decay_t<Cmd> >(*this, idx, cmd);
+    }
+    template<typename Cmd>
+    inline std::enable_if_t<isCompositeCmd<Cmd>, Result<std::decay_t<Cmd> > >
+    add(Cmd &&cmd)
+    {
+        typedef typename std::decay_t<Cmd>::tupleType TupleType;
+        auto idx = m_reqs.size();
+        addComposite(cmd, std::make_index_sequence<
+                     std::tuple_size<TupleType>::value>());
+        return Result<std::decay_t<Cmd> >(*this, idx, cmd);
+    }
+
+    inline size_t
+    size() const
+    {
+        return m_reqs.size();
+    }
+    inline Request&
+    operator[](size_t i)
+    {
+        return m_reqs[i];
+    }
+
+    inline void
+    submit()
+    {
+        assert(!m_submitted);
+        m_submitted = true;
+        m_ptrs.resize(m_reqs.size());
+        for (size_t i = 0;i < m_reqs.size();i++)
+            m_ptrs[i] = &m_reqs[i];
+        m_ctrl.pushReqs(m_ptrs.data(), m_ptrs.size());
+    }
+    // Same as `submit` but for the thread holding the controller lock.
+    inline void
+    run()
+    {
+        assert(!m_submitted);
+        m_submitted = true;
+        m_ctrl.runReqs(m_reqs.data(), m_reqs.size());
+    }
+    inline bool
+    ready() const
+    {
+        return m_group.ready();
+    }
+    inline void
+    wait() const
+    {
+        m_group.wait();
+    }
+private:
+    Controller &m_ctrl;
+    bool m_submitted;
+    std::vector<Request> m_reqs;
+    std::vector<Request*> m_ptrs;
+    mutable ReqGroup m_group;
+};
+
 }
 }
 
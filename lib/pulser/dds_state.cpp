@@ -0,0 +1,218 @@
+#include "dds_state.h"
+
+#include <nacs-utils/log.h>
+
+namespace NaCs {
+namespace Pulser {
+
+NACS_EXPORT() std::vector<DDSState>
+readDDSStates(Controller &ctrl, const std::vector<unsigned> &dds)
+{
+    RequestBatch batch(ctrl, dds.size() * 4);
+    std::vector<RequestBatch::Result<DDSGetFreq> > freqs;
+    std::vector<RequestBatch::Result<DDSGetAmp> > amps;
+    std::vector<RequestBatch::Result<DDSGetPhase> > phases;
+    freqs.reserve(dds.size());
+    amps.reserve(dds.size());
+    phases.reserve(dds.size());
+    for (auto i: dds) {
+        freqs.push_back(batch.add(DDSGetFreq(int(i))));
+        amps.push_back(batch.add(DDSGetAmp(int(i))));
+        phases.push_back(batch.add(DDSGetPhase(int(i))));
+    }
+    batch.submit();
+    batch.wait();
+    std::vector<DDSState> res(dds.size());
+    for (size_t i = 0;i < dds.size();i++) {
+        res[i].id = dds[i];
+        res[i].freq = freqs[i].get();
+        res[i].amp = uint16_t(amps[i].get());
+        res[i].phase = uint16_t(phases[i].get());
+    }
+    return res;
+}
+
+
+NACS_EXPORT() DDSCache::DDSCache(Controller &ctrl, Mode mode)
+    : m_ctrl(ctrl),
+      m_mode(mode)
+{
+}
+
+NACS_EXPORT() void
+DDSCache::setMode(Mode mode)
+{
+    std::lock_guard<std::mutex> locker(m_lock);
+    m_mode.store(mode, std::memory_order_relaxed);
+    for (auto &entry: m_entries) {
+        entry.gen++;
+        entry.valid = 0;
+    }
+}
+
+template<typename Cmd, typename Func>
+void
+DDSCache::write(unsigned i, const Cmd &cmd, uint8_t flag, Func &&update)
+{
+    if (mode() == Disabled) {
+        m_ctrl.reqSync(cmd);
+        return;
+    }
+    auto &entry = m_entries[i];
+    uint32_t gen;
+    bool clean;
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        entry.valid &= uint8_t(~flag);
+        gen = ++entry.gen;
+        // With another write in flight we can't tell which one
+        // reaches the hardware last.
+        clean = entry.pending++ == 0;
+    }
+    m_ctrl.reqSync(cmd);
+    std::lock_guard<std::mutex> locker(m_lock);
+    entry.pending--;
+    if (clean && entry.gen == gen) {
+        entry.gen++;
+        update(entry);
+        entry.valid |= flag;
+    }
+}
+
+NACS_EXPORT() void
+DDSCache::setFreq(unsigned i, uint32_t freq)
+{
+    write(i, DDSSetFreq(int(i), freq), FreqValid,
+          [&] (Entry &entry) { entry.freq = freq; });
+}
+
+NACS_EXPORT() void
+DDSCache::setAmp(unsigned i, uint16_t amp)
+{
+    write(i, DDSSetAmp(int(i), amp), AmpValid,
+          [&] (Entry &entry) { entry.amp = amp; });
+}
+
+NACS_EXPORT() void
+DDSCache::setPhase(unsigned i, uint16_t phase)
+{
+    write(i, DDSSetPhase(int(i), phase), PhaseValid,
+          [&] (Entry &entry) { entry.phase = phase; });
+}
+
+NACS_EXPORT() void
+DDSCache::invalidate(unsigned i)
+{
+    std::lock_guard<std::mutex> locker(m_lock);
+    m_entries[i].gen++;
+    m_entries[i].valid = 0;
+}
+
+NACS_EXPORT() void
+DDSCache::invalidateAll()
+{
+    std::lock_guard<std::mutex> locker(m_lock);
+    for (auto &entry: m_entries) {
+        entry.gen++;
+        entry.valid = 0;
+    }
+}
+
+NACS_EXPORT() DDSState
+DDSCache::read(unsigned i)
+{
+    return read(std::vector<unsigned>{i})[0];
+}
+
+NACS_EXPORT() std::vector<DDSState>
+DDSCache::read(const std::vector<unsigned> &dds)
+{
+    auto mode = this->mode();
+    if (mode == Disabled)
+        return readDDSStates(m_ctrl, dds);
+    std::vector<DDSState> res(dds.size());
+    std::vector<uint32_t> gens(dds.size());
+    std::vector<uint8_t> valid(dds.size());
+    size_t nmiss = 0;
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        for (size_t i = 0;i < dds.size();i++) {
+            auto &entry = m_entries[dds[i]];
+            res[i] = DDSState{dds[i], entry.freq, entry.amp, entry.phase};
+            gens[i] = entry.gen;
+            valid[i] = entry.valid;
+            if (mode == Verify || entry.valid != AllValid) {
+                nmiss++;
+            }
+        }
+    }
+    m_hits.fetch_add(dds.size() - nmiss, std::memory_order_relaxed);
+    if (nmiss == 0)
+        return res;
+    m_misses.fetch_add(nmiss, std::memory_order_relaxed);
+
+    // Only read the registers we don't know about, unless we are verifying.
+    auto needRead = [&] (size_t i, uint8_t flag) {
+        return mode == Verify || !(valid[i] & flag);
+    };
+    RequestBatch batch(m_ctrl, nmiss * 4);
+    std::vector<std::pair<size_t, RequestBatch::Result<DDSGetFreq> > > freqs;
+    std::vector<std::pair<size_t, RequestBatch::Result<DDSGetAmp> > > amps;
+    std::vector<std::pair<size_t, RequestBatch::Result<DDSGetPhase> > > phases;
+    for (size_t i = 0;i < dds.size();i++) {
+        if (needRead(i, FreqValid))
+            freqs.emplace_back(i, batch.add(DDSGetFreq(int(dds[i]))));
+        if (needRead(i, AmpValid))
+            amps.emplace_back(i, batch.add(DDSGetAmp(int(dds[i]))));
+        if (needRead(i, PhaseValid))
+            phases.emplace_back(i, batch.add(DDSGetPhase(int(dds[i]))));
+    }
+    batch.submit();
+    batch.wait();
+
+    uint64_t nmismatch = 0;
+    auto check = [&] (size_t i, uint8_t flag, const char *name,
+                      uint32_t cached, uint32_t val) {
+        if ((valid[i] & flag) && cached != val) {
+            Log::error("DDS %u %s mismatch: cached %08X, read %08X\n",
+                       dds[i], name, cached, val);
+            nmismatch++;
+        }
+    };
+    for (auto &freq: freqs) {
+        auto i = freq.first;
+        uint32_t val = freq.second.get();
+        check(i, FreqValid, "frequency", res[i].freq, val);
+        res[i].freq = val;
+    }
+    for (auto &amp: amps) {
+        auto i = amp.first;
+        auto val = uint16_t(amp.second.get());
+        check(i, AmpValid, "amplitude", res[i].amp, val);
+        res[i].amp = val;
+    }
+    for (auto &phase: phases) {
+        auto i = phase.first;
+        auto val = uint16_t(phase.second.get());
+        check(i, PhaseValid, "phase", res[i].phase, val);
+        res[i].phase = val;
+    }
+    if (nmismatch) {
+        m_mismatches.fetch_add(nmismatch, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> locker(m_lock);
+    for (size_t i = 0;i < dds.size();i++) {
+        auto &entry = m_entries[dds[i]];
+        if (entry.gen != gens[i] || entry.pending)
+            continue;
+        entry.freq = res[i].freq;
+        entry.amp = res[i].amp;
+        entry.phase = res[i].phase;
+        entry.valid = AllValid;
+    }
+    return res;
+}
+
+}
+}
@@ -0,0 +1,139 @@
+#ifndef __NACS_PULSER_DDS_STATE_H__
+#define __NACS_PULSER_DDS_STATE_H__
+
+#include "controller.h"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace NaCs {
+namespace Pulser {
+
+/**
+ * Raw frequency (tuning word), amplitude and phase of a DDS channel.
+ */
+struct DDSState {
+    unsigned id;
+    uint32_t freq;
+    uint16_t amp;
+    uint16_t phase;
+    inline double
+    freqF() const
+    {
+        return DDSCvt::num2freq(freq, PULSER_AD9914_CLK);
+    }
+    inline double
+    ampF() const
+    {
+        return DDSCvt::num2amp(amp);
+    }
+    inline double
+    phaseF() const
+    {
+        return DDSCvt::num2phase(phase);
+    }
+};
+
+/**
+ * Read the state of the DDS's in @dds.
+ * All the reads are submitted to the controller as a single batch so that
+ * they are pipelined by the writer and reader threads.
+ */
+std::vector<DDSState> readDDSStates(Controller &ctrl,
+                                    const std::vector<unsigned> &dds);
+
+
+/**
+ * Shadow copy of the frequency, amplitude and phase registers of the DDS's.
+ *
+ * Values written through the cache are remembered so that later reads can be
+ * served without going to the FPGA. Anything else that may change the DDS
+ * registers (sequences, DDS reset and initialization) must call `invalidate`
+ * or `invalidateAll`, after which the next read of the channel goes to
+ * the hardware and refills the cache.
+ *
+ * In `Verify` mode every read goes to the hardware and is compared with the
+ * cached value. Mismatches are logged and counted.
+ */
+class DDSCache {
+    DDSCache(const DDSCache&) = delete;
+    void operator=(const DDSCache&) = delete;
+public:
+    enum Mode {
+        Disabled,
+        Enabled,
+        Verify
+    };
+    DDSCache(Controller &ctrl, Mode mode=Enabled);
+
+    inline Mode
+    mode() const
+    {
+        return m_mode.load(std::memory_order_relaxed);
+    }
+    // Changing the mode drops all cached values.
+    void setMode(Mode mode);
+
+    void setFreq(unsigned i, uint32_t freq);
+    void setAmp(unsigned i, uint16_t amp);
+    void setPhase(unsigned i, uint16_t phase);
+
+    DDSState read(unsigned i);
+    std::vector<DDSState> read(const std::vector<unsigned> &dds);
+
+    void invalidate(unsigned i);
+    void invalidateAll();
+
+    // Number of channels read from the cache/hardware
+    // and the number of hardware reads that disagree with the cache.
+    inline uint64_t
+    hits() const
+    {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+    inline uint64_t
+    misses() const
+    {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+    inline uint64_t
+    mismatches() const
+    {
+        return m_mismatches.load(std::memory_order_relaxed);
+    }
+private:
+    enum : uint8_t {
+        FreqValid = 1 << 0,
+        AmpValid = 1 << 1,
+        PhaseValid = 1 << 2,
+        AllValid = FreqValid | AmpValid | PhaseValid
+    };
+    struct Entry {
+        // Bumped on invalidation and writes so that values read from
+        // the hardware concurrently are not put back in the cache.
+        uint32_t gen = 0;
+        // Number of writes in flight.
+        uint32_t pending = 0;
+        uint8_t valid = 0;
+        uint32_t freq = 0;
+        uint16_t amp = 0;
+        uint16_t phase = 0;
+    };
+    template<typename Cmd, typename Func>
+    void write(unsigned i, const Cmd &cmd, uint8_t flag, Func &&update);
+
+    Controller &m_ctrl;
+    std::atomic<Mode> m_mode;
+    std::mutex m_lock;
+    std::array<Entry, PULSER_NDDS> m_entries;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+    std::atomic<uint64_t> m_mismatches{0};
+};
+
+}
+}
+
+#endif
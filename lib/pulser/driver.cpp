@@ -5,6 +5,8 @@
 #include <nacs-utils/fd_utils.h>
 #include <nacs-utils/log.h>
 
+#include <stdlib.h>
+
 namespace NaCs {
 namespace Pulser {
 
@@ -16,7 +18,18 @@ mapPulserAddr()
     // with propery device tree file.
     static constexpr auto phy_addr = XPAR_PULSE_CONTROLLER_0_BASEADDR;
     static_assert(sizeof(off_t) == 8, "");
-    static auto map_addr = [] {
+    static auto map_addr = [] () -> volatile void* {
+#if PULSER_SIM
+        if (getenv("NACS_PULSER_SIM")) {
+            double clock_rate = 1e8;
+            if (auto rate = getenv("NACS_PULSER_SIM_CLOCK"))
+                clock_rate = atof(rate);
+            Log::info("Using simulated pulse controller (%g Hz)\n",
+                      clock_rate);
+            static Simulator sim(clock_rate);
+            return sim.base();
+        }
+#endif
         Log::info("Initializing pulse controller\n");
         auto addr = mapFile("/dev/mem", phy_addr, 4096);
         if (unlikely(!addr)) {
@@ -3,6 +3,15 @@
 
 #include "ctrl_io.h"
 
+#include <nacs-pulser/pulser-config.h>
+
+#if PULSER_SIM
+#  include "simulator.h"
+#endif
+#if PULSER_TRACE
+#  include "trace.h"
+#endif
+
 namespace NaCs {
 namespace Pulser {
 
@@ -14,15 +23,25 @@ namespace Pulser {
  */
 class Driver {
     volatile void *const m_base;
+#if PULSER_SIM
+    // Non-null if @m_base belongs to a simulated controller.
+    Simulator *const m_sim;
+#endif
     Driver() = delete;
     Driver(const Driver&) = delete;
     void operator=(const Driver&) = delete;
 public:
     Driver(volatile void *base)
         : m_base(base)
+#if PULSER_SIM
+        , m_sim(Simulator::find(base))
+#endif
     {}
     Driver(Driver &&other)
         : m_base(other.m_base)
+#if PULSER_SIM
+        , m_sim(other.m_sim)
+#endif
     {
     }
     intptr_t
@@ -35,6 +54,10 @@ public:
     inline uint32_t
     readReg(uint32_t reg) const
     {
+#if PULSER_SIM
+        if (m_sim)
+            return m_sim->readReg(reg);
+#endif
         return mReadSlaveReg(m_base, reg);
     }
     inline uint32_t
@@ -77,11 +100,20 @@ public:
     inline void
     writeReg(uint32_t reg, uint32_t val) const
     {
+#if PULSER_SIM
+        if (m_sim) {
+            m_sim->writeReg(reg, val);
+            return;
+        }
+#endif
         mWriteSlaveReg(m_base, reg, val);
     }
     inline void
     shortPulse(uint32_t ctrl, uint32_t op) const
     {
+#if PULSER_TRACE
+        pulseTrace().record(ctrl, op);
+#endif
         writeReg(31, op);
         writeReg(31, ctrl);
     }
@@ -115,9 +147,19 @@ public:
         uint32_t r3 = readReg(3);
         writeReg(3, r3 | 0x00000100);
         writeReg(3, r3 & ~0x00000100);
+#if PULSER_TRACE
+        pulseTrace().restart();
+#endif
     }
 };
 
+/**
+ * Map the registers of the pulse controller.
+ * If the simulator is enabled at build time and the environment variable
+ * `NACS_PULSER_SIM` is set, return the registers of a simulated controller
+ * instead. The clock rate of the simulator (in Hz) can be set with
+ * `NACS_PULSER_SIM_CLOCK`.
+ */
 volatile void *mapPulserAddr();
 
 }
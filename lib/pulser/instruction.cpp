@@ -11,67 +11,99 @@
 namespace NaCs {
 namespace Pulser {
 
+template<typename Out>
 static inline __attribute__((flatten, hot)) void
-checkedShortPulse(Controller *__restrict__ ctrler, uint32_t ctrl, uint32_t op)
+checkedShortPulse(Out *__restrict__ ctrler, uint32_t ctrl, uint32_t op)
 {
     ctrl |= ControlBit::TimingCheck;
     ctrler->shortPulse(ctrl, op);
 }
 
-template<typename Cmd>
+template<typename Out, typename Cmd>
 static inline __attribute__((flatten, hot))
 std::enable_if_t<isSimpleCmd<Cmd> >
-checkedShortPulse(Controller *__restrict__ ctrler, Cmd &&cmd)
+checkedShortPulse(Out *__restrict__ ctrler, Cmd &&cmd)
 {
     checkedShortPulse(ctrler, cmd.control(), cmd.operand());
 }
 
+template<typename Out>
 static inline __attribute__((flatten, hot)) void
-runDDSSetPhase(Controller *__restrict__ ctrler, CtrlState *__restrict__ state,
+runDDSSetPhase(Out *__restrict__ ctrler, CtrlState *__restrict__ state,
                int dds_num, uint16_t phase)
 {
     state->dds_phases[dds_num] = phase;
     checkedShortPulse(ctrler, DDSSetPhase(dds_num, phase));
 }
 
-template<typename T>
-static inline __attribute__((flatten, hot)) void
-runWait(Controller *__restrict__ ctrler, uint64_t &wait_time, uint64_t t,
-        T &&release_after)
+// If the wait time is too short, don't do anything fancy
+static constexpr uint32_t wait_t_max = 8000; // 80us
+
+enum class WaitKind {
+    // Output directly
+    Short,
+    // Output directly after writing some requests
+    Requests,
+    // Output in steps while waiting for requests
+    Long
+};
+
+// Decide how a wait is output.
+// This only depends on the previous waits in the sequence so that
+// it can be done ahead of time when compiling a sequence.
+static inline WaitKind
+classifyWait(uint64_t &wait_time, uint64_t t)
 {
-    const uint32_t flags = ControlBit::TimingCheck;
-    // If the wait time is too short, don't do anything fancy
-    static constexpr uint32_t t_max = 8000; // 80us
-    static constexpr auto t_sleep = 10us;
     if (t < Seq::PulseTime::_DDS) {
-        ctrler->shortPulse(0x20000000 | uint32_t(t) | flags, 0);
-        return;
-    } else if (t < t_max * 2) {
-        uint32_t t32 = uint32_t(t);
-        wait_time += t32;
+        return WaitKind::Short;
+    } else if (t < wait_t_max * 2) {
+        wait_time += uint32_t(t);
         if (wait_time > 8192 || t >= 1024) {
             wait_time = 0;
-            // Allocate 1.28us for each pulse (except the first one)
-            uint32_t max_requests = (t32 - Seq::PulseTime::_DDS) / 256 + 1;
-            t32 -= (uint32_t)ctrler->writeRequests(max_requests, false, flags);
-            if (release_after) {
-                ctrler->releaseHold();
-                release_after = false;
-            }
+            return WaitKind::Requests;
         }
-        ctrler->shortPulse(0x20000000 | t32 | flags, 0);
-        return;
+        return WaitKind::Short;
     }
     wait_time = 0;
+    return WaitKind::Long;
+}
+
+static inline uint32_t
+waitMaxRequests(uint32_t t)
+{
+    // Allocate 1.28us for each pulse (except the first one)
+    return (t - Seq::PulseTime::_DDS) / 256 + 1;
+}
+
+template<typename T>
+static inline __attribute__((flatten, hot)) void
+runRequestsWait(Controller *__restrict__ ctrler, uint32_t t,
+                uint32_t max_requests, T &&release_after)
+{
+    const uint32_t flags = ControlBit::TimingCheck;
+    t -= (uint32_t)ctrler->writeRequests(max_requests, false, flags);
+    if (release_after) {
+        ctrler->releaseHold();
+        release_after = false;
+    }
+    ctrler->shortPulse(0x20000000 | t | flags, 0);
+}
+
+template<typename T>
+static inline __attribute__((flatten, hot)) void
+runLongWait(Controller *__restrict__ ctrler, uint64_t t, T &&release_after)
+{
+    const uint32_t flags = ControlBit::TimingCheck;
+    static constexpr auto t_sleep = 10us;
     while (true) {
         // Proceed 80us each time. If no requests are written, sleep for
         // 10us to wait for new request in order to minimize request latency
         // Also unblock the queue if some requests are written.
-        if (t >= 2 * t_max) {
-            static constexpr uint32_t max_requests = t_max / 1000;
+        if (t >= 2 * wait_t_max) {
+            static constexpr uint32_t max_requests = wait_t_max / 1000;
             auto t_write = uint32_t(ctrler->writeRequests(max_requests,
                                                           true, flags));
-            auto t_step = t_max - t_write;
+            auto t_step = wait_t_max - t_write;
             ctrler->shortPulse(0x20000000 | t_step | flags, 0);
             if (!t_write) {
                 std::this_thread::sleep_for(t_sleep);
@@ -80,7 +112,7 @@ runWait(Controller *__restrict__ ctrler, uint64_t &wait_time, uint64_t t,
                 ctrler->releaseHold();
                 release_after = false;
             }
-            t -= t_max;
+            t -= wait_t_max;
         } else {
             ctrler->shortPulse(0x20000000 | uint32_t(t) | flags, 0);
             break;
@@ -88,8 +120,29 @@ runWait(Controller *__restrict__ ctrler, uint64_t &wait_time, uint64_t t,
     }
 }
 
+template<typename T>
+static inline __attribute__((flatten, hot)) void
+runWait(Controller *__restrict__ ctrler, uint64_t &wait_time, uint64_t t,
+        T &&release_after)
+{
+    switch (classifyWait(wait_time, t)) {
+    case WaitKind::Short:
+        ctrler->shortPulse(0x20000000 | uint32_t(t) | ControlBit::TimingCheck,
+                           0);
+        return;
+    case WaitKind::Requests:
+        runRequestsWait(ctrler, uint32_t(t), waitMaxRequests(uint32_t(t)),
+                        release_after);
+        return;
+    case WaitKind::Long:
+        runLongWait(ctrler, t, release_after);
+        return;
+    }
+}
+
+template<typename Out>
 static inline __attribute__((flatten, hot)) void
-runTTLMeta(Controller *__restrict__ ctrler, CtrlState *__restrict__ state,
+runTTLMeta(Out *__restrict__ ctrler, CtrlState *__restrict__ state,
            uint32_t ttl_ctrl, uint32_t ttl_val)
 {
     uint32_t ttl_addr = ttl_ctrl & ControlBit::TTLAll;
@@ -110,14 +163,57 @@ combTime(uint64_t ctrl, uint32_t op)
 }
 
 static inline __attribute__((flatten, hot)) void
-runMetaInstruction(Controller *__restrict__ ctrler,
+outputWait(Controller *__restrict__ ctrler, uint64_t &wait_time, uint64_t t)
+{
+    runWait(ctrler, wait_time, t, false);
+}
+
+namespace {
+
+// Records the pulses of an instruction list instead of writing them.
+struct SeqCompiler {
+    CompiledSeq &seq;
+    inline void
+    shortPulse(uint32_t ctrl, uint32_t op)
+    {
+        seq.pulses.emplace_back(ctrl, op);
+    }
+    inline void
+    wait(uint64_t &wait_time, uint64_t t)
+    {
+        switch (classifyWait(wait_time, t)) {
+        case WaitKind::Short:
+            shortPulse(0x20000000 | uint32_t(t) | ControlBit::TimingCheck, 0);
+            return;
+        case WaitKind::Requests:
+            seq.waits.push_back({seq.pulses.size(), t,
+                        waitMaxRequests(uint32_t(t))});
+            return;
+        case WaitKind::Long:
+            seq.waits.push_back({seq.pulses.size(), t, 0});
+            return;
+        }
+    }
+};
+
+}
+
+static inline void
+outputWait(SeqCompiler *__restrict__ compiler, uint64_t &wait_time, uint64_t t)
+{
+    compiler->wait(wait_time, t);
+}
+
+template<typename Out>
+static inline __attribute__((flatten, hot)) void
+runMetaInstruction(Out *__restrict__ ctrler,
                    CtrlState *__restrict__ state, uint32_t ctrl, uint32_t op)
 {
     switch (ctrl & ControlBit::MetaInstMask) {
     case ControlBit::WaitMeta:
         // After removing the Meta bits, the maximum time is
         // 2^(32 + 24) * 10ns ~ 22 years. Hopefully that's enough...
-        runWait(ctrler, state->wait_time, combTime(ctrl, op), false);
+        outputWait(ctrler, state->wait_time, combTime(ctrl, op));
         break;
     case ControlBit::DDSSetPhaseMeta:
         // Truncate ctrl to 16 bits to get phase
@@ -138,8 +234,9 @@ runMetaInstruction(Controller *__restrict__ ctrler,
     }
 }
 
+template<typename Out>
 static inline __attribute__((flatten, hot)) void
-runInstruction(Controller *__restrict__ ctrler, CtrlState *__restrict__ state,
+runInstruction(Out *__restrict__ ctrler, CtrlState *__restrict__ state,
                const Instruction *__restrict__ inst)
 {
     uint32_t ctrl = inst->ctrl;
@@ -151,31 +248,411 @@ runInstruction(Controller *__restrict__ ctrler, CtrlState *__restrict__ state,
     }
 }
 
+// Run the instructions and replay the bodies of the loops.
+// The state carries over from one iteration to the next.
+template<typename Out>
+static inline __attribute__((flatten, hot)) void
+runInstructions(Out *__restrict__ ctrler, CtrlState *__restrict__ state,
+                const Instruction *__restrict__ inst, size_t n)
+{
+    // Iterations left in each of the loops being run
+    uint32_t loops[max_loop_depth];
+    unsigned depth = 0;
+    for (size_t i = 0;i < n;i++) {
+        auto cur_inst = inst + i;
+        __builtin_prefetch(cur_inst + 2);
+        uint32_t ctrl = cur_inst->ctrl;
+        if ((ctrl & ControlBit::InstMask) == ControlBit::MetaCmd) {
+            switch (ctrl & ControlBit::MetaInstMask) {
+            case ControlBit::LoopStartMeta:
+                loops[depth++] = cur_inst->op;
+                continue;
+            case ControlBit::LoopEndMeta:
+                if (--loops[depth - 1]) {
+                    // Back to the first instruction of the body
+                    i -= cur_inst->op + 1;
+                } else {
+                    depth--;
+                }
+                continue;
+            default:
+                break;
+            }
+        }
+        runInstruction(ctrler, state, cur_inst);
+    }
+}
+
 NACS_EXPORT() void
 runInstructionList(Controller *__restrict__ ctrler,
                    CtrlState *__restrict__ state,
                    const Instruction *__restrict__ inst, size_t n)
 {
+    runInstructions(ctrler, state, inst, n);
+    ctrler->shortPulse(0x20000000 | Seq::PulseTime::Min, 0);
+}
+
+NACS_EXPORT() PackedInstList
+packInstructionList(const Instruction *__restrict__ inst, size_t n)
+{
+    PackedInstList list;
+    auto &words = list.words;
+    words.reserve(n * 3 / 2 + 2);
+    list.ninsts = n;
+    // The instruction the next wait can be merged into, `-1` for none.
+    size_t last = size_t(-1);
+    // First word of the body of the open loops
+    size_t loops[max_loop_depth];
+    unsigned depth = 0;
     for (size_t i = 0;i < n;i++) {
-        auto cur_inst = inst + i;
-        __builtin_prefetch(cur_inst + 2);
-        runInstruction(ctrler, state, cur_inst);
+        uint32_t ctrl = inst[i].ctrl;
+        uint32_t op = inst[i].op;
+        auto push = [&] (size_t next_last) {
+            words.push_back(ctrl);
+            words.push_back(op);
+            last = next_last;
+        };
+        if ((ctrl & ControlBit::InstMask) != ControlBit::MetaCmd) {
+            // Always set when running the instruction
+            ctrl &= ~ControlBit::TimingCheck;
+            push(words.size());
+            continue;
+        }
+        switch (ctrl & ControlBit::MetaInstMask) {
+        case ControlBit::WaitMeta:
+            if (last != size_t(-1) && !(ctrl & ControlBit::MetaContentMask)) {
+                words[last] |= PackedInstList::WaitFollows;
+                words.push_back(op);
+                last = size_t(-1);
+            } else {
+                push(size_t(-1));
+            }
+            break;
+        case ControlBit::LoopStartMeta:
+            push(size_t(-1));
+            loops[depth++] = words.size();
+            break;
+        case ControlBit::LoopEndMeta:
+            // Distance back to the start of the body
+            op = uint32_t(words.size() - loops[--depth]);
+            push(size_t(-1));
+            break;
+        default:
+            push(words.size());
+            break;
+        }
+    }
+    return list;
+}
+
+NACS_EXPORT() void
+runInstructionList(Controller *__restrict__ ctrler,
+                   CtrlState *__restrict__ state, const PackedInstList &list)
+{
+    auto p = list.words.data();
+    auto end = p + list.words.size();
+    // Iterations left in each of the loops being run
+    uint32_t loops[max_loop_depth];
+    unsigned depth = 0;
+    while (p < end) {
+        __builtin_prefetch(p + 8);
+        uint32_t ctrl = p[0];
+        Instruction inst(ctrl & ~PackedInstList::WaitFollows, p[1]);
+        if ((ctrl & ControlBit::InstMask) == ControlBit::MetaCmd) {
+            switch (inst.ctrl & ControlBit::MetaInstMask) {
+            case ControlBit::LoopStartMeta:
+                loops[depth++] = inst.op;
+                p += 2;
+                continue;
+            case ControlBit::LoopEndMeta:
+                if (--loops[depth - 1]) {
+                    p -= inst.op;
+                } else {
+                    depth--;
+                    p += 2;
+                }
+                continue;
+            default:
+                break;
+            }
+        }
+        runInstruction(ctrler, state, &inst);
+        if (ctrl & PackedInstList::WaitFollows) {
+            outputWait(ctrler, state->wait_time, p[2]);
+            p += 3;
+        } else {
+            p += 2;
+        }
     }
     ctrler->shortPulse(0x20000000 | Seq::PulseTime::Min, 0);
 }
 
+NACS_EXPORT() void
+SeqChunkCompiler::compile(CompiledSeq &seq, const Instruction *__restrict__ inst,
+                          size_t n)
+{
+    seq.pulses.reserve(seq.pulses.size() + n + 1);
+    SeqCompiler compiler{seq};
+    runInstructions(&compiler, &m_state, inst, n);
+}
+
+NACS_EXPORT() void
+SeqChunkCompiler::finish(CompiledSeq &seq)
+{
+    SeqCompiler{seq}.shortPulse(0x20000000 | Seq::PulseTime::Min, 0);
+}
+
+NACS_EXPORT() CompiledSeq
+compileInstructionList(const Instruction *__restrict__ inst, size_t n)
+{
+    CompiledSeq seq;
+    SeqChunkCompiler compiler;
+    compiler.compile(seq, inst, n);
+    compiler.finish(seq);
+    seq.pulses.shrink_to_fit();
+    return seq;
+}
+
+namespace {
+
+// What `optimizeInstructionList` knows about the outputs of a DDS.
+struct KnownDDS {
+    bool freq_known = false;
+    bool amp_known = false;
+    // The output phase is the same as `phase`
+    bool phase_known = false;
+    // `phase` is the phase in the `CtrlState` at run time
+    bool phase_valid = true;
+    uint32_t freq = 0;
+    uint32_t amp = 0;
+    uint16_t phase = 0;
+    void
+    forget()
+    {
+        freq_known = amp_known = phase_known = false;
+    }
+};
+
+}
+
+NACS_EXPORT() OptimizeStats
+optimizeInstructionList(BlockBuilder &builder)
+{
+    OptimizeStats stats;
+    std::vector<Instruction> out;
+    out.reserve(builder.size());
+
+    // The waits (and removed pulses) not written out yet
+    uint64_t wait_t = 0;
+    size_t nwaits = 0;
+    auto flush = [&] {
+        if (wait_t)
+            out.push_back(InstWriter::wait(wait_t));
+        if (nwaits > 1)
+            stats.merged_waits += nwaits - 1;
+        wait_t = 0;
+        nwaits = 0;
+    };
+    auto remove = [&] (uint64_t t) {
+        stats.removed++;
+        stats.removed_t += t;
+        wait_t += t;
+    };
+    auto keep = [&] (const Instruction &inst) {
+        flush();
+        out.push_back(inst);
+    };
+
+    KnownDDS dds[22];
+    // A TTL meta instruction has set the outputs to `ttl`, the TTL state
+    // at run time, for the bits in `ttl_known`.
+    bool ttl_written = false;
+    uint32_t ttl = 0;
+    uint32_t ttl_known = 0;
+    // The state is different in each iteration of a loop.
+    auto forget = [&] {
+        for (auto &d: dds) {
+            d.forget();
+            d.phase_valid = false;
+        }
+        ttl_known = 0;
+    };
+    size_t loops[max_loop_depth];
+    unsigned depth = 0;
+
+    const uint32_t freq_ctrl = DDSSetFreq(0, 0).control();
+    const uint32_t amp_ctrl = DDSSetAmp(0, 0).control();
+    for (auto &inst: builder) {
+        uint32_t ctrl = inst.ctrl;
+        uint32_t op = inst.op;
+        if ((ctrl & ControlBit::InstMask) == 0x10000000) {
+            auto chn = (ctrl >> 4) & 0x1f;
+            if (chn >= 22) {
+                keep(inst);
+                continue;
+            }
+            auto &d = dds[chn];
+            if ((ctrl & ~0x1f0u) == freq_ctrl) {
+                if (d.freq_known && d.freq == op) {
+                    remove(Seq::PulseTime::DDSFreq);
+                    continue;
+                }
+                d.freq_known = true;
+                d.freq = op;
+            } else if ((ctrl & ~0x1f0u) == amp_ctrl) {
+                if (d.amp_known && d.amp == op) {
+                    remove(Seq::PulseTime::DDSAmp);
+                    continue;
+                }
+                d.amp_known = true;
+                d.amp = op;
+            } else {
+                d.forget();
+            }
+            keep(inst);
+            continue;
+        } else if ((ctrl & ControlBit::InstMask) == 0) {
+            // The output is not the TTL state anymore
+            ttl_written = false;
+            keep(inst);
+            continue;
+        } else if ((ctrl & ControlBit::InstMask) != ControlBit::MetaCmd) {
+            keep(inst);
+            continue;
+        }
+        switch (ctrl & ControlBit::MetaInstMask) {
+        case ControlBit::WaitMeta:
+            wait_t += combTime(ctrl, op);
+            nwaits++;
+            continue;
+        case ControlBit::LoopStartMeta:
+            keep(inst);
+            forget();
+            loops[depth++] = out.size();
+            continue;
+        case ControlBit::LoopEndMeta:
+            flush();
+            forget();
+            out.push_back(InstWriter::loopEnd(
+                              uint32_t(out.size() - loops[--depth])));
+            continue;
+        case ControlBit::DDSSetPhaseMeta:
+        case ControlBit::DDSShiftPhaseMeta: {
+            if (op >= 22) {
+                keep(inst);
+                continue;
+            }
+            auto &d = dds[op];
+            bool shift = (ctrl & ControlBit::MetaInstMask) ==
+                ControlBit::DDSShiftPhaseMeta;
+            if (shift && !d.phase_valid) {
+                d.phase_known = false;
+                keep(inst);
+                continue;
+            }
+            auto phase = uint16_t(shift ? ctrl + d.phase : ctrl);
+            if (d.phase_known && d.phase == phase) {
+                remove(Seq::PulseTime::DDSPhase);
+                continue;
+            }
+            d.phase_known = true;
+            d.phase_valid = true;
+            d.phase = phase;
+            keep(inst);
+            continue;
+        }
+        case ControlBit::DDSResetMeta:
+            if (op < 22) {
+                dds[op] = KnownDDS();
+            }
+            keep(inst);
+            continue;
+        case ControlBit::TTLMeta: {
+            uint32_t ttl_addr = ctrl & ControlBit::TTLAll;
+            uint32_t ttl_time = (ctrl & ControlBit::MetaContentMask) >> 18;
+            uint32_t mask;
+            uint32_t new_ttl;
+            if (ttl_addr == ControlBit::TTLAll) {
+                mask = 0xffffffff;
+                new_ttl = op;
+            } else {
+                mask = uint32_t(1) << ttl_addr;
+                new_ttl = setBit(ttl, uint8_t(ttl_addr), bool(op));
+            }
+            if (ttl_written && ttl_time >= Seq::PulseTime::Min &&
+                (ttl_known & mask) == mask && ((new_ttl ^ ttl) & mask) == 0) {
+                remove(ttl_time);
+                continue;
+            }
+            ttl_written = true;
+            ttl = new_ttl;
+            ttl_known |= mask;
+            keep(inst);
+            continue;
+        }
+        default:
+            keep(inst);
+            continue;
+        }
+    }
+    flush();
+    out.shrink_to_fit();
+    static_cast<std::vector<Instruction>&>(builder).swap(out);
+    return stats;
+}
+
+NACS_EXPORT() void
+runCompiledSeq(Controller *__restrict__ ctrler, const CompiledSeq &seq)
+{
+    auto pulses = seq.pulses.data();
+    size_t idx = 0;
+    auto stream = [&] (size_t end) {
+        for (;idx < end;idx++) {
+            ctrler->shortPulse(pulses[idx].ctrl, pulses[idx].op);
+        }
+    };
+    for (auto &wait: seq.waits) {
+        stream(wait.idx);
+        if (wait.max_requests) {
+            runRequestsWait(ctrler, uint32_t(wait.t), wait.max_requests, false);
+        } else {
+            runLongWait(ctrler, wait.t, false);
+        }
+    }
+    stream(seq.pulses.size());
+}
+
 namespace {
 
 struct ByteCodeRunner {
-    ByteCodeRunner(Controller *ctrler, uint32_t preserve_ttl, bool short_seq)
+    // @prev_end is the time the previous sequence in the FIFO is expected to
+    // finish, `0` if the FPGA is held (see `runByteCode`).
+    ByteCodeRunner(Controller *ctrler, uint32_t preserve_ttl, bool short_seq,
+                   SlackStats *stats=nullptr, LeadController *lead=nullptr,
+                   uint64_t prev_end=0)
         : ctrler(ctrler),
           preserve_ttl(preserve_ttl),
-          short_seq(short_seq)
+          short_seq(short_seq),
+          m_stats(stats),
+          m_lead(lead),
+          // The FPGA is already running, this sequence starts when
+          // the previous one ends.
+          m_released(prev_end != 0),
+          // The adaptive lead can be much shorter than the resolution of
+          // the coarse clock.
+          m_start_t(prev_end ? max(prev_end, getTime()) :
+                    lead ? getTime() : getCoarseTime())
     {
+        m_release_rt = m_start_t;
+        if (lead) {
+            lead->startSeq();
+        }
     }
     void ttl(uint32_t ttl, uint64_t t)
     {
         ttl = ttl | preserve_ttl;
+        last_ttl = ttl;
+        has_ttl = true;
         if (t <= 1000) {
             // 10us
             m_t += t;
@@ -240,15 +717,29 @@ struct ByteCodeRunner {
             return;
         }
         while (true) {
-            // Now we always make sure that the sequence time is at least 0.5s ahead of
-            // the real time.
-            auto tnow = getCoarseTime();
+            // Now we always make sure that the sequence time is at least
+            // 0.5s (or the lead from `m_lead`) ahead of the real time.
+            auto tnow = m_lead ? getTime() : getCoarseTime();
+            if (m_stats || m_lead) {
+                int64_t slack = 0;
+                if (m_released) {
+                    // The FPGA started running the sequence at `m_release_rt`.
+                    slack = (int64_t(m_t * 10) -
+                             int64_t((m_lead ? tnow : getTime()) - m_release_rt));
+                    if (m_stats) {
+                        m_stats->add(slack);
+                    }
+                }
+                if (m_lead) {
+                    m_lead->update(tnow, m_released, slack);
+                }
+            }
             // Current sequence time in real time.
             auto seq_rt = m_start_t + m_t * 10;
             // We need to output to this time before processing commands.
-            auto thresh_rt = tnow + m_min_t;
+            auto thresh_rt = tnow + (m_lead ? m_lead->lead() : m_min_t);
             if (seq_rt < thresh_rt) {
-                auto min_seqt = max((seq_rt - thresh_rt) / 10, 10000);
+                auto min_seqt = max((thresh_rt - seq_rt) / 10, 10000);
                 if (t <= min_seqt + 3000) {
                     output_wait(t);
                     return;
@@ -264,6 +755,7 @@ struct ByteCodeRunner {
                 output_wait(1000);
                 t -= 1000;
                 ctrler->releaseHold();
+                m_release_rt = getTime();
             }
             // We have time to do something else
             uint32_t max_requests = t >= 7000 ? 8 : uint32_t(t / 1000 + 1);
@@ -275,35 +767,695 @@ struct ByteCodeRunner {
             } else {
                 // Didn't find much to do. Sleep for a while
                 using namespace std::literals;
-                std::this_thread::sleep_for(1ms);
+                if (m_lead) {
+                    std::this_thread::sleep_for(
+                        std::chrono::nanoseconds(m_lead->sleepTime()));
+                } else {
+                    std::this_thread::sleep_for(1ms);
+                }
             }
         }
     }
 
+    // Wait for @t starting at sequence time @start, used when the pulses
+    // before it were written directly.
+    void waitAt(uint64_t start, uint64_t t)
+    {
+        m_t = start;
+        wait(t);
+    }
+
+    // Real time at which the FPGA is expected to finish the sequence of
+    // length @len. If the hold wasn't released yet it is assumed to be
+    // released now.
+    uint64_t endTime(uint64_t len) const
+    {
+        return ((m_released ? m_release_rt : getTime()) +
+                (len + Seq::PulseTime::Min) * 10);
+    }
+    // Current sequence time.
+    uint64_t seqTime() const
+    {
+        return m_t;
+    }
+
+    // TTL output at the end of the sequence.
+    // Only valid if the sequence sets the TTL at all.
+    uint32_t last_ttl{0};
+    bool has_ttl{false};
 private:
     Controller *ctrler;
     const uint32_t preserve_ttl;
     const bool short_seq;
-    bool m_released{false};
+    SlackStats *const m_stats;
+    LeadController *const m_lead;
+    bool m_released;
     uint64_t m_t{0};
-    const uint64_t m_start_t{getCoarseTime()};
+    // Real time when the FPGA starts the sequence.
+    uint64_t m_release_rt;
+    // Real time of sequence time `0`, used to decide how far ahead we are.
+    const uint64_t m_start_t;
     // Minimum time we stay ahead of the sequence.
     const uint64_t m_min_t{max(getCoarseRes() * 20, 500000000)}; // 0.5s
 };
 
+// Only adds up the length of the sequence.
+struct ByteCodeChecker {
+    uint64_t m_t{0};
+    void ttl(uint32_t, uint64_t t)
+    {
+        m_t += t;
+    }
+    void dds_freq(uint8_t, uint32_t)
+    {
+        m_t += Seq::PulseTime::DDSFreq;
+    }
+    void dds_amp(uint8_t, uint16_t)
+    {
+        m_t += Seq::PulseTime::DDSAmp;
+    }
+    void dac(uint8_t, uint16_t)
+    {
+        m_t += Seq::PulseTime::DAC;
+    }
+    void clock(uint8_t)
+    {
+        m_t += Seq::PulseTime::Clock;
+    }
+    void wait(uint64_t t)
+    {
+        m_t += t;
+    }
+};
+
+// Records the calls from the bytecode interpreter.
+struct ByteCodeDecoder {
+    DecodedByteCode &decoded;
+    inline void
+    push(DecodedByteCode::Type type, uint8_t chn, uint32_t val, uint64_t t)
+    {
+        decoded.pulses.push_back({type, chn, val, t});
+    }
+    void ttl(uint32_t ttl, uint64_t t)
+    {
+        push(DecodedByteCode::TTL, 0, ttl, t);
+    }
+    void dds_freq(uint8_t chn, uint32_t freq)
+    {
+        push(DecodedByteCode::DDSFreq, chn, freq, 0);
+    }
+    void dds_amp(uint8_t chn, uint16_t amp)
+    {
+        push(DecodedByteCode::DDSAmp, chn, amp, 0);
+    }
+    void dac(uint8_t chn, uint16_t V)
+    {
+        push(DecodedByteCode::DAC, chn, V, 0);
+    }
+    void clock(uint8_t period)
+    {
+        push(DecodedByteCode::Clock, 0, period, 0);
+    }
+    void wait(uint64_t t)
+    {
+        push(DecodedByteCode::Wait, 0, 0, t);
+    }
+};
+
+// Encodes the calls from the bytecode interpreter the same way as
+// `ByteCodeRunner` except for the long waits and the preserved TTL channels.
+// The words and the long waits are passed to @sink.
+template<typename Sink>
+struct ByteCodeEncoder {
+    Sink &sink;
+    uint64_t m_t{0};
+    uint32_t last_ttl{0};
+    bool has_ttl{false};
+    inline void
+    shortPulse(uint32_t ctrl, uint32_t op)
+    {
+        sink.shortPulse(ctrl, op);
+    }
+    void ttl(uint32_t ttl, uint64_t t)
+    {
+        last_ttl = ttl;
+        has_ttl = true;
+        if (t <= 1000) {
+            m_t += t;
+            checkedShortPulse(this, (uint32_t)t, ttl);
+        }
+        else {
+            m_t += 100;
+            checkedShortPulse(this, 100, ttl);
+            wait(t - 100);
+        }
+    }
+    void dds_freq(uint8_t chn, uint32_t freq)
+    {
+        m_t += Seq::PulseTime::DDSFreq;
+        checkedShortPulse(this, DDSSetFreq(chn, freq));
+    }
+    void dds_amp(uint8_t chn, uint16_t amp)
+    {
+        m_t += Seq::PulseTime::DDSAmp;
+        checkedShortPulse(this, DDSSetAmp(chn, amp));
+    }
+    void dac(uint8_t chn, uint16_t V)
+    {
+        m_t += Seq::PulseTime::DAC;
+        checkedShortPulse(this, DACSetVolt(chn, V));
+    }
+    void clock(uint8_t period)
+    {
+        m_t += Seq::PulseTime::Clock;
+        checkedShortPulse(this, ClockOut(period));
+    }
+    void wait(uint64_t t)
+    {
+        if (t < 2000) {
+            m_t += t;
+            shortPulse(0x20000000 | uint32_t(t) | ControlBit::TimingCheck, 0);
+            return;
+        }
+        sink.waitPoint(m_t, t);
+        m_t += t;
+    }
+    void finish()
+    {
+        shortPulse(0x20000000 | Seq::PulseTime::Min, 0);
+        sink.finish(has_ttl, last_ttl, m_t);
+    }
+};
+
+struct EncodedSink {
+    EncodedByteCode &encoded;
+    inline void
+    shortPulse(uint32_t ctrl, uint32_t op)
+    {
+        encoded.words.emplace_back(ctrl, op);
+    }
+    void waitPoint(uint64_t start, uint64_t t)
+    {
+        encoded.waits.push_back({encoded.words.size(), start, t});
+    }
+    void finish(bool has_ttl, uint32_t last_ttl, uint64_t len)
+    {
+        encoded.has_ttl = has_ttl;
+        encoded.last_ttl = last_ttl;
+        encoded.len = len;
+        encoded.words.shrink_to_fit();
+        encoded.waits.shrink_to_fit();
+    }
+};
+
+template<typename Sink>
+static void
+encodeDecoded(Sink &sink, const DecodedByteCode &decoded)
+{
+    ByteCodeEncoder<Sink> encoder{sink};
+    for (auto &pulse: decoded.pulses) {
+        switch (pulse.type) {
+        case DecodedByteCode::TTL:
+            encoder.ttl(pulse.val, pulse.t);
+            break;
+        case DecodedByteCode::DDSFreq:
+            encoder.dds_freq(pulse.chn, pulse.val);
+            break;
+        case DecodedByteCode::DDSAmp:
+            encoder.dds_amp(pulse.chn, uint16_t(pulse.val));
+            break;
+        case DecodedByteCode::DAC:
+            encoder.dac(pulse.chn, uint16_t(pulse.val));
+            break;
+        case DecodedByteCode::Clock:
+            encoder.clock(uint8_t(pulse.val));
+            break;
+        case DecodedByteCode::Wait:
+            encoder.wait(pulse.t);
+            break;
+        }
+    }
+    encoder.finish();
+}
+
+template<typename Sink>
+static void
+encodeByteCode(Sink &sink, const uint8_t *__restrict__ code, size_t code_len)
+{
+    ByteCodeEncoder<Sink> encoder{sink};
+    Seq::ByteCode::ExeState exestate;
+    exestate.run(encoder, code, code_len);
+    encoder.finish();
 }
 
-NACS_EXPORT() __attribute__((flatten, hot))
-void runByteCode(Controller *__restrict__ ctrler, const uint8_t *__restrict__ code,
-                 size_t code_len, uint32_t ttl_mask, bool short_seq)
+}
+
+static inline uint32_t
+preservedTTL(Controller *__restrict__ ctrler, uint32_t ttl_mask)
 {
-    uint32_t preserve_ttl = 0;
     if (~ttl_mask != 0)
-        preserve_ttl = (~ttl_mask) & ctrler->getCurTTL();
-    ByteCodeRunner runner{ctrler, preserve_ttl, short_seq};
+        return (~ttl_mask) & ctrler->getCurTTL();
+    return 0;
+}
+
+static inline uint32_t
+preservedTTL(Controller *__restrict__ ctrler, uint32_t ttl_mask,
+             const uint32_t *cur_ttl)
+{
+    if (!cur_ttl)
+        return preservedTTL(ctrler, ttl_mask);
+    return (~ttl_mask) & *cur_ttl;
+}
+
+NACS_EXPORT() __attribute__((flatten, hot))
+uint32_t runByteCode(Controller *__restrict__ ctrler,
+                     const uint8_t *__restrict__ code, size_t code_len,
+                     uint32_t ttl_mask, bool short_seq, const uint32_t *cur_ttl,
+                     SlackStats *stats, LeadController *lead, uint64_t *end_t)
+{
+    ByteCodeRunner runner{ctrler, preservedTTL(ctrler, ttl_mask, cur_ttl),
+                          short_seq, stats, lead, end_t ? *end_t : 0};
     Seq::ByteCode::ExeState exestate;
     exestate.run(runner, code, code_len);
     ctrler->shortPulse(0x20000000 | Seq::PulseTime::Min, 0);
+    if (end_t)
+        *end_t = runner.endTime(runner.seqTime());
+    if (runner.has_ttl)
+        return runner.last_ttl;
+    return cur_ttl ? *cur_ttl : ctrler->getCurTTL();
+}
+
+NACS_EXPORT() DecodedByteCode
+decodeByteCode(const uint8_t *__restrict__ code, size_t code_len)
+{
+    DecodedByteCode decoded;
+    ByteCodeDecoder decoder{decoded};
+    Seq::ByteCode::ExeState exestate;
+    exestate.run(decoder, code, code_len);
+    decoded.pulses.shrink_to_fit();
+    return decoded;
+}
+
+NACS_EXPORT() uint64_t
+checkByteCode(const uint8_t *__restrict__ code, size_t code_len)
+{
+    ByteCodeChecker checker;
+    Seq::ByteCode::ExeState exestate;
+    exestate.run(checker, code, code_len);
+    return checker.m_t;
+}
+
+NACS_EXPORT() __attribute__((flatten, hot))
+uint32_t runByteCode(Controller *__restrict__ ctrler,
+                     const DecodedByteCode &decoded, uint32_t ttl_mask,
+                     bool short_seq, const uint32_t *cur_ttl,
+                     SlackStats *stats, LeadController *lead, uint64_t *end_t)
+{
+    ByteCodeRunner runner{ctrler, preservedTTL(ctrler, ttl_mask, cur_ttl),
+                          short_seq, stats, lead, end_t ? *end_t : 0};
+    bool has_ttl = false;
+    for (auto &pulse: decoded.pulses) {
+        switch (pulse.type) {
+        case DecodedByteCode::TTL:
+            runner.ttl(pulse.val, pulse.t);
+            has_ttl = true;
+            break;
+        case DecodedByteCode::DDSFreq:
+            runner.dds_freq(pulse.chn, pulse.val);
+            break;
+        case DecodedByteCode::DDSAmp:
+            runner.dds_amp(pulse.chn, uint16_t(pulse.val));
+            break;
+        case DecodedByteCode::DAC:
+            runner.dac(pulse.chn, uint16_t(pulse.val));
+            break;
+        case DecodedByteCode::Clock:
+            runner.clock(uint8_t(pulse.val));
+            break;
+        case DecodedByteCode::Wait:
+            runner.wait(pulse.t);
+            break;
+        }
+    }
+    ctrler->shortPulse(0x20000000 | Seq::PulseTime::Min, 0);
+    if (end_t)
+        *end_t = runner.endTime(runner.seqTime());
+    if (has_ttl)
+        return runner.last_ttl;
+    return cur_ttl ? *cur_ttl : ctrler->getCurTTL();
+}
+
+NACS_EXPORT() EncodedByteCode
+encodeByteCode(const uint8_t *__restrict__ code, size_t code_len)
+{
+    EncodedByteCode encoded;
+    EncodedSink sink{encoded};
+    encodeByteCode(sink, code, code_len);
+    return encoded;
+}
+
+NACS_EXPORT() EncodedByteCode
+encodeByteCode(const DecodedByteCode &decoded)
+{
+    EncodedByteCode encoded;
+    encoded.words.reserve(decoded.pulses.size() + 1);
+    EncodedSink sink{encoded};
+    encodeDecoded(sink, decoded);
+    return encoded;
+}
+
+NACS_EXPORT() __attribute__((flatten, hot))
+uint32_t runByteCode(Controller *__restrict__ ctrler,
+                     const EncodedByteCode &code, uint32_t ttl_mask,
+                     bool short_seq, const uint32_t *cur_ttl,
+                     SlackStats *stats, LeadController *lead, uint64_t *end_t)
+{
+    auto preserve = preservedTTL(ctrler, ttl_mask, cur_ttl);
+    ByteCodeRunner runner{ctrler, preserve, short_seq, stats, lead,
+                          end_t ? *end_t : 0};
+    auto words = code.words.data();
+    size_t idx = 0;
+    auto stream = [&] (size_t end) {
+        if (!preserve) {
+            for (;idx < end;idx++)
+                ctrler->shortPulse(words[idx].ctrl, words[idx].op);
+            return;
+        }
+        // Merge a block at a time and then write it with a tight loop.
+        constexpr size_t block_size = 256;
+        uint32_t buff[block_size * 2];
+        while (idx < end) {
+            auto n = min(end - idx, block_size);
+            mergeTTL(buff, words + idx, n, preserve);
+            for (size_t i = 0;i < n;i++)
+                ctrler->shortPulse(buff[2 * i], buff[2 * i + 1]);
+            idx += n;
+        }
+    };
+    for (auto &wait: code.waits) {
+        stream(wait.idx);
+        runner.waitAt(wait.start, wait.t);
+    }
+    stream(code.words.size());
+    if (end_t)
+        *end_t = runner.endTime(code.len);
+    if (code.has_ttl)
+        return code.last_ttl | preserve;
+    return cur_ttl ? *cur_ttl : ctrler->getCurTTL();
+}
+
+struct ByteCodePipeline::Chunk {
+    static constexpr uint32_t size = 512;
+    uint32_t nwords;
+    bool last;
+    // Only valid in the last chunk
+    bool has_ttl;
+    uint32_t last_ttl;
+    uint64_t len;
+    // The long wait after the words, `wait_t` is `0` if there isn't one.
+    uint64_t wait_start;
+    uint64_t wait_t;
+    // `ctrl`, `op` pairs
+    uint32_t words[size * 2];
+};
+
+// Number of chunks in the ring (power of 2).
+static constexpr uint32_t pipeline_nchunks = 64;
+
+static inline void
+spinWait(uint32_t &nspin)
+{
+    // Don't waste the time slice when there's only one CPU.
+    if (++nspin > 64) {
+        std::this_thread::yield();
+    }
+    else {
+        CPU::pause();
+    }
+}
+
+struct ByteCodePipeline::ChunkSink {
+    ByteCodePipeline &pipeline;
+    EncodedByteCode *encoded;
+    uint32_t m_idx{pipeline.m_write_idx.load(std::memory_order_relaxed)};
+    Chunk *cur{acquire()};
+    Chunk *acquire()
+    {
+        uint32_t nspin = 0;
+        while (m_idx - pipeline.m_read_idx.load(std::memory_order_acquire) >=
+               pipeline_nchunks)
+            spinWait(nspin);
+        auto chunk = &pipeline.m_chunks[m_idx & (pipeline_nchunks - 1)];
+        chunk->nwords = 0;
+        chunk->last = false;
+        chunk->wait_t = 0;
+        return chunk;
+    }
+    void publish()
+    {
+        m_idx++;
+        pipeline.m_write_idx.store(m_idx, std::memory_order_release);
+        cur = cur->last ? nullptr : acquire();
+    }
+    inline void
+    shortPulse(uint32_t ctrl, uint32_t op)
+    {
+        if (unlikely(cur->nwords >= Chunk::size))
+            publish();
+        cur->words[cur->nwords * 2] = ctrl;
+        cur->words[cur->nwords * 2 + 1] = op;
+        cur->nwords++;
+        if (encoded) {
+            encoded->words.emplace_back(ctrl, op);
+        }
+    }
+    void waitPoint(uint64_t start, uint64_t t)
+    {
+        cur->wait_start = start;
+        cur->wait_t = t;
+        publish();
+        if (encoded) {
+            encoded->waits.push_back({encoded->words.size(), start, t});
+        }
+    }
+    void finish(bool has_ttl, uint32_t last_ttl, uint64_t len)
+    {
+        cur->last = true;
+        cur->has_ttl = has_ttl;
+        cur->last_ttl = last_ttl;
+        cur->len = len;
+        publish();
+        if (encoded) {
+            EncodedSink{*encoded}.finish(has_ttl, last_ttl, len);
+        }
+    }
+    // Drop the words of the current chunk and stop the runner,
+    // which rethrows the error after it has seen the last chunk.
+    void fail()
+    {
+        if (!cur)
+            return;
+        cur->nwords = 0;
+        cur->wait_t = 0;
+        cur->last = true;
+        publish();
+    }
+};
+
+NACS_EXPORT() ByteCodePipeline::ByteCodePipeline(const ThreadConfig &config)
+    : m_chunks(new Chunk[pipeline_nchunks]),
+      m_thread(&ByteCodePipeline::decodeLoop, this, config)
+{
+}
+
+NACS_EXPORT() ByteCodePipeline::~ByteCodePipeline()
+{
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+    delete[] m_chunks;
+}
+
+void
+ByteCodePipeline::decodeLoop(ThreadConfig config)
+{
+    config.apply("Bytecode decoder");
+    std::unique_lock<std::mutex> locker(m_lock);
+    while (true) {
+        m_cond.wait(locker, [&] {
+                return m_quit || m_busy;
+            });
+        if (m_quit)
+            return;
+        locker.unlock();
+        ChunkSink sink{*this, m_encoded};
+        std::exception_ptr error;
+        try {
+            if (m_decoded) {
+                encodeDecoded(sink, *m_decoded);
+            }
+            else {
+                encodeByteCode(sink, m_code, m_code_len);
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+            sink.fail();
+        }
+        locker.lock();
+        m_error = error;
+        m_code = nullptr;
+        m_decoded = nullptr;
+        m_encoded = nullptr;
+        m_busy = false;
+        m_cond.notify_all();
+    }
+}
+
+NACS_EXPORT() uint32_t
+ByteCodePipeline::run(Controller *__restrict__ ctrler, const uint8_t *code,
+                      size_t code_len, uint32_t ttl_mask, bool short_seq,
+                      const uint32_t *cur_ttl, SlackStats *stats,
+                      LeadController *lead, EncodedByteCode *encoded,
+                      uint64_t *end_t)
+{
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_code = code;
+        m_code_len = code_len;
+        m_encoded = encoded;
+        m_busy = true;
+    }
+    m_cond.notify_all();
+    return run(ctrler, ttl_mask, short_seq, cur_ttl, stats, lead, end_t);
+}
+
+NACS_EXPORT() uint32_t
+ByteCodePipeline::run(Controller *__restrict__ ctrler,
+                      const DecodedByteCode &decoded, uint32_t ttl_mask,
+                      bool short_seq, const uint32_t *cur_ttl,
+                      SlackStats *stats, LeadController *lead, uint64_t *end_t)
+{
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_decoded = &decoded;
+        m_busy = true;
+    }
+    m_cond.notify_all();
+    return run(ctrler, ttl_mask, short_seq, cur_ttl, stats, lead, end_t);
+}
+
+__attribute__((flatten, hot)) uint32_t
+ByteCodePipeline::run(Controller *__restrict__ ctrler, uint32_t ttl_mask,
+                      bool short_seq, const uint32_t *cur_ttl,
+                      SlackStats *stats, LeadController *lead, uint64_t *end_t)
+{
+    auto preserve = preservedTTL(ctrler, ttl_mask, cur_ttl);
+    ByteCodeRunner runner{ctrler, preserve, short_seq, stats, lead,
+                          end_t ? *end_t : 0};
+    auto idx = m_read_idx.load(std::memory_order_relaxed);
+    bool has_ttl;
+    uint32_t last_ttl;
+    uint64_t len;
+    while (true) {
+        uint32_t nspin = 0;
+        while (m_write_idx.load(std::memory_order_acquire) == idx)
+            spinWait(nspin);
+        auto chunk = &m_chunks[idx & (pipeline_nchunks - 1)];
+        auto words = chunk->words;
+        auto n = chunk->nwords;
+        if (preserve) {
+            uint32_t buff[Chunk::size * 2];
+            mergeTTL(buff, words, n, preserve);
+            for (uint32_t i = 0;i < n;i++) {
+                ctrler->shortPulse(buff[2 * i], buff[2 * i + 1]);
+            }
+        }
+        else {
+            for (uint32_t i = 0;i < n;i++) {
+                ctrler->shortPulse(words[2 * i], words[2 * i + 1]);
+            }
+        }
+        bool last = chunk->last;
+        has_ttl = chunk->has_ttl;
+        last_ttl = chunk->last_ttl;
+        len = chunk->len;
+        auto wait_start = chunk->wait_start;
+        auto wait_t = chunk->wait_t;
+        // Release the chunk before waiting so that the decoder can continue.
+        idx++;
+        m_read_idx.store(idx, std::memory_order_release);
+        if (last)
+            break;
+        if (wait_t) {
+            runner.waitAt(wait_start, wait_t);
+        }
+    }
+    std::exception_ptr error;
+    {
+        // Wait for the decoder to finish writing @encoded.
+        std::unique_lock<std::mutex> locker(m_lock);
+        m_cond.wait(locker, [&] { return !m_busy; });
+        std::swap(error, m_error);
+    }
+    if (error)
+        std::rethrow_exception(error);
+    if (end_t)
+        *end_t = runner.endTime(len);
+    if (has_ttl)
+        return last_ttl | preserve;
+    return cur_ttl ? *cur_ttl : ctrler->getCurTTL();
+}
+
+NACS_EXPORT() void
+SlackStats::merge(const SlackStats &other)
+{
+    min_slack = min(min_slack, other.min_slack);
+    nsamples += other.nsamples;
+    nlow += other.nlow;
+    for (int i = 0;i < NBins;i++) {
+        hist[i] += other.hist[i];
+    }
+}
+
+NACS_EXPORT() LeadController::LeadController(uint64_t min_lead,
+                                             uint64_t max_lead)
+    : m_min_lead(min_lead),
+      m_max_lead(max_lead),
+      m_lead(max_lead)
+{
+}
+
+NACS_EXPORT() void
+LeadController::startSeq()
+{
+    // The time between sequences doesn't count.
+    m_last_t = 0;
+}
+
+NACS_EXPORT() void
+LeadController::update(uint64_t tnow, bool released, int64_t slack)
+{
+    if (m_last_t) {
+        auto gap = tnow - m_last_t;
+        m_max_gap = max(gap, m_max_gap - m_max_gap / 256);
+    }
+    m_last_t = tnow;
+    auto target = min(max(m_max_gap * 8, m_min_lead), m_max_lead);
+    if (released && slack < int64_t(m_lead / 4)) {
+        // We fell behind a lot more than expected.
+        m_nbackoff++;
+        m_lead = min(m_lead * 2, m_max_lead);
+    }
+    else if (target > m_lead) {
+        m_lead = target;
+    }
+    else {
+        m_lead -= (m_lead - target) / 32;
+    }
 }
 
 NACS_EXPORT() void runEpilogue(Controller *__restrict__ ctrler)
@@ -317,5 +1469,18 @@ NACS_EXPORT() void runEpilogue(Controller *__restrict__ ctrler)
     ctrler->run(Pulser::ClearTimingCheck());
 }
 
+NACS_EXPORT() bool
+prepareQueuedSeq(Controller *__restrict__ ctrler, uint64_t &end_t,
+                 uint64_t margin)
+{
+    if (end_t && getTime() + margin < end_t)
+        return true;
+    ctrler->waitFinish();
+    ctrler->setHold();
+    ctrler->toggleInit();
+    end_t = 0;
+    return false;
+}
+
 }
 }
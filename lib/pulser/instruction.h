@@ -2,9 +2,12 @@
 #define __NACS_PULSER_INSTRUCTION_H__
 
 #include "controller.h"
+#include "thread_config.h"
 
 #include <nacs-seq/seq.h>
 
+#include <array>
+#include <exception>
 #include <vector>
 
 namespace NaCs {
@@ -41,11 +44,16 @@ struct ControlBit {
     static constexpr uint32_t DDSShiftPhaseMeta = 0x2000000;
     static constexpr uint32_t DDSResetMeta = 0x4000000;
     static constexpr uint32_t TTLMeta = 0x5000000;
+    static constexpr uint32_t LoopStartMeta = 0x6000000;
+    static constexpr uint32_t LoopEndMeta = 0x7000000;
 
     static constexpr uint32_t TTLAll = 0x03ffff; // 18 bits
     static constexpr uint32_t MetaContentMask = ~(MetaInstMask | InstMask);
 };
 
+// Maximum nesting of the loops in an instruction list.
+static constexpr unsigned max_loop_depth = 16;
+
 struct CtrlState {
     uint16_t dds_phases[22];
     uint32_t curr_ttl;
@@ -150,12 +158,62 @@ public:
         accumTime(tp, cmd.length());
         return cmd;
     }
+    // Run the instructions up to the matching `loopEnd` @count (> 0) times.
+    static inline Instruction
+    loopStart(uint32_t count)
+    {
+        return Instruction(ControlBit::MetaCmd | ControlBit::LoopStartMeta,
+                           count);
+    }
+    // @len: number of instructions in the loop body.
+    static inline Instruction
+    loopEnd(uint32_t len)
+    {
+        return Instruction(ControlBit::MetaCmd | ControlBit::LoopEndMeta, len);
+    }
 };
 
+/**
+ * An instruction list packed into 32 bits words for storage.
+ *
+ * Each instruction is stored as its `ctrl` and `op` words. A wait (shorter
+ * than 2^32 cycles) right after another instruction is stored as a third
+ * word of that instruction, flagged by `WaitFollows` in `ctrl`.
+ * This removes most of the waits added by `BlockBuilder::pulseDT`.
+ * The bit is free since it's the timing check bit for the normal
+ * instructions (which is set when they run anyway) and unused by
+ * the meta instructions.
+ * The loop ends count the words instead of the instructions in the body.
+ */
+struct PackedInstList {
+    static constexpr uint32_t WaitFollows = ControlBit::TimingCheck;
+    std::vector<uint32_t> words;
+    // Number of instructions before packing.
+    size_t ninsts = 0;
+    inline size_t
+    cacheSize() const
+    {
+        return words.size() * sizeof(uint32_t) + sizeof(*this);
+    }
+};
+
+PackedInstList packInstructionList(const Instruction *__restrict__ inst,
+                                   size_t n);
+template<typename T>
+static inline PackedInstList
+packInstructionList(T &&v)
+{
+    return packInstructionList(v.data(), v.size());
+}
+
 void runInstructionList(Controller *__restrict__ ctrler,
                         CtrlState *__restrict__ state,
                         const Instruction *__restrict__ inst, size_t n);
-template<typename T>
+void runInstructionList(Controller *__restrict__ ctrler,
+                        CtrlState *__restrict__ state,
+                        const PackedInstList &list);
+template<typename T, class=std::enable_if_t<
+                         !std::is_same<std::decay_t<T>, PackedInstList>::value> >
 static inline void
 runInstructionList(Controller *__restrict__ ctrler,
                    CtrlState *__restrict__ state, T &&v)
@@ -163,14 +221,401 @@ runInstructionList(Controller *__restrict__ ctrler,
     runInstructionList(ctrler, state, v.data(), v.size());
 }
 
-void runByteCode(Controller *__restrict__ ctrler,
-                 const uint8_t *__restrict__ code, size_t code_len,
-                 uint32_t ttl_mask, bool short_seq);
+/**
+ * An instruction list lowered to the (ctrl, op) pairs written to the FIFO.
+ *
+ * All meta instructions except the waits that write requests from
+ * the request queue are resolved when compiling so that running the sequence
+ * is a plain stream of register writes that can be repeated.
+ * The phase and TTL states start from zero.
+ */
+struct CompiledSeq {
+    struct WaitPoint {
+        // Index of the first pulse after the wait
+        size_t idx;
+        uint64_t t;
+        // Maximum number of requests to write during the wait.
+        // `0` for long waits that are split into steps at run time.
+        uint32_t max_requests;
+    };
+    std::vector<Instruction> pulses;
+    std::vector<WaitPoint> waits;
+    inline size_t
+    cacheSize() const
+    {
+        return (pulses.size() * sizeof(Instruction) +
+                waits.size() * sizeof(WaitPoint) + sizeof(*this));
+    }
+    // Append the next piece of the same sequence (see `SeqChunkCompiler`).
+    inline void
+    append(const CompiledSeq &other)
+    {
+        auto offset = pulses.size();
+        pulses.insert(pulses.end(), other.pulses.begin(), other.pulses.end());
+        for (auto wait: other.waits) {
+            wait.idx += offset;
+            waits.push_back(wait);
+        }
+    }
+};
+
+CompiledSeq compileInstructionList(const Instruction *__restrict__ inst,
+                                   size_t n);
+
+/**
+ * Compile an instruction list in pieces (e.g. while it is being parsed).
+ * Each piece can be run with `runCompiledSeq` in order.
+ * Compiling the whole list as one piece and finishing it is the same as
+ * `compileInstructionList`.
+ * Loops are unrolled and must not cross the pieces.
+ */
+class SeqChunkCompiler {
+    CtrlState m_state{};
+public:
+    void compile(CompiledSeq &seq, const Instruction *__restrict__ inst,
+                 size_t n);
+    // Add the end of the sequence to the last piece.
+    void finish(CompiledSeq &seq);
+};
+template<typename T>
+static inline CompiledSeq
+compileInstructionList(T &&v)
+{
+    return compileInstructionList(v.data(), v.size());
+}
+void runCompiledSeq(Controller *__restrict__ ctrler, const CompiledSeq &seq);
+
+struct SlackStats;
+class LeadController;
+// Interpret and run the bytecode directly.
+// The optional arguments are the same as the `DecodedByteCode` version below.
+uint32_t runByteCode(Controller *__restrict__ ctrler,
+                     const uint8_t *__restrict__ code, size_t code_len,
+                     uint32_t ttl_mask, bool short_seq,
+                     const uint32_t *cur_ttl=nullptr, SlackStats *stats=nullptr,
+                     LeadController *lead=nullptr, uint64_t *end_t=nullptr);
+
+/**
+ * Bytecode decoded into a flat list of pulses so that running it again
+ * does not need to interpret the bytecode.
+ * The TTL mask is still applied when running.
+ */
+struct DecodedByteCode {
+    enum Type : uint8_t {
+        TTL,
+        DDSFreq,
+        DDSAmp,
+        DAC,
+        Clock,
+        Wait
+    };
+    struct Pulse {
+        Type type;
+        uint8_t chn;
+        uint32_t val;
+        uint64_t t;
+    };
+    std::vector<Pulse> pulses;
+    inline size_t
+    cacheSize() const
+    {
+        return pulses.size() * sizeof(Pulse) + sizeof(*this);
+    }
+};
+
+DecodedByteCode decodeByteCode(const uint8_t *__restrict__ code,
+                               size_t code_len);
+/**
+ * Run the bytecode interpreter without any output, e.g. to reject a bad
+ * sequence before it starts when it is only decoded while running.
+ * Throws the same errors as running the bytecode.
+ * Returns the length of the sequence in cycles.
+ */
+uint64_t checkByteCode(const uint8_t *__restrict__ code, size_t code_len);
+/**
+ * How far ahead of the FPGA the host stays while running a sequence,
+ * i.e. the length of the instructions in the FIFO that haven't run yet.
+ * The slack is sampled every time the runner checks the time in a long
+ * wait after the hold is released. For a sequence queued behind another
+ * one that is still running the slack is only correct if the end time of
+ * the previous sequence is passed to the runner.
+ */
+struct SlackStats {
+    // The first bin counts the samples where the FIFO was empty (slack <= 0),
+    // the last one the samples with more than 500ms of slack.
+    static constexpr int NBins = 11;
+    // Upper bound (in ns) of the histogram bin @i (< `NBins - 1`).
+    static inline int64_t
+    binEdge(int i)
+    {
+        static constexpr int64_t ms = 1000000;
+        static constexpr int64_t edges[NBins - 1] = {
+            0, 1 * ms, 2 * ms, 5 * ms, 10 * ms, 20 * ms, 50 * ms,
+            100 * ms, 200 * ms, 500 * ms};
+        return edges[i];
+    }
+
+    // Samples below this are counted in `nlow`.
+    uint64_t threshold_ns;
+    int64_t min_slack = INT64_MAX;
+    uint32_t nsamples = 0;
+    uint32_t nlow = 0;
+    std::array<uint32_t, NBins> hist{};
+
+    SlackStats(uint64_t threshold_ns=50000000)
+        : threshold_ns(threshold_ns)
+    {}
+    inline void
+    add(int64_t slack)
+    {
+        nsamples++;
+        if (slack < min_slack)
+            min_slack = slack;
+        if (slack < int64_t(threshold_ns))
+            nlow++;
+        int i = 0;
+        while (i < NBins - 1 && slack > binEdge(i))
+            i++;
+        hist[i]++;
+    }
+    void merge(const SlackStats &other);
+};
+
+/**
+ * Adaptive lead time for long bytecode sequences.
+ *
+ * Without a `LeadController` the runner stays at least 0.5s ahead of the FPGA
+ * and sleeps for 1ms when it has nothing to do. With one, the lead follows
+ * the longest time the runner spends between two checks of the clock. This
+ * includes writing the pulses in between, the sleep, the requests written in
+ * the waits and any scheduling delay, so it tracks the write throughput of
+ * the host. The lead is doubled whenever the slack drops below
+ * a quarter of it and decays slowly back to the target otherwise.
+ * The sleep time is a fraction of the lead.
+ *
+ * The state is kept across sequences so the same controller should be used
+ * for all the sequences run on a controller.
+ */
+class LeadController {
+public:
+    LeadController(uint64_t min_lead=10000000, uint64_t max_lead=500000000);
+    // Current lead in ns.
+    inline uint64_t
+    lead() const
+    {
+        return m_lead;
+    }
+    // How long to sleep (in ns) when there's nothing to do.
+    inline uint64_t
+    sleepTime() const
+    {
+        return min(max(m_lead / 16, uint64_t(50000)), uint64_t(1000000));
+    }
+    // Called before the sequence starts.
+    void startSeq();
+    // Called every time the runner checks the time (@tnow).
+    // @slack is only valid if @released is `true`.
+    void update(uint64_t tnow, bool released, int64_t slack);
+    // Number of times the lead was increased because of low slack.
+    inline uint32_t
+    numBackoffs() const
+    {
+        return m_nbackoff;
+    }
+private:
+    const uint64_t m_min_lead;
+    const uint64_t m_max_lead;
+    uint64_t m_lead;
+    uint64_t m_last_t = 0;
+    // Slowly decaying maximum of the time between two updates.
+    uint64_t m_max_gap = 0;
+    uint32_t m_nbackoff = 0;
+};
+
+/**
+ * Returns the TTL output at the end of the sequence.
+ * The channels not in @ttl_mask keep their value from @cur_ttl, or from
+ * the current hardware output if @cur_ttl is `nullptr`. Passing the return
+ * value of the previous sequence allows queueing a sequence behind
+ * another one that hasn't finished yet.
+ * The slack is added to @stats if it is not `nullptr`.
+ * The lead time is controlled by @lead if it is not `nullptr`,
+ * otherwise a fixed lead of 0.5s is used.
+ * If @end_t is not `nullptr` it is the time (from `getTime`) when
+ * the previous sequence is expected to finish on the FPGA, or `0` if the FPGA
+ * is held. The sequence is assumed to start at that time and @end_t is
+ * set to the time this sequence is expected to finish.
+ */
+uint32_t runByteCode(Controller *__restrict__ ctrler,
+                     const DecodedByteCode &decoded, uint32_t ttl_mask,
+                     bool short_seq, const uint32_t *cur_ttl=nullptr,
+                     SlackStats *stats=nullptr, LeadController *lead=nullptr,
+                     uint64_t *end_t=nullptr);
+
+/**
+ * Bytecode expanded into the words written to the FIFO.
+ *
+ * The waits shorter than 20us and the TTL pulses are split and encoded
+ * the same way as `runByteCode` does when running the bytecode directly.
+ * The longer waits are kept as `WaitPoint`s since they are where requests
+ * are written and where the lead time is managed.
+ * The channels preserved from the current TTL output are only known when
+ * the sequence runs so they are merged into the TTL words (see `mergeTTL`)
+ * just before they are written.
+ */
+struct EncodedByteCode {
+    struct WaitPoint {
+        // Index of the first word after the wait
+        size_t idx;
+        // Sequence time at the start of the wait
+        uint64_t start;
+        uint64_t t;
+    };
+    std::vector<Instruction> words;
+    std::vector<WaitPoint> waits;
+    // Length of the sequence in cycles
+    uint64_t len = 0;
+    // TTL output at the end of the sequence without the preserved channels.
+    // Only valid if `has_ttl`.
+    uint32_t last_ttl = 0;
+    bool has_ttl = false;
+    inline size_t
+    cacheSize() const
+    {
+        return (words.size() * sizeof(Instruction) +
+                waits.size() * sizeof(WaitPoint) + sizeof(*this));
+    }
+};
+
+EncodedByteCode encodeByteCode(const uint8_t *__restrict__ code,
+                               size_t code_len);
+EncodedByteCode encodeByteCode(const DecodedByteCode &decoded);
+
+/**
+ * Copy @n words to @out (as `ctrl`, `op` pairs) adding @preserve to
+ * the TTL words. This has no branches so that it can be vectorized.
+ */
+static inline void
+mergeTTL(uint32_t *__restrict__ out, const Instruction *__restrict__ in,
+         size_t n, uint32_t preserve)
+{
+    for (size_t i = 0;i < n;i++) {
+        auto ctrl = in[i].ctrl;
+        // All ones for TTL instructions
+        uint32_t mask = -uint32_t((ctrl & ControlBit::InstMask) == 0);
+        out[2 * i] = ctrl;
+        out[2 * i + 1] = in[i].op | (preserve & mask);
+    }
+}
+
+// Same as above with the input words also stored as `ctrl`, `op` pairs.
+static inline void
+mergeTTL(uint32_t *__restrict__ out, const uint32_t *__restrict__ in,
+         size_t n, uint32_t preserve)
+{
+    for (size_t i = 0;i < n;i++) {
+        auto ctrl = in[2 * i];
+        uint32_t mask = -uint32_t((ctrl & ControlBit::InstMask) == 0);
+        out[2 * i] = ctrl;
+        out[2 * i + 1] = in[2 * i + 1] | (preserve & mask);
+    }
+}
+
+/**
+ * Same as running the bytecode used to create @code.
+ */
+uint32_t runByteCode(Controller *__restrict__ ctrler,
+                     const EncodedByteCode &code, uint32_t ttl_mask,
+                     bool short_seq, const uint32_t *cur_ttl=nullptr,
+                     SlackStats *stats=nullptr, LeadController *lead=nullptr,
+                     uint64_t *end_t=nullptr);
+
+/**
+ * Runs bytecode with two threads.
+ *
+ * A decoder thread encodes the bytecode (see `encodeByteCode`) into fixed
+ * size chunks in a lock-free ring. The thread calling `run` merges
+ * the preserved TTL channels, writes the chunks to the FIFO and handles
+ * the long waits, including the requests. The sequence can start before
+ * the whole bytecode is encoded, and the interpreter is moved off the thread
+ * that writes to the FPGA.
+ * Only one sequence can be run at a time.
+ */
+class ByteCodePipeline {
+    ByteCodePipeline(const ByteCodePipeline&) = delete;
+    void operator=(const ByteCodePipeline&) = delete;
+public:
+    struct Chunk;
+    ByteCodePipeline(const ThreadConfig &config=ThreadConfig());
+    ~ByteCodePipeline();
+    /**
+     * Same as `runByteCode`. If @encoded is not `nullptr` the encoded
+     * sequence is also saved to it.
+     * If decoding fails, the sequence stops after the last chunk decoded
+     * before the error and the error is rethrown.
+     */
+    uint32_t run(Controller *__restrict__ ctrler, const uint8_t *code,
+                 size_t code_len, uint32_t ttl_mask, bool short_seq,
+                 const uint32_t *cur_ttl=nullptr, SlackStats *stats=nullptr,
+                 LeadController *lead=nullptr,
+                 EncodedByteCode *encoded=nullptr, uint64_t *end_t=nullptr);
+    uint32_t run(Controller *__restrict__ ctrler,
+                 const DecodedByteCode &decoded, uint32_t ttl_mask,
+                 bool short_seq, const uint32_t *cur_ttl=nullptr,
+                 SlackStats *stats=nullptr, LeadController *lead=nullptr,
+                 uint64_t *end_t=nullptr);
+private:
+    struct ChunkSink;
+    uint32_t run(Controller *__restrict__ ctrler, uint32_t ttl_mask,
+                 bool short_seq, const uint32_t *cur_ttl,
+                 SlackStats *stats, LeadController *lead, uint64_t *end_t);
+    void decodeLoop(ThreadConfig config);
+
+    Chunk *const m_chunks;
+    // Number of chunks written by the decoder and read by the runner.
+    std::atomic<uint32_t> m_write_idx{0};
+    std::atomic<uint32_t> m_read_idx{0};
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    // The current job, protected by `m_lock`
+    const uint8_t *m_code = nullptr;
+    size_t m_code_len = 0;
+    const DecodedByteCode *m_decoded = nullptr;
+    EncodedByteCode *m_encoded = nullptr;
+    // Error thrown on the decoder thread.
+    std::exception_ptr m_error;
+    bool m_busy = false;
+    bool m_quit = false;
+    std::thread m_thread;
+};
+
 void runEpilogue(Controller *__restrict__ ctrler);
+/**
+ * Prepare the controller for a sequence appended behind the ones written so
+ * far, which are expected to finish at @end_t (see `runByteCode`).
+ * If they have finished or will within @margin ns, the new sequence wouldn't
+ * be buffered before it starts. In that case, wait for them to finish, hold
+ * the FIFO and set @end_t to `0` so that the sequence runs as a first one.
+ * Returns whether the sequence is still appended to the previous ones.
+ */
+bool prepareQueuedSeq(Controller *__restrict__ ctrler, uint64_t &end_t,
+                      uint64_t margin=10000000);
 
 struct BlockBuilder : public std::vector<Instruction> {
     unsigned lineNum;
     uint64_t currT;
+    // Number of loops in the list.
+    size_t numLoops = 0;
+private:
+    struct OpenLoop {
+        size_t idx;
+        uint64_t t;
+        uint32_t count;
+        // `numLoops` before the loop, i.e. without the nested ones.
+        size_t nloops;
+    };
+    std::vector<OpenLoop> m_loops;
 public:
     BlockBuilder()
         : std::vector<Instruction>(),
@@ -207,6 +652,41 @@ public:
         }
         pushPulse(InstWriter::wait, final_t - currT);
     }
+    // The instructions added before the matching `endLoop` are stored once
+    // and repeated @count times when the list runs.
+    // The times in the loop body are the ones of the first iteration.
+    inline void
+    beginLoop(uint32_t count)
+    {
+        if (m_loops.size() >= max_loop_depth)
+            throw std::runtime_error("Loops nested too deep.");
+        m_loops.push_back({size(), currT, count, numLoops});
+        push_back(InstWriter::loopStart(count));
+    }
+    inline void
+    endLoop()
+    {
+        if (m_loops.empty())
+            throw std::runtime_error("End of loop without loop.");
+        auto loop = m_loops.back();
+        m_loops.pop_back();
+        auto len = size() - loop.idx - 1;
+        if (loop.count == 0 || len == 0) {
+            // Including the nested loops.
+            erase(begin() + loop.idx, end());
+            currT = loop.t;
+            numLoops = loop.nloops;
+            return;
+        }
+        push_back(InstWriter::loopEnd(uint32_t(len)));
+        currT = loop.t + (currT - loop.t) * loop.count;
+        numLoops++;
+    }
+    inline size_t
+    loopDepth() const
+    {
+        return m_loops.size();
+    }
     inline size_t
     cacheSize() const
     {
@@ -214,6 +694,31 @@ public:
     }
 };
 
+struct OptimizeStats {
+    // Redundant DDS and TTL writes removed
+    size_t removed = 0;
+    // Length (in cycles) of the removed pulses, which are now waits
+    uint64_t removed_t = 0;
+    // Waits merged into the previous wait
+    size_t merged_waits = 0;
+    inline void
+    merge(const OptimizeStats &other)
+    {
+        removed += other.removed;
+        removed_t += other.removed_t;
+        merged_waits += other.merged_waits;
+    }
+};
+
+/**
+ * Remove the DDS and TTL writes that set an output to the value it already
+ * has (from an earlier write in the same list) and merge consecutive waits.
+ * Each removed pulse is replaced by a wait of the same length so the timing
+ * of all the other outputs doesn't change.
+ * What is known about the outputs is reset at the loop boundaries.
+ */
+OptimizeStats optimizeInstructionList(BlockBuilder &builder);
+
 }
 }
 
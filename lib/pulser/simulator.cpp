@@ -0,0 +1,289 @@
+#include "simulator.h"
+
+#include <nacs-utils/utils.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace NaCs {
+namespace Pulser {
+
+static constexpr uint32_t timingCheckBit = 0x8000000;
+static constexpr uint32_t holdBit = 0x80;
+static constexpr uint32_t initBit = 0x100;
+
+static std::mutex sim_lock;
+static std::vector<Simulator*> sims;
+
+NACS_EXPORT() Simulator::Simulator(double clock_rate)
+    : m_cycles_per_ns(clock_rate * 1e-9),
+      m_start(clock::now()),
+      m_thread(&Simulator::run, this)
+{
+    std::lock_guard<std::mutex> locker(sim_lock);
+    sims.push_back(this);
+}
+
+NACS_EXPORT() Simulator::~Simulator()
+{
+    {
+        std::lock_guard<std::mutex> locker(sim_lock);
+        sims.erase(std::find(sims.begin(), sims.end(), this));
+    }
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+NACS_EXPORT() Simulator*
+Simulator::find(volatile void *base)
+{
+    std::lock_guard<std::mutex> locker(sim_lock);
+    for (auto sim: sims) {
+        if (sim->base() == base) {
+            return sim;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t
+Simulator::now() const
+{
+    if (m_cycles_per_ns <= 0)
+        return 0;
+    auto dt = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock::now() - m_start).count();
+    return uint64_t(double(dt) * m_cycles_per_ns);
+}
+
+NACS_EXPORT() uint64_t
+Simulator::curTime()
+{
+    std::lock_guard<std::mutex> locker(m_lock);
+    advance(now());
+    return m_t_end;
+}
+
+void
+Simulator::pushResult(uint32_t res)
+{
+    // The hardware result buffer has 32 entries.
+    if (m_results.size() < 32) {
+        m_results.push_back(res);
+    }
+}
+
+void
+Simulator::execDDS(uint32_t ctrl, uint32_t op)
+{
+    uint32_t chn = (ctrl >> 4) & 0x1f;
+    uint32_t addr = (ctrl >> 9) & 0x7f;
+    if (chn >= PULSER_NDDS) {
+        if ((ctrl & 0xf) == 0x3 || (ctrl & 0xf) == 0xe)
+            pushResult(0);
+        return;
+    }
+    auto &mem = m_dds[chn];
+    auto getBytes = [&] (uint32_t start, int n) {
+        uint32_t res = 0;
+        for (int i = 0;i < n;i++)
+            res |= uint32_t(mem[(start + i) & 0x7f]) << (i * 8);
+        return res;
+    };
+    auto setBytes = [&] (uint32_t start, int n, uint32_t val) {
+        for (int i = 0;i < n;i++) {
+            mem[(start + i) & 0x7f] = uint8_t(val >> (i * 8));
+        }
+    };
+    switch (ctrl & 0xf) {
+    case 0x0:
+        // Frequency tuning word of profile 0
+        setBytes(0x2c, 4, op);
+        break;
+    case 0x2:
+        setBytes(addr - 1, 2, op);
+        break;
+    case 0x3:
+        pushResult(getBytes(addr - 1, 2));
+        break;
+    case 0x4:
+        mem.fill(0);
+        break;
+    case 0x5:
+        for (uint32_t i = 0;i < PULSER_NDDS;i++) {
+            if (op & (1 << i)) {
+                m_dds[i].fill(0);
+            }
+        }
+        break;
+    case 0xe:
+        pushResult(getBytes(addr - 1, 4));
+        break;
+    case 0xf:
+        setBytes(addr - 1, 4, op);
+        break;
+    default:
+        break;
+    }
+}
+
+// Returns the length of the instruction in cycles.
+uint64_t
+Simulator::execute(const Inst &inst)
+{
+    m_num_insts.fetch_add(1, std::memory_order_relaxed);
+    switch (inst.ctrl >> 28) {
+    case 0x0:
+        m_ttl = inst.op;
+        return max(inst.ctrl & 0xffffff, 1u);
+    case 0x1:
+        execDDS(inst.ctrl & 0xffffff, inst.op);
+        return 50;
+    case 0x2:
+        return max(inst.ctrl & 0xffffff, 1u);
+    case 0x3:
+        m_timing_fail = false;
+        return 5;
+    case 0x4:
+        pushResult(inst.op);
+        return 5;
+    case 0x6:
+        return 45;
+    default:
+        return 5;
+    }
+}
+
+/**
+ * Run all the instructions that should have started by @now.
+ */
+void
+Simulator::advance(uint64_t now)
+{
+    if (m_reg3 & holdBit)
+        return;
+    bool realtime = m_cycles_per_ns > 0;
+    while (!m_fifo.empty()) {
+        auto &inst = m_fifo.front();
+        auto start = m_t_end;
+        if (inst.t_write > start) {
+            // The FIFO was empty when the previous instruction finished.
+            if ((inst.ctrl & timingCheckBit) && !m_restart)
+                m_timing_fail = true;
+            start = inst.t_write;
+        }
+        if (realtime && start > now)
+            break;
+        m_restart = false;
+        m_t_end = start + execute(inst);
+        m_fifo.pop_front();
+    }
+}
+
+NACS_EXPORT() uint32_t
+Simulator::readReg(uint32_t reg)
+{
+    std::lock_guard<std::mutex> locker(m_lock);
+    auto t = now();
+    advance(t);
+    switch (reg) {
+    case 0:
+        return m_ttl_hi;
+    case 1:
+        return m_ttl_lo;
+    case 2: {
+        bool finished = m_fifo.empty() && (m_cycles_per_ns <= 0 ||
+                                           m_t_end <= t);
+        return (uint32_t(m_timing_fail) | (uint32_t(finished) << 2) |
+                (uint32_t(m_results.size() & 31) << 4));
+    }
+    case 3:
+        return m_reg3;
+    case 4:
+        // The output after the masks, the low mask wins.
+        return (m_ttl | m_ttl_hi) & ~m_ttl_lo;
+    case 31: {
+        if (m_results.empty())
+            return 0;
+        auto res = m_results.front();
+        m_results.pop_front();
+        return res;
+    }
+    default:
+        return m_regs[reg & 31];
+    }
+}
+
+NACS_EXPORT() void
+Simulator::writeReg(uint32_t reg, uint32_t val)
+{
+    std::unique_lock<std::mutex> locker(m_lock);
+    auto t = now();
+    switch (reg) {
+    case 0:
+        m_ttl_hi = val;
+        break;
+    case 1:
+        m_ttl_lo = val;
+        break;
+    case 3:
+        advance(t);
+        if ((m_reg3 & holdBit) && !(val & holdBit)) {
+            // Released from hold, start running the instructions now.
+            m_t_end = max(m_t_end, t);
+        }
+        if (!(m_reg3 & initBit) && (val & initBit))
+            m_restart = true;
+        m_reg3 = val;
+        locker.unlock();
+        m_cond.notify_all();
+        return;
+    case 31:
+        if (!m_has_op) {
+            m_op = val;
+            m_has_op = true;
+            return;
+        } else {
+            m_has_op = false;
+            bool was_empty = m_fifo.empty();
+            m_fifo.push_back({val, m_op, t});
+            advance(t);
+            if (was_empty && !m_fifo.empty()) {
+                locker.unlock();
+                m_cond.notify_all();
+            }
+            return;
+        }
+    default:
+        m_regs[reg & 31] = val;
+        break;
+    }
+}
+
+void
+Simulator::run()
+{
+    std::unique_lock<std::mutex> locker(m_lock);
+    while (!m_quit) {
+        auto t = now();
+        advance(t);
+        auto timeout = std::chrono::milliseconds(10);
+        if (!m_fifo.empty() && !(m_reg3 & holdBit) && m_cycles_per_ns > 0) {
+            // Wake up when the next instruction should start.
+            auto start = max(m_t_end, m_fifo.front().t_write);
+            auto dt = std::chrono::nanoseconds(
+                int64_t(double(start - min(start, t)) / m_cycles_per_ns));
+            timeout = std::min(timeout, std::chrono::duration_cast<
+                                   std::chrono::milliseconds>(dt) +
+                               std::chrono::milliseconds(1));
+        }
+        m_cond.wait_for(locker, timeout);
+    }
+}
+
+}
+}
@@ -0,0 +1,114 @@
+#ifndef __NACS_PULSER_SIMULATOR_H__
+#define __NACS_PULSER_SIMULATOR_H__
+
+#include <nacs-pulser/pulser-config.h>
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace NaCs {
+namespace Pulser {
+
+/**
+ * Software model of the pulse controller.
+ *
+ * This implements the register interface used by `Driver` so that
+ * the controller, the sequence runners and the tests can run without
+ * the FPGA. The model includes:
+ *
+ * * The instruction FIFO at register 31 (written as op then ctrl) and
+ *     the result buffer read from register 31.
+ * * The status register 2: timing failure (bit 0), finished (bit 2) and
+ *     the number of results (bits 4-8).
+ * * Hold and init in register 3, TTL masks in register 0 and 1 and
+ *     the TTL output (with the masks applied) in register 4.
+ * * TTL, wait, loopback, clear timing check and the DDS register commands.
+ *     Each DDS is modeled as 128 bytes of register memory.
+ *
+ * Instructions are executed by a background thread at @clock_rate cycles
+ * per second. A timing checked instruction that is not in the FIFO when
+ * the previous one finishes sets the timing failure bit.
+ * With a clock rate of `0` every instruction runs as soon as it is written.
+ */
+class Simulator {
+    Simulator(const Simulator&) = delete;
+    void operator=(const Simulator&) = delete;
+public:
+    Simulator(double clock_rate=1e8);
+    ~Simulator();
+
+    // The address to pass to `Driver`.
+    inline volatile void*
+    base()
+    {
+        return m_regs.data();
+    }
+    // Find the simulator that owns @base. Returns `nullptr` for hardware.
+    static Simulator *find(volatile void *base);
+
+    uint32_t readReg(uint32_t reg);
+    void writeReg(uint32_t reg, uint32_t val);
+
+    // Number of instructions executed.
+    inline uint64_t
+    numInsts() const
+    {
+        return m_num_insts.load(std::memory_order_relaxed);
+    }
+    // Sequence time in cycles.
+    uint64_t curTime();
+
+private:
+    struct Inst {
+        uint32_t ctrl;
+        uint32_t op;
+        // Time when the instruction is written to the FIFO.
+        uint64_t t_write;
+    };
+    typedef std::chrono::steady_clock clock;
+
+    uint64_t now() const;
+    void advance(uint64_t now);
+    uint64_t execute(const Inst &inst);
+    void execDDS(uint32_t ctrl, uint32_t op);
+    void pushResult(uint32_t res);
+    void run();
+
+    // Only used as the base address.
+    std::array<uint32_t, 32> m_regs{};
+    const double m_cycles_per_ns;
+    const clock::time_point m_start;
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<Inst> m_fifo;
+    std::deque<uint32_t> m_results;
+    std::array<std::array<uint8_t, 128>, PULSER_NDDS> m_dds{};
+    uint32_t m_ttl_hi = 0;
+    uint32_t m_ttl_lo = 0;
+    uint32_t m_reg3 = 0;
+    uint32_t m_ttl = 0;
+    uint32_t m_op = 0;
+    bool m_has_op = false;
+    bool m_timing_fail = false;
+    // Set by init, the next instruction starts a new sequence.
+    bool m_restart = false;
+    // End time of the last instruction
+    uint64_t m_t_end = 0;
+    std::atomic<uint64_t> m_num_insts{0};
+
+    bool m_quit = false;
+    std::thread m_thread;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,1043 @@
+//
+
+#include "text_seq.h"
+
+#include <nacs-utils/utils.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sstream>
+#include <stdexcept>
+
+namespace NaCs {
+namespace Pulser {
+
+using Inst = InstWriter;
+
+static auto
+parseError(BlockBuilder &builder, std::string &&text)
+{
+    return std::runtime_error("L" + std::to_string(builder.lineNum) +
+                              ": " + text);
+}
+
+/**
+ * Loops
+ *
+ *     loop(1000)
+ *     dt = 1 us, TTL(all) = 0x1
+ *     dt = 1 us, TTL(all) = 0x0
+ *     endloop
+ *
+ * The body is stored once in the builder (see `BlockBuilder::beginLoop`).
+ * Shared by both parsers since neither of the lines has a '='.
+ * Returns `false` if the line is not a loop line.
+ */
+enum class LoopLine {
+    None,
+    Begin,
+    End
+};
+
+// Only checks the start of the loop line. For `Begin`, @p is moved to
+// after the '('.
+static LoopLine
+loopLineKind(const char *&p, const char *&end)
+{
+    while (p < end && isspace(*p))
+        p++;
+    while (end > p && isspace(end[-1]))
+        end--;
+    if (end - p == 7 && memcmp(p, "endloop", 7) == 0)
+        return LoopLine::End;
+    if (end - p < 4 || memcmp(p, "loop", 4) != 0)
+        return LoopLine::None;
+    auto q = p + 4;
+    while (q < end && isspace(*q))
+        q++;
+    if (q == end || *q != '(')
+        return LoopLine::None;
+    p = q + 1;
+    return LoopLine::Begin;
+}
+
+static bool
+parseLoopLine(BlockBuilder &builder, const char *p, const char *end)
+{
+    auto kind = loopLineKind(p, end);
+    if (kind == LoopLine::None)
+        return false;
+    if (kind == LoopLine::End) {
+        if (!builder.loopDepth())
+            throw parseError(builder, "endloop without loop.");
+        builder.endLoop();
+        return true;
+    }
+    while (p < end && isspace(*p))
+        p++;
+    uint64_t count = 0;
+    auto digits = p;
+    for (;p < end && *p >= '0' && *p <= '9';p++) {
+        count = count * 10 + uint64_t(*p - '0');
+        if (count > UINT32_MAX) {
+            throw parseError(builder, "Invalid loop count.");
+        }
+    }
+    while (p < end && isspace(*p))
+        p++;
+    if (p == digits || end - p != 1 || *p != ')')
+        throw parseError(builder, "Invalid loop count.");
+    if (builder.loopDepth() >= max_loop_depth)
+        throw parseError(builder, "Loops nested too deep.");
+    builder.beginLoop(uint32_t(count));
+    return true;
+}
+
+static void
+checkLoopsClosed(BlockBuilder &builder)
+{
+    if (builder.loopDepth()) {
+        throw parseError(builder, "loop without endloop.");
+    }
+}
+
+/**
+ * The original parser
+ */
+
+static bool
+get_channel_and_operand(std::string &arg1, std::istream &s, int *channel,
+                        double *operand)
+{
+    std::string line;
+    getline(s, line);
+
+    if (!line.length())
+        return false;
+
+    if (operand)
+        if (!sscanf(line.c_str(), " = %le", operand))
+            return false;
+
+    if (sscanf(arg1.c_str(), " %d", channel))
+        return true;
+
+    return false;
+}
+
+// eat stream up to character == to.  put prior chars into strPrior
+static bool
+eatStreamTo(std::istream &is, char to, std::string &strPrior)
+{
+    while (!is.eof()) {
+        char c;
+        is.get(c);
+
+        if (!is.eof()) {
+            strPrior.push_back(c);
+
+            if (c == to) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static Instruction
+parseReset(BlockBuilder &builder, std::string &arg1, std::istream &s,
+           uint64_t *tp)
+{
+    std::string line;
+    getline(s, line);
+    int channel = -1;
+
+    if (!line.length() || !sscanf(arg1.c_str(), " %d", &channel)) {
+        throw parseError(builder, "Failed to parse reset command.");
+    }
+    return Inst::DDS::reset(channel, tp);
+}
+
+static Instruction
+parseClockOut(BlockBuilder &builder, std::string &arg1, uint64_t *tp)
+{
+    int divider = 0;
+
+    if (arg1.find("off") == 0) {
+        divider = 255;
+    } else {
+        divider = atoi(arg1.c_str()) - 1;
+    }
+
+    if (divider < 0 || divider > 255) {
+        throw parseError(builder, "Bad CLOCK_OUT parameter");
+    }
+    return Inst::clockOut(divider, tp);
+}
+
+static Instruction
+parseDACSetVolt(BlockBuilder &builder, std::string &arg1,
+                std::istream &s, uint64_t *tp)
+{
+    int chn = -1;
+    double operand = 0;
+
+    if (get_channel_and_operand(arg1, s, &chn, &operand)) {
+        if (chn > 3)
+            throw parseError(builder,
+                             "Invalid DAC (" + std::to_string(chn) + ")");
+        return Inst::dacSetVolt(uint8_t(chn), operand, tp);
+    }
+    throw parseError(builder, "Failed to parse DAC command.");
+}
+
+static Instruction
+parseTTL(BlockBuilder &builder, std::string &arg1, std::istream &s,
+         uint64_t *tp)
+{
+    std::string line;
+    getline(s, line);
+    unsigned ttl;
+
+    if (!line.length() || !sscanf(line.c_str(), " = %x", &ttl)) {
+        throw parseError(builder, "Failed to parse TTL command.");
+    }
+
+    int channel = -1;
+    if (sscanf(arg1.c_str(), " %d", &channel)) {
+        return Inst::ttl(uint8_t(channel), ttl, tp);
+    } else {
+        if (arg1.find("all") != std::string::npos) {
+            return Inst::ttlAll(ttl, tp);
+        }
+    }
+    throw parseError(builder, "Failed to parse TTL command.");
+}
+
+template<typename Func>
+static Instruction
+parseDDS(BlockBuilder &builder, std::string &arg1, std::istream &s,
+         Func &&cb, uint64_t *tp)
+{
+    int chn = -1;
+    double operand = 0;
+
+    if (get_channel_and_operand(arg1, s, &chn, &operand)) {
+        if (chn > PULSER_NDDS - 1) {
+            throw parseError(builder,
+                             "Invalid DDS (" + std::to_string(chn) + ")");
+        }
+        return cb(chn, operand, tp);
+    }
+    throw parseError(builder, "Failed to parse DDS command.");
+}
+
+static Instruction
+parseCommand(BlockBuilder &builder, std::string &cmd,
+             std::string &arg1, std::istream &s, uint64_t *tp)
+{
+    if (cmd.find("TTL") != std::string::npos)
+        return parseTTL(builder, arg1, s, tp);
+
+    if (cmd.find("freq") != std::string::npos)
+        return parseDDS(builder, arg1, s, Inst::DDS::setFreq, tp);
+
+    if (cmd.find("amp") != std::string::npos)
+        return parseDDS(builder, arg1, s, Inst::DDS::setAmp, tp);
+
+    if (cmd.find("phase") != std::string::npos)
+        return parseDDS(builder, arg1, s, Inst::DDS::setPhase, tp);
+
+    if (cmd.find("shiftp") != std::string::npos)
+        return parseDDS(builder, arg1, s, Inst::DDS::shiftPhase, tp);
+
+    if (cmd.find("reset") != std::string::npos)
+        return parseReset(builder, arg1, s, tp);
+
+    if (cmd.find("CLOCK_OUT") != std::string::npos)
+        return parseClockOut(builder, arg1, tp);
+
+    if (cmd.find("dac") != std::string::npos)
+        return parseDACSetVolt(builder, arg1, s, tp);
+
+    throw parseError(builder, "Unknown command.");
+}
+
+// Parse a line (with the comment removed).
+static void
+parseLineLegacy(BlockBuilder &builder, const std::string &line)
+{
+    std::stringstream ssL(line);
+
+    std::string strPrior;
+
+    // valid lines will start with "dt = " or "t = "
+
+    if (!eatStreamTo(ssL, '=', strPrior)) {
+        parseLoopLine(builder, line.data(), line.data() + line.size());
+        return;
+    }
+
+    bool use_dt;
+    double __new_t;
+    ssL >> __new_t;
+    uint64_t new_t = uint64_t(__new_t * PULSER_DT_per_us);
+    if (strPrior.find("dt") != std::string::npos) {
+        use_dt = true;
+    } else if (strPrior.find("t") != std::string::npos) {
+        use_dt = false;
+    } else {
+        throw parseError(builder, "Invalid time spec.");
+    }
+
+    // next comes the time unit (not used), then a comma
+    std::string timeunit;
+    getline(ssL, timeunit, ',');
+
+    if (ssL.eof()) {
+        throw parseError(builder, "No action.");
+    }
+
+    // then comes the command name, followed by '(arg1)'
+    std::string cmd;
+    getline(ssL, cmd, '(');
+    if (ssL.eof()) {
+        throw parseError(builder, "Incomplete action.");
+    }
+
+    std::string arg1;
+    getline(ssL, arg1, ')');
+    if (ssL.eof()) {
+        throw parseError(builder, "Incomplete action (2).");
+    }
+
+    if (use_dt) {
+        builder.pulseDT(new_t, parseCommand, builder, cmd, arg1, ssL);
+    } else {
+        builder.pulseAbsT(new_t, parseCommand, builder, cmd, arg1, ssL);
+    }
+}
+
+NACS_EXPORT() void
+parseTextSeqLegacy(const std::string &seqTxt, BlockBuilder &builder)
+{
+    // first parse and load up the pulses vector
+    std::stringstream ss0(seqTxt);
+
+    while (!ss0.eof()) {
+        // read line
+        std::string line;
+        getline(ss0, line);
+
+        builder.lineNum++;
+
+        // ignore everything after '#' comment symbol
+        size_t posC = line.find("#");
+        if (posC != std::string::npos)
+            line = line.substr(0, posC);
+
+        // ignore blank lines
+        if (line.length() == 0)
+            continue;
+
+        // otherwise parse the line
+        parseLineLegacy(builder, line);
+    }
+    checkLoopsClosed(builder);
+}
+
+/**
+ * The fast parser
+ *
+ * Each field is scanned with the same rules as the `sscanf`, `atoi` or
+ * `std::istream` call in the original parser. When a field is not in one of
+ * the common forms, the scanners return `Slow` and the line is handed to
+ * `parseLineLegacy` instead. Nothing is added to the builder before that.
+ */
+
+namespace {
+
+enum ScanRes {
+    // Not a match, same as `sscanf` returning `0`.
+    Fail,
+    OK,
+    // Need the original parser to find out.
+    Slow,
+};
+
+struct Parser {
+    BlockBuilder &builder;
+
+    static inline bool
+    isSpace(char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+    static inline bool
+    isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+    static inline int
+    hexDigit(char c)
+    {
+        if (isDigit(c))
+            return c - '0';
+        c = char(c | 0x20);
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        return -1;
+    }
+    static inline const char*
+    skipSpace(const char *p, const char *end)
+    {
+        while (p < end && isSpace(*p))
+            p++;
+        return p;
+    }
+    static inline const char*
+    find(const char *p, const char *end, char c)
+    {
+        return (const char*)memchr(p, c, size_t(end - p));
+    }
+    static inline bool
+    contains(const char *p, const char *end, const char *str, size_t len)
+    {
+        for (;size_t(end - p) >= len;p++) {
+            p = find(p, end - len + 1, str[0]);
+            if (!p)
+                return false;
+            if (memcmp(p, str, len) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    template<size_t N>
+    static inline bool
+    contains(const char *p, const char *end, const char (&str)[N])
+    {
+        return contains(p, end, str, N - 1);
+    }
+
+    // Exact conversion of `mant * 10^exp10` when both are exactly
+    // representable (the result is then correctly rounded, same as `strtod`).
+    static inline bool
+    toDouble(uint64_t mant, int exp10, bool neg, double &res)
+    {
+        static const double pow10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        if (mant > (uint64_t(1) << 53) || exp10 < -22 || exp10 > 22)
+            return false;
+        double v = double(mant);
+        v = exp10 < 0 ? v / pow10[-exp10] : v * pow10[exp10];
+        res = neg ? -v : v;
+        return true;
+    }
+
+    // Decimal number with at least one digit, an optional fraction and
+    // an optional exponent with at least one digit.
+    // Returns `Fail` if there's no digit in the mantissa.
+    static inline ScanRes
+    scanDecimal(const char *&p, const char *end, double &res)
+    {
+        bool neg = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            neg = *p == '-';
+            p++;
+        }
+        uint64_t mant = 0;
+        int ndigits = 0;
+        int exp10 = 0;
+        bool has_digit = false;
+        for (;p < end && isDigit(*p);p++) {
+            has_digit = true;
+            if (mant == 0 && *p == '0')
+                continue;
+            mant = mant * 10 + uint64_t(*p - '0');
+            ndigits++;
+        }
+        if (p < end && *p == '.') {
+            p++;
+            for (;p < end && isDigit(*p);p++) {
+                has_digit = true;
+                exp10--;
+                if (mant == 0 && *p == '0')
+                    continue;
+                mant = mant * 10 + uint64_t(*p - '0');
+                ndigits++;
+            }
+        }
+        if (!has_digit)
+            return Fail;
+        if (ndigits > 19)
+            return Slow;
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            auto q = p + 1;
+            bool exp_neg = false;
+            if (q < end && (*q == '-' || *q == '+')) {
+                exp_neg = *q == '-';
+                q++;
+            }
+            if (q == end || !isDigit(*q))
+                return Slow;
+            int exp = 0;
+            for (;q < end && isDigit(*q);q++) {
+                if (exp > 1000)
+                    return Slow;
+                exp = exp * 10 + (*q - '0');
+            }
+            exp10 += exp_neg ? -exp : exp;
+            p = q;
+        }
+        if (mant == 0) {
+            res = neg ? -0.0 : 0.0;
+            return OK;
+        }
+        return toDouble(mant, exp10, neg, res) ? OK : Slow;
+    }
+
+    // `sscanf(str, " %d")`
+    static inline ScanRes
+    scanInt(const char *p, const char *end, int &res)
+    {
+        p = skipSpace(p, end);
+        if (p == end)
+            return Slow;
+        bool neg = *p == '-';
+        if (*p == '-' || *p == '+') {
+            p++;
+            if (p == end || !isDigit(*p)) {
+                return Slow;
+            }
+        }
+        if (!isDigit(*p))
+            return Fail;
+        int v = 0;
+        for (int i = 0;p < end && isDigit(*p);p++, i++) {
+            if (i >= 9)
+                return Slow;
+            v = v * 10 + (*p - '0');
+        }
+        res = neg ? -v : v;
+        return OK;
+    }
+
+    // `atoi(str)`
+    static inline ScanRes
+    scanAtoi(const char *p, const char *end, int &res)
+    {
+        p = skipSpace(p, end);
+        bool neg = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+'))
+            p++;
+        int v = 0;
+        for (int i = 0;p < end && isDigit(*p);p++, i++) {
+            if (i >= 9)
+                return Slow;
+            v = v * 10 + (*p - '0');
+        }
+        res = neg ? -v : v;
+        return OK;
+    }
+
+    // The `" = "` before the `sscanf` conversions.
+    static inline ScanRes
+    scanEq(const char *&p, const char *end)
+    {
+        p = skipSpace(p, end);
+        if (p == end)
+            return Slow;
+        if (*p != '=')
+            return Fail;
+        p = skipSpace(p + 1, end);
+        if (p == end)
+            return Slow;
+        return OK;
+    }
+
+    // `sscanf(str, " = %x")`
+    static inline ScanRes
+    scanEqHex(const char *p, const char *end, uint32_t &res)
+    {
+        auto r = scanEq(p, end);
+        if (r != OK)
+            return r;
+        if (*p == '-' || *p == '+')
+            return Slow;
+        if (end - p >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+            p += 2;
+            if (p == end || hexDigit(*p) < 0) {
+                return Slow;
+            }
+        }
+        if (hexDigit(*p) < 0)
+            return Fail;
+        uint32_t v = 0;
+        for (int i = 0;p < end;p++, i++) {
+            int d = hexDigit(*p);
+            if (d < 0)
+                break;
+            if (i >= 8)
+                return Slow;
+            v = (v << 4) | uint32_t(d);
+        }
+        res = v;
+        return OK;
+    }
+
+    // `sscanf(str, " = %le")`
+    static inline ScanRes
+    scanEqDouble(const char *p, const char *end, double &res)
+    {
+        auto r = scanEq(p, end);
+        if (r != OK)
+            return r;
+        auto q = p;
+        if (*q == '-' || *q == '+')
+            q++;
+        if (q == end)
+            return Slow;
+        char c = char(*q | 0x20);
+        // Infinity, NaN or hex float
+        if (c == 'i' || c == 'n' || (end - q >= 2 && *q == '0' &&
+                                     (q[1] | 0x20) == 'x'))
+            return Slow;
+        if (q == p && !isDigit(*p) && *p != '.')
+            return Fail;
+        // The corner cases (e.g. no digits after the sign) are left to
+        // `sscanf`.
+        r = scanDecimal(p, end, res);
+        return r == Fail ? Slow : r;
+    }
+
+    // `std::istream >> double`, the stream must not reach the end.
+    static inline ScanRes
+    scanTime(const char *&p, const char *end, double &res)
+    {
+        p = skipSpace(p, end);
+        auto r = scanDecimal(p, end, res);
+        if (r != OK || p == end)
+            return Slow;
+        return OK;
+    }
+
+    enum CmdKind {
+        TTL,
+        Freq,
+        Amp,
+        Phase,
+        ShiftPhase,
+        Reset,
+        ClockOut,
+        DAC,
+        Unknown,
+    };
+
+    // Same as the substring search in `parseCommand` but with a fast path
+    // for the names that are used.
+    static inline CmdKind
+    cmdKind(const char *p, const char *end)
+    {
+        p = skipSpace(p, end);
+        while (end > p && isSpace(end[-1]))
+            end--;
+        auto eq = [&] (const char *name, size_t len) {
+            return memcmp(p, name, len) == 0;
+        };
+        switch (end - p) {
+        case 3:
+            if (eq("TTL", 3))
+                return TTL;
+            if (eq("amp", 3))
+                return Amp;
+            if (eq("dac", 3))
+                return DAC;
+            break;
+        case 4:
+            if (eq("freq", 4))
+                return Freq;
+            break;
+        case 5:
+            if (eq("phase", 5))
+                return Phase;
+            if (eq("reset", 5))
+                return Reset;
+            break;
+        case 6:
+            if (eq("shiftp", 6))
+                return ShiftPhase;
+            break;
+        case 9:
+            if (eq("CLOCK_OUT", 9))
+                return ClockOut;
+            break;
+        default:
+            break;
+        }
+        if (contains(p, end, "TTL"))
+            return TTL;
+        if (contains(p, end, "freq"))
+            return Freq;
+        if (contains(p, end, "amp"))
+            return Amp;
+        if (contains(p, end, "phase"))
+            return Phase;
+        if (contains(p, end, "shiftp"))
+            return ShiftPhase;
+        if (contains(p, end, "reset"))
+            return Reset;
+        if (contains(p, end, "CLOCK_OUT"))
+            return ClockOut;
+        if (contains(p, end, "dac"))
+            return DAC;
+        return Unknown;
+    }
+
+    // The result of `parseCommand`, evaluated when the builder asks for it
+    // so that the errors are thrown in the same order.
+    struct Command {
+        CmdKind kind;
+        // Error message if not `nullptr`
+        const char *error;
+        // For the DDS and DAC errors
+        int chn;
+        uint32_t ttl;
+        double operand;
+        bool all;
+    };
+
+    Instruction
+    operator()(const Command &cmd, uint64_t *tp) const
+    {
+        if (cmd.error)
+            throw parseError(builder, cmd.error);
+        switch (cmd.kind) {
+        case TTL:
+            if (cmd.all)
+                return Inst::ttlAll(cmd.ttl, tp);
+            return Inst::ttl(uint8_t(cmd.chn), cmd.ttl, tp);
+        case Freq:
+        case Amp:
+        case Phase:
+        case ShiftPhase:
+            if (cmd.chn > PULSER_NDDS - 1) {
+                throw parseError(builder, "Invalid DDS (" +
+                                 std::to_string(cmd.chn) + ")");
+            }
+            if (cmd.kind == Freq)
+                return Inst::DDS::setFreq(cmd.chn, cmd.operand, tp);
+            if (cmd.kind == Amp)
+                return Inst::DDS::setAmp(cmd.chn, cmd.operand, tp);
+            if (cmd.kind == Phase)
+                return Inst::DDS::setPhase(cmd.chn, cmd.operand, tp);
+            return Inst::DDS::shiftPhase(cmd.chn, cmd.operand, tp);
+        case Reset:
+            return Inst::DDS::reset(cmd.chn, tp);
+        case ClockOut:
+            return Inst::clockOut(cmd.chn, tp);
+        case DAC:
+            if (cmd.chn > 3) {
+                throw parseError(builder, "Invalid DAC (" +
+                                 std::to_string(cmd.chn) + ")");
+            }
+            return Inst::dacSetVolt(uint8_t(cmd.chn), cmd.operand, tp);
+        default:
+            throw parseError(builder, "Unknown command.");
+        }
+    }
+
+    // Scan the arguments of the command,
+    // `arg` and `rest` are the ranges of `arg1` and `s` in `parseCommand`.
+    static inline ScanRes
+    scanCommand(Command &cmd, const char *arg, const char *arg_end,
+                const char *rest, const char *end)
+    {
+        ScanRes r = OK;
+        switch (cmd.kind) {
+        case TTL:
+            cmd.error = "Failed to parse TTL command.";
+            if (rest == end)
+                return OK;
+            r = scanEqHex(rest, end, cmd.ttl);
+            if (r != OK)
+                return r == Fail ? OK : r;
+            r = scanInt(arg, arg_end, cmd.chn);
+            if (r == Fail) {
+                if (!contains(arg, arg_end, "all"))
+                    return OK;
+                cmd.all = true;
+            }
+            else if (r == Slow) {
+                return r;
+            }
+            cmd.error = nullptr;
+            return OK;
+        case Freq:
+        case Amp:
+        case Phase:
+        case ShiftPhase:
+        case DAC:
+            cmd.error = (cmd.kind == DAC ? "Failed to parse DAC command." :
+                         "Failed to parse DDS command.");
+            if (rest == end)
+                return OK;
+            r = scanEqDouble(rest, end, cmd.operand);
+            if (r == OK)
+                r = scanInt(arg, arg_end, cmd.chn);
+            if (r == OK)
+                cmd.error = nullptr;
+            return r == Fail ? OK : r;
+        case Reset:
+            cmd.error = "Failed to parse reset command.";
+            if (rest == end)
+                return OK;
+            r = scanInt(arg, arg_end, cmd.chn);
+            if (r == OK)
+                cmd.error = nullptr;
+            return r == Fail ? OK : r;
+        case ClockOut:
+            if (arg_end - arg >= 3 && memcmp(arg, "off", 3) == 0) {
+                cmd.chn = 255;
+            } else {
+                r = scanAtoi(arg, arg_end, cmd.chn);
+                if (r != OK)
+                    return r;
+                cmd.chn -= 1;
+            }
+            if (cmd.chn < 0 || cmd.chn > 255)
+                cmd.error = "Bad CLOCK_OUT parameter";
+            return OK;
+        default:
+            return OK;
+        }
+    }
+
+    // Returns `false` if the line needs the original parser.
+    bool
+    parseLine(const char *p, const char *end)
+    {
+        auto eq = find(p, end, '=');
+        if (!eq) {
+            parseLoopLine(builder, p, end);
+            return true;
+        }
+        bool use_dt;
+        if (contains(p, eq, "dt")) {
+            use_dt = true;
+        } else if (find(p, eq, 't')) {
+            use_dt = false;
+        } else {
+            throw parseError(builder, "Invalid time spec.");
+        }
+        p = eq + 1;
+        double t;
+        if (scanTime(p, end, t) != OK)
+            return false;
+        uint64_t new_t = uint64_t(t * PULSER_DT_per_us);
+
+        auto comma = find(p, end, ',');
+        if (!comma)
+            throw parseError(builder, "No action.");
+        auto lparen = find(comma + 1, end, '(');
+        if (!lparen)
+            throw parseError(builder, "Incomplete action.");
+        auto rparen = find(lparen + 1, end, ')');
+        if (!rparen)
+            throw parseError(builder, "Incomplete action (2).");
+
+        Command cmd{cmdKind(comma + 1, lparen), nullptr, -1, 0, 0, false};
+        if (scanCommand(cmd, lparen + 1, rparen, rparen + 1, end) != OK)
+            return false;
+        if (use_dt) {
+            builder.pulseDT(new_t, *this, cmd);
+        } else {
+            builder.pulseAbsT(new_t, *this, cmd);
+        }
+        return true;
+    }
+};
+
+}
+
+// Parse at most @max_lines lines starting at @p.
+// Returns the start of the next line or `nullptr` at the end of the text.
+static const char*
+parseLines(Parser &parser, const char *p, const char *end, size_t max_lines)
+{
+    auto &builder = parser.builder;
+    for (size_t i = 0;i < max_lines;i++) {
+        auto nl = Parser::find(p, end, '\n');
+        auto line_end = nl ? nl : end;
+        builder.lineNum++;
+        // ignore everything after '#' comment symbol
+        if (auto comment = Parser::find(p, line_end, '#'))
+            line_end = comment;
+        if (p != line_end && !parser.parseLine(p, line_end))
+            parseLineLegacy(builder, std::string(p, line_end));
+        if (!nl) {
+            checkLoopsClosed(builder);
+            return nullptr;
+        }
+        p = nl + 1;
+    }
+    return p;
+}
+
+NACS_EXPORT() void
+parseTextSeq(const char *str, size_t len, BlockBuilder &builder)
+{
+    Parser parser{builder};
+    parseLines(parser, str, str + len, size_t(-1));
+}
+
+NACS_EXPORT() bool
+hasLoops(const char *str, size_t len)
+{
+    const char *p = str;
+    const char *end = str + len;
+    while (p) {
+        auto nl = Parser::find(p, end, '\n');
+        auto line_end = nl ? nl : end;
+        if (auto comment = Parser::find(p, line_end, '#'))
+            line_end = comment;
+        // Same as `Parser::parseLine`, loop lines don't have a '='.
+        auto line = p;
+        if (!Parser::find(p, line_end, '=') &&
+            loopLineKind(line, line_end) != LoopLine::None)
+            return true;
+        p = nl ? nl + 1 : nullptr;
+    }
+    return false;
+}
+
+NACS_EXPORT()
+TextSeqStream::TextSeqStream(const char *str, size_t len, const Config &config)
+    : m_str(str),
+      m_len(len),
+      m_config(config)
+{
+}
+
+NACS_EXPORT() TextSeqStream::~TextSeqStream()
+{
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+inline bool
+TextSeqStream::validated() const
+{
+    return m_done || (m_lines >= m_config.validate_lines &&
+                      m_len_parsed >= m_config.min_lead);
+}
+
+void
+TextSeqStream::parseLoop()
+{
+    BlockBuilder builder;
+    Parser parser{builder};
+    SeqChunkCompiler compiler;
+    const char *p = m_str;
+    const char *end = m_str + m_len;
+    auto chunk_lines = max(m_config.chunk_lines, size_t(1));
+    try {
+        while (p) {
+            // `lineNum` and `currT` carry over to the next chunk.
+            builder.clear();
+            p = parseLines(parser, p, end, chunk_lines);
+            // Loops are compiled as a whole.
+            while (p && builder.loopDepth())
+                p = parseLines(parser, p, end, 1);
+            // What is known about the outputs doesn't carry over
+            // to the next chunk.
+            OptimizeStats opt;
+            if (m_config.optimize)
+                opt = optimizeInstructionList(builder);
+            CompiledSeq chunk;
+            compiler.compile(chunk, builder.data(), builder.size());
+            if (!p)
+                compiler.finish(chunk);
+            std::unique_lock<std::mutex> locker(m_lock);
+            // Only block on the queue once the sequence is allowed to start.
+            // Before that the runner can't make any room.
+            m_cond.wait(locker, [&] {
+                    return m_quit || m_chunks.size() < m_config.max_chunks ||
+                        !validated();
+                });
+            if (m_quit)
+                return;
+            m_chunks.push_back(std::move(chunk));
+            m_ninsts += builder.size();
+            m_opt.merge(opt);
+            m_lines = builder.lineNum;
+            m_len_parsed = builder.currT;
+            m_done = !p;
+            locker.unlock();
+            m_cond.notify_all();
+        }
+    }
+    catch (const std::runtime_error &err) {
+        {
+            std::lock_guard<std::mutex> locker(m_lock);
+            m_error = err.what();
+            m_done = true;
+        }
+        m_cond.notify_all();
+    }
+}
+
+NACS_EXPORT() unsigned
+TextSeqStream::start()
+{
+    m_thread = std::thread([this] { parseLoop(); });
+    std::unique_lock<std::mutex> locker(m_lock);
+    m_cond.wait(locker, [&] { return validated(); });
+    if (!m_error.empty()) {
+        throw std::runtime_error(m_error);
+    }
+    return m_lines;
+}
+
+NACS_EXPORT() bool
+TextSeqStream::run(Controller *__restrict__ ctrler)
+{
+    while (true) {
+        CompiledSeq chunk;
+        {
+            std::unique_lock<std::mutex> locker(m_lock);
+            m_cond.wait(locker, [&] { return m_done || !m_chunks.empty(); });
+            if (m_chunks.empty())
+                break;
+            chunk = std::move(m_chunks.front());
+            m_chunks.pop_front();
+        }
+        m_cond.notify_all();
+        runCompiledSeq(ctrler, chunk);
+        if (m_has_compiled) {
+            m_compiled.append(chunk);
+            if (m_compiled.cacheSize() > m_config.max_compiled) {
+                m_has_compiled = false;
+                m_compiled = CompiledSeq();
+            }
+        }
+    }
+    m_thread.join();
+    m_compiled.pulses.shrink_to_fit();
+    return m_error.empty();
+}
+
+}
+}
@@ -0,0 +1,154 @@
+#ifndef __NACS_PULSER_TEXT_SEQ_H__
+#define __NACS_PULSER_TEXT_SEQ_H__
+
+#include "instruction.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace NaCs {
+namespace Pulser {
+
+/**
+ * Parse the text sequence format (`seqtext` of the web interface) into
+ * @builder, one pulse per line, e.g.
+ *
+ *     t = 1 us, TTL(all) = 0x3
+ *     dt = 0.5 us, freq(2) = 100e6  # comment
+ *
+ * The lines between `loop(N)` and `endloop` are repeated N times
+ * without being unrolled in @builder.
+ *
+ * Errors are thrown as `std::runtime_error` with the line number.
+ *
+ * The common forms are parsed in place, lines with anything unusual
+ * are handed to the original parser so that the result is always the same
+ * as `parseTextSeqLegacy`.
+ */
+void parseTextSeq(const char *str, size_t len, BlockBuilder &builder);
+static inline void
+parseTextSeq(const std::string &str, BlockBuilder &builder)
+{
+    parseTextSeq(str.data(), str.size(), builder);
+}
+
+/**
+ * Whether the text has any `loop` or `endloop` lines (outside comments),
+ * without parsing the rest of it.
+ */
+bool hasLoops(const char *str, size_t len);
+
+/**
+ * Parse and run a long text sequence at the same time.
+ *
+ * A parser thread compiles the text in chunks into a bounded queue
+ * and `run` streams the chunks to the controller as they are ready.
+ * The first `validate_lines` lines (and at least `min_lead` of the sequence)
+ * are parsed before `start` returns so that errors in them are thrown
+ * before anything is written to the hardware.
+ * Errors after that stop the sequence at the end of the last good chunk
+ * and are returned by `error`.
+ * Each loop is kept in a single chunk and is unrolled when it is compiled.
+ * The chunks that have run are also joined into the whole sequence
+ * (see `compiled`) until it grows beyond `max_compiled`.
+ * The memory used is only bounded if that limit is set.
+ *
+ * @str must stay valid until `run` returns.
+ */
+class TextSeqStream {
+public:
+    struct Config {
+        // Lines parsed before the sequence can start.
+        size_t validate_lines = 10000;
+        // Minimum length (in cycles) of the sequence parsed before it starts.
+        uint64_t min_lead = 1000000;
+        // Lines in each chunk.
+        size_t chunk_lines = 1024;
+        // Maximum number of chunks in the queue after the sequence starts.
+        size_t max_chunks = 64;
+        // Maximum size (see `CompiledSeq::cacheSize`) of the sequence
+        // kept for `compiled`.
+        size_t max_compiled = SIZE_MAX;
+        // Run `optimizeInstructionList` on each chunk.
+        bool optimize = false;
+    };
+    TextSeqStream(const char *str, size_t len, const Config &config);
+    TextSeqStream(const char *str, size_t len)
+        : TextSeqStream(str, len, Config())
+    {}
+    ~TextSeqStream();
+
+    // Start the parser thread and wait for the validation window.
+    // Returns the number of lines parsed so far.
+    // Throws `std::runtime_error` with the line number on parse errors.
+    unsigned start();
+    // Run the sequence with the controller locked.
+    // Returns `false` if the parser hits an error.
+    bool run(Controller *__restrict__ ctrler);
+    const std::string &error() const
+    {
+        return m_error;
+    }
+
+    // The whole sequence after a successful `run`, e.g. for the cache.
+    // Only valid if `hasCompiled()`, i.e. it is not larger than
+    // `max_compiled`.
+    CompiledSeq &compiled()
+    {
+        return m_compiled;
+    }
+    bool hasCompiled() const
+    {
+        return m_has_compiled;
+    }
+    // Only valid after `run` returns.
+    size_t numInsts() const
+    {
+        return m_ninsts;
+    }
+    const OptimizeStats &optimizeStats() const
+    {
+        return m_opt;
+    }
+    uint64_t length() const
+    {
+        return m_len_parsed;
+    }
+
+private:
+    void parseLoop();
+    bool validated() const;
+
+    const char *const m_str;
+    const size_t m_len;
+    const Config m_config;
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<CompiledSeq> m_chunks;
+    bool m_done = false;
+    bool m_quit = false;
+    std::string m_error;
+    size_t m_ninsts = 0;
+    OptimizeStats m_opt;
+    unsigned m_lines = 0;
+    uint64_t m_len_parsed = 0;
+
+    CompiledSeq m_compiled;
+    bool m_has_compiled = true;
+    std::thread m_thread;
+};
+
+/**
+ * The original `std::stringstream` based parser.
+ * Kept as the reference for `parseTextSeq`.
+ */
+void parseTextSeqLegacy(const std::string &str, BlockBuilder &builder);
+
+}
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include "thread_config.h"
+
+#include <nacs-utils/utils.h>
+#include <nacs-utils/log.h>
+
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace NaCs {
+namespace Pulser {
+
+static void
+reportThread(pthread_t thread, const char *name)
+{
+    int policy;
+    sched_param param;
+    if (int err = pthread_getschedparam(thread, &policy, &param)) {
+        Log::error("%s: cannot get scheduling policy: %s\n",
+                   name, strerror(err));
+        return;
+    }
+    std::string sched;
+    if (policy == SCHED_FIFO) {
+        sched = "SCHED_FIFO priority " + std::to_string(param.sched_priority);
+    } else if (policy == SCHED_RR) {
+        sched = "SCHED_RR priority " + std::to_string(param.sched_priority);
+    } else {
+        sched = "SCHED_OTHER";
+    }
+    std::string cpus;
+    cpu_set_t cpu_set;
+    if (pthread_getaffinity_np(thread, sizeof(cpu_set), &cpu_set) == 0) {
+        int ncpu = (int)sysconf(_SC_NPROCESSORS_CONF);
+        for (int i = 0;i < ncpu && i < CPU_SETSIZE;i++) {
+            if (!CPU_ISSET(i, &cpu_set))
+                continue;
+            if (!cpus.empty())
+                cpus += ",";
+            cpus += std::to_string(i);
+        }
+    }
+    Log::log("%s: %s, CPU %s\n", name, sched.c_str(),
+             cpus.empty() ? "unknown" : cpus.c_str());
+}
+
+static bool
+applyConfig(const ThreadConfig &config, pthread_t thread, const char *name)
+{
+    bool res = true;
+    if (config.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config.cpu, &cpus);
+        if (int err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus)) {
+            Log::error("%s: cannot set CPU affinity to %d: %s\n",
+                       name, config.cpu, strerror(err));
+            res = false;
+        }
+    }
+    if (config.priority > 0) {
+        sched_param param;
+        param.sched_priority = config.priority;
+        if (int err = pthread_setschedparam(thread, SCHED_FIFO, &param)) {
+            Log::error("%s: cannot set SCHED_FIFO priority %d: %s\n",
+                       name, config.priority, strerror(err));
+            res = false;
+        }
+    }
+    reportThread(thread, name);
+    return res;
+}
+
+NACS_EXPORT() bool
+ThreadConfig::apply(const char *name) const
+{
+    if (priority > 0)
+        prefaultStack();
+    return applyConfig(*this, pthread_self(), name);
+}
+
+NACS_EXPORT() bool
+ThreadConfig::apply(std::thread &thread, const char *name) const
+{
+    return applyConfig(*this, thread.native_handle(), name);
+}
+
+NACS_EXPORT() bool
+lockMemory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        Log::error("Cannot lock memory: %s\n", strerror(errno));
+        return false;
+    }
+    Log::log("Locked process memory.\n");
+    return true;
+}
+
+NACS_EXPORT() __attribute__((noinline)) void
+prefaultStack(size_t size)
+{
+    // `alloca` so that the buffer is on the stack and isn't optimized out.
+    auto p = (volatile char*)alloca(size);
+    auto page = size_t(sysconf(_SC_PAGESIZE));
+    for (size_t i = 0;i < size;i += page) {
+        p[i] = 0;
+    }
+}
+
+}
+}
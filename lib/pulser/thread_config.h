@@ -0,0 +1,48 @@
+#ifndef __NACS_PULSER_THREAD_CONFIG_H__
+#define __NACS_PULSER_THREAD_CONFIG_H__
+
+#include <stddef.h>
+#include <thread>
+
+namespace NaCs {
+namespace Pulser {
+
+/**
+ * CPU affinity and real time scheduling of a thread.
+ */
+struct ThreadConfig {
+    // CPU to pin the thread to, `-1` to run on any CPU.
+    int cpu = -1;
+    // `SCHED_FIFO` priority, `0` to keep the default scheduling.
+    int priority = 0;
+
+    ThreadConfig(int cpu=-1, int priority=0)
+        : cpu(cpu),
+          priority(priority)
+    {}
+    // Apply to the calling thread, @name is only used in the log.
+    // The stack of real time threads is also prefaulted.
+    // Failures are logged and do not stop the thread.
+    // The resulting scheduling of the thread is logged in either case.
+    bool apply(const char *name) const;
+    // Apply to another thread, e.g. the helper threads of `Controller`.
+    bool apply(std::thread &thread, const char *name) const;
+};
+
+/**
+ * Lock all current and future pages of the process in memory
+ * so that the real time threads never wait for a page fault.
+ * This includes the full stack of each thread created afterward.
+ */
+bool lockMemory();
+
+/**
+ * Touch @size bytes of the stack of the calling thread so that they are
+ * mapped (and locked after `lockMemory`) before they are needed.
+ */
+void prefaultStack(size_t size=256 * 1024);
+
+}
+}
+
+#endif
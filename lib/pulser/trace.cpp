@@ -0,0 +1,97 @@
+#include "trace.h"
+
+#include <nacs-utils/utils.h>
+#include <nacs-utils/log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace NaCs {
+namespace Pulser {
+
+static size_t
+roundSize(size_t size)
+{
+    size_t res = 16;
+    while (res < size)
+        res *= 2;
+    return res;
+}
+
+NACS_EXPORT() TraceRing::TraceRing(size_t size)
+    : m_buff((TraceEntry*)calloc(roundSize(size), sizeof(TraceEntry))),
+      m_mask(roundSize(size) - 1)
+{
+    if (unlikely(!m_buff)) {
+        Log::error("Cannot allocate pulse trace buffer.\n");
+        abort();
+    }
+}
+
+NACS_EXPORT() TraceRing::~TraceRing()
+{
+    free(m_buff);
+}
+
+NACS_EXPORT() void
+TraceRing::restart()
+{
+    m_seq_t = 0;
+    record(StartMarker, 0);
+}
+
+NACS_EXPORT() void
+TraceRing::clear()
+{
+    m_seq_t = 0;
+    m_count.store(0, std::memory_order_release);
+}
+
+NACS_EXPORT() std::vector<TraceEntry>
+TraceRing::entries() const
+{
+    auto n = count();
+    auto len = min(n, uint64_t(capacity()));
+    std::vector<TraceEntry> res(len);
+    auto start = (n - len) & m_mask;
+    auto len1 = min(len, uint64_t(capacity() - start));
+    memcpy(res.data(), m_buff + start, len1 * sizeof(TraceEntry));
+    memcpy(res.data() + len1, m_buff, (len - len1) * sizeof(TraceEntry));
+    return res;
+}
+
+NACS_EXPORT() bool
+TraceRing::dump(const char *fname) const
+{
+    auto data = entries();
+    FILE *fp = fopen(fname, "wb");
+    if (!fp) {
+        Log::error("Cannot open trace file %s.\n", fname);
+        return false;
+    }
+    uint64_t n = data.size();
+    bool res = (fwrite("NACSTRC1", 8, 1, fp) == 1 &&
+                fwrite(&n, 8, 1, fp) == 1 &&
+                fwrite(data.data(), sizeof(TraceEntry), n, fp) == n);
+    if (fclose(fp) != 0)
+        res = false;
+    if (!res)
+        Log::error("Failed to write trace file %s.\n", fname);
+    return res;
+}
+
+NACS_EXPORT() TraceRing&
+pulseTrace()
+{
+    static TraceRing trace([] {
+            size_t size = 1024 * 1024;
+            if (auto env = getenv("NACS_PULSER_TRACE_SIZE"))
+                size = max(strtoul(env, nullptr, 0), 16ul);
+            return size;
+        }());
+    return trace;
+}
+
+}
+}
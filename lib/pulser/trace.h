@@ -0,0 +1,124 @@
+#ifndef __NACS_PULSER_TRACE_H__
+#define __NACS_PULSER_TRACE_H__
+
+#include <nacs-pulser/pulser-config.h>
+#include <nacs-utils/timer.h>
+#include <nacs-seq/seq.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <vector>
+
+namespace NaCs {
+namespace Pulser {
+
+struct TraceEntry {
+    // Host time (`getTime()`) when the instruction was written.
+    uint64_t host_ns;
+    // Sequence time at the start of the instruction in FPGA cycles,
+    // i.e. the sum of the lengths of all the instructions written since the
+    // last `TraceRing::restart()`.
+    uint64_t seq_t;
+    uint32_t ctrl;
+    uint32_t op;
+};
+static_assert(sizeof(TraceEntry) == 24, "");
+
+/**
+ * Fixed size ring buffer of the instructions written to the FIFO.
+ *
+ * There should only be one writer (the same requirement as the FIFO
+ * register itself) and recording an instruction never blocks or allocates.
+ * Old entries are overwritten when the ring is full.
+ * Reading the trace while the writer is active may return a few entries
+ * that are being overwritten so it should normally be done between
+ * sequences.
+ */
+class TraceRing {
+    TraceRing(const TraceRing&) = delete;
+    void operator=(const TraceRing&) = delete;
+public:
+    // Marks the start of a sequence, @op is `0`.
+    static constexpr uint32_t StartMarker = 0xffffffff;
+
+    // @size is rounded up to a power of 2.
+    TraceRing(size_t size);
+    ~TraceRing();
+
+    inline void
+    record(uint32_t ctrl, uint32_t op)
+    {
+        auto n = m_count.load(std::memory_order_relaxed);
+        auto &entry = m_buff[n & m_mask];
+        entry.host_ns = getTime();
+        entry.seq_t = m_seq_t;
+        entry.ctrl = ctrl;
+        entry.op = op;
+        m_seq_t += instLength(ctrl);
+        m_count.store(n + 1, std::memory_order_release);
+    }
+    // Reset the sequence time.
+    void restart();
+    // Total number of entries recorded (including the overwritten ones).
+    inline uint64_t
+    count() const
+    {
+        return m_count.load(std::memory_order_acquire);
+    }
+    inline size_t
+    capacity() const
+    {
+        return m_mask + 1;
+    }
+    // Drop all the entries.
+    void clear();
+    // The entries still in the ring, oldest first.
+    std::vector<TraceEntry> entries() const;
+    /**
+     * Write the entries still in the ring to @fname.
+     * The file starts with a 16 bytes header: the magic `"NACSTRC1"`
+     * and the number of entries as a little endian `uint64_t`,
+     * followed by the entries in `TraceEntry` layout (little endian).
+     * Returns `false` if the file can't be written.
+     */
+    bool dump(const char *fname) const;
+
+    // Length of an instruction in FPGA cycles.
+    static inline uint32_t
+    instLength(uint32_t ctrl)
+    {
+        switch (ctrl >> 28) {
+        case 0x0: // TTL
+        case 0x2: // Wait
+            return ctrl & 0xffffff;
+        case 0x1:
+            return Seq::PulseTime::_DDS;
+        case 0x6: // SPI
+            return 45;
+        case 0xf: // StartMarker
+            return 0;
+        default:
+            return 5;
+        }
+    }
+private:
+    TraceEntry *const m_buff;
+    const size_t m_mask;
+    std::atomic<uint64_t> m_count{0};
+    uint64_t m_seq_t = 0;
+};
+
+/**
+ * The trace of all the instructions written by `Driver::shortPulse`
+ * (only recorded when the library is built with `ENABLE_PULSER_TRACE`).
+ * The size can be set with the environment variable `NACS_PULSER_TRACE_SIZE`
+ * (number of entries, default 1M).
+ */
+TraceRing &pulseTrace();
+
+}
+}
+
+#endif
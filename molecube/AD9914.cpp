@@ -1,8 +1,10 @@
 //
 
 #include "AD9914.h"
+#include "molecube.h"
 
 #include <nacs-pulser/controller.h>
+#include <nacs-pulser/dds_state.h>
 #include <nacs-utils/log.h>
 
 using namespace std::literals;
@@ -17,14 +19,23 @@ print_registers(Controller &ctrl, int i)
 {
     static constexpr bool nonZeroOnly = true;
 
+    // Read all the registers in one batch instead of one round trip each.
+    RequestBatch batch(ctrl, 0x80 / 2);
+    std::vector<RequestBatch::Result<DDSGetTwoBytes> > res;
+    res.reserve(0x80 / 2);
+    for (unsigned addr = 0;addr < 0x80;addr += 2) {
+        res.push_back(batch.add(DDSGetTwoBytes(i, addr)));
+    }
+    batch.run();
+
     Log::log("*******************************\n");
     if (nonZeroOnly) {
         Log::log("***only show non-zero values***\n");
     }
 
     for (unsigned addr = 0;addr + 3 <= 0x7F;addr += 4) {
-        uint32_t u0 = ctrl.run(DDSGetTwoBytes(i, addr));
-        uint32_t u2 = ctrl.run(DDSGetTwoBytes(i, addr + 2));
+        uint32_t u0 = res[addr / 2].get();
+        uint32_t u2 = res[addr / 2 + 1].get();
         uint32_t u = ((u2 & 0xffff) << 16 ) | (u0 & 0xffff);
 
         if (u || !nonZeroOnly) {
@@ -35,38 +46,12 @@ print_registers(Controller &ctrl, int i)
     Log::log("*******************************\n");
 }
 
-// Initialize the DDS.
-// return true if init was performed
-bool
-init(Controller &ctrl, int i, InitFlags flags)
-{
-    const unsigned magic_bytes = 0xf00f0000;
-    bool force = flags & Force;
-    bool log_verbose = flags & LogVerbose;
-    bool log = log_verbose || (flags & LogAction);
-    if (!force) {
-        // Check if magic bytes have been set (profile 7, FTW) which is
-        // otherwise not used.  If already set, the board has been initialized
-        // and doesn't need another init.  This avoids reboot-induced glitches.
-
-        uint32_t u0 = ctrl.run(DDSGetFourBytes(i, 0x64));
-        if (log_verbose)
-            Log::log("AD9914 board=%i  FTW7 = %08X\n", i, u0);
-        if (u0 == magic_bytes) {
-            if (log_verbose)
-                Log::log("No initialization required\n");
-            return false;
-        }
-        if (log) {
-            Log::log("Initialization required\n");
-        }
-    }
+static const unsigned magic_bytes = 0xf00f0000;
 
-    ctrl.run(DDSReset(i));
-
-    // calibrate internal timing.  required at power-up
-    ctrl.run(DDSSetTwoBytes(i, 0x0E, 0x0105));
-    std::this_thread::sleep_for(1ms);
+// Program the DDS after the calibration started by `init_all`.
+static void
+finish_init(Controller &ctrl, int i)
+{
     // finish cal. disble sync_out
     ctrl.run(DDSSetTwoBytes(i, 0x0E, 0x0405));
 
@@ -99,10 +84,71 @@ init(Controller &ctrl, int i, InitFlags flags)
     }
 
     ctrl.run(DDSSetFourBytes(i, 0x64, magic_bytes));
+    dds_cache->invalidate(i);
+}
 
-    if (log)
-        Log::log("Initialized AD9914 board=%i\n", i);
-    return true;
+// Initialize the DDS's.
+// return the ones that were initialized
+std::vector<unsigned>
+init_all(Controller &ctrl, const std::vector<unsigned> &boards,
+         InitFlags flags)
+{
+    bool force = flags & Force;
+    bool log_verbose = flags & LogVerbose;
+    bool log = log_verbose || (flags & LogAction);
+    std::vector<unsigned> todo;
+    if (force) {
+        todo = boards;
+    } else {
+        // Check if magic bytes have been set (profile 7, FTW) which is
+        // otherwise not used.  If already set, the board has been initialized
+        // and doesn't need another init.  This avoids reboot-induced glitches.
+        // All the boards are checked in one batch.
+        RequestBatch batch(ctrl, boards.size());
+        std::vector<RequestBatch::Result<DDSGetFourBytes> > res;
+        res.reserve(boards.size());
+        for (auto i: boards)
+            res.push_back(batch.add(DDSGetFourBytes(int(i), 0x64)));
+        batch.run();
+        for (size_t k = 0;k < boards.size();k++) {
+            auto i = boards[k];
+            uint32_t u0 = res[k].get();
+            if (log_verbose)
+                Log::log("AD9914 board=%i  FTW7 = %08X\n", i, u0);
+            if (u0 == magic_bytes) {
+                if (log_verbose)
+                    Log::log("No initialization required\n");
+                continue;
+            }
+            if (log) {
+                Log::log("Initialization required\n");
+            }
+            todo.push_back(i);
+        }
+    }
+    if (todo.empty())
+        return todo;
+
+    // calibrate internal timing.  required at power-up
+    // All the boards calibrate during the same sleep.
+    for (auto i: todo) {
+        ctrl.run(DDSReset(int(i)));
+        ctrl.run(DDSSetTwoBytes(int(i), 0x0E, 0x0105));
+    }
+    std::this_thread::sleep_for(1ms);
+    for (auto i: todo) {
+        finish_init(ctrl, int(i));
+        if (log) {
+            Log::log("Initialized AD9914 board=%i\n", i);
+        }
+    }
+    return todo;
+}
+
+bool
+init(Controller &ctrl, int i, InitFlags flags)
+{
+    return !init_all(ctrl, {unsigned(i)}, flags).empty();
 }
 
 }
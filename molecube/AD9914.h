@@ -1,6 +1,8 @@
 #ifndef AD9914_H
 #define AD9914_H
 
+#include <vector>
+
 namespace NaCs {
 namespace Pulser {
 class Controller;
@@ -12,6 +14,11 @@ enum InitFlags : int {
     LogVerbose = 1 << 2,
 };
 bool init(Pulser::Controller &ctrl, int i, InitFlags flags=LogVerbose);
+// Same as `init` for multiple DDS's, the checks and calibrations of
+// all the DDS's are done together.
+std::vector<unsigned> init_all(Pulser::Controller &ctrl,
+                               const std::vector<unsigned> &boards,
+                               InitFlags flags=LogVerbose);
 void print_registers(Pulser::Controller &ctrl, int i);
 }
 }
@@ -4,6 +4,7 @@
 
 #include <nacs-utils/log.h>
 #include <nacs-pulser/controller.h>
+#include <nacs-pulser/dds_state.h>
 
 #include "AD9914.h"
 #include "molecube.h"
@@ -16,7 +17,7 @@ namespace NaCs {
 using namespace Pulser;
 
 Controller&
-init_system()
+init_system(size_t notify_size)
 {
     Log::info("Processor clock frequency: %9.3f MHz\n", 1e-6 * CPU_FREQ_HZ);
     Log::log("NDDS = %d  (REF_CLK = %u MHz)   NSPI = %d\n",
@@ -32,7 +33,9 @@ init_system()
         Log::error("Set priority to %d.  FAILURE  ERRNO=%d\n", nice, errno);
     }
 
-    static Controller ctrl(mapPulserAddr());
+    static Controller ctrl(mapPulserAddr(), notify_size);
+    static DDSCache cache(ctrl);
+    dds_cache = &cache;
     CtrlLocker locker(ctrl);
     ctrl.init();
     Log::log("Initializing pulse controller...done.\n");
@@ -40,15 +43,21 @@ init_system()
     ctrl.run(ClearTimingCheck());
 
     // detect active DDS
+    RequestBatch batch(ctrl, PULSER_NDDS * 4);
+    std::vector<RequestBatch::Result<DDSExists> > exists;
     for (unsigned j = 0;j < PULSER_NDDS;j++) {
-        if (ctrl.run(DDSExists(j))) {
+        exists.push_back(batch.add(DDSExists(j)));
+    }
+    batch.run();
+    for (unsigned j = 0;j < PULSER_NDDS;j++) {
+        if (exists[j].get()) {
             active_dds.push_back(j);
         }
     }
 
     // initialize active DDS if necessary
+    AD9914::init_all(ctrl, active_dds);
     for (auto i: active_dds) {
-        AD9914::init(ctrl, i);
         AD9914::print_registers(ctrl, i);
     }
 
@@ -1,6 +1,8 @@
 #ifndef __MOLECUBE_INIT_SYSTEM_H__
 #define __MOLECUBE_INIT_SYSTEM_H__
 
+#include <stddef.h>
+
 #define CPU_FREQ_HZ (667000000)
 
 namespace NaCs {
@@ -8,7 +10,7 @@ namespace Pulser {
 class Controller;
 }
 
-Pulser::Controller &init_system();
+Pulser::Controller &init_system(size_t notify_size);
 
 }
 
@@ -13,11 +13,15 @@
 #include <nacs-utils/log.h>
 #include <nacs-utils/zmq_utils.h>
 #include <nacs-pulser/controller.h>
+#include <nacs-pulser/dds_state.h>
+#include <nacs-pulser/instruction.h>
 
 #include <stdexcept>
 #include <fstream>
 #include <map>
 #include <atomic>
+#include <deque>
+#include <condition_variable>
 
 #include <unistd.h>
 #include <errno.h>
@@ -108,6 +112,7 @@ namespace NaCs {
 
 volatile bool g_stop_curr_seq = false;
 std::vector<unsigned> active_dds; // all DDS that are available
+Pulser::DDSCache *dds_cache = nullptr;
 
 static void
 handleINT(int)
@@ -145,6 +150,40 @@ printUsage()
     printf(" -s startup_file_name : "
            "If specified, run startup pulse sequence from file.\n");
     printf(" -s zmq address to listen to.\n");
+    printf(" -dds-cache on|off|verify : DDS register cache mode "
+           "(default: on).\n");
+    printf(" -seq-cache size_MB : Memory limit of the sequence caches "
+           "(default: 32).\n");
+    printf(" -txt-stream lines : Start running long text sequences after "
+           "checking the first lines (default: parse the whole sequence).\n");
+    printf(" -txt-optimize : Remove redundant DDS and TTL writes from "
+           "text sequences (per chunk when streamed).\n");
+    printf(" -epilogue full|deferred|minimal : What to run between "
+           "queued ZMQ sequences (default: full).\n");
+    printf(" -lead fixed|adaptive : How far ahead of the FPGA long "
+           "sequences are written (default: fixed).\n");
+    printf(" -runner-thread cpu[:prio] : CPU (-1 for any) and SCHED_FIFO "
+           "priority of the ZMQ sequence runner.\n");
+    printf(" -decode-thread cpu[:prio] : Decode new ZMQ sequences on "
+           "a separate thread while they run.\n");
+    printf(" -writer-thread cpu[:prio] : CPU and SCHED_FIFO priority of "
+           "the FPGA request writer.\n");
+    printf(" -reader-thread cpu[:prio] : CPU and SCHED_FIFO priority of "
+           "the FPGA result reader.\n");
+    printf(" -net-thread cpu[:prio] : CPU and SCHED_FIFO priority of "
+           "the FastCGI and ZMQ threads.\n");
+    printf(" -notify-queue n : Number of write only requests waiting to "
+           "be notified by the reader thread (default: 1024).\n");
+    printf(" -reader-spin us : Poll for results for this long after "
+           "the last request before sleeping (default: 0).\n");
+    printf(" -lock-memory : Lock all memory (including thread stacks) "
+           "to avoid page faults.\n");
+    printf(" -record-seq dir : Save all the ZMQ sequences in this "
+           "directory.\n");
+    printf(" -slack-threshold ms : Count the times the FIFO is less than "
+           "this far ahead (default: 50).\n");
+    printf(" -trace-file path : Save the instruction trace of sequences "
+           "with timing failures.\n");
     printf(" -h or --help : Print help / usage info.\n");
     printf("\n\n");
 }
@@ -156,6 +195,147 @@ getRequestId()
     return id.fetch_add(1, std::memory_order_relaxed);
 }
 
+// A validated `run_seq` request waiting to be run.
+struct SeqJob {
+    std::vector<zmq::message_t> addr;
+    std::shared_ptr<const Pulser::EncodedByteCode> code;
+    uint64_t len_ns;
+    uint32_t ttl_mask;
+    int request_id;
+    // Only used when `code` is `nullptr` (see `setDecodeThread`)
+    RawByteCode raw;
+};
+
+// Sequences are run on a separate thread so that the ZMQ thread can
+// receive and decode the next sequence while the current one is running.
+class SeqQueue {
+public:
+    size_t
+    push(SeqJob &&job)
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_jobs.push_back(std::move(job));
+        m_cond.notify_one();
+        return m_jobs.size();
+    }
+    SeqJob
+    pop()
+    {
+        std::unique_lock<std::mutex> locker(m_lock);
+        m_cond.wait(locker, [&] { return !m_jobs.empty(); });
+        auto job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        return job;
+    }
+    bool
+    tryPop(SeqJob &job)
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        if (m_jobs.empty())
+            return false;
+        job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        return true;
+    }
+private:
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<SeqJob> m_jobs;
+};
+
+static constexpr const char *seq_reply_addr = "inproc://molecube-seq-reply";
+
+// The ROUTER socket can only be used from the ZMQ thread.
+// Replies for sequences are sent to it through a PAIR socket and forwarded.
+static void
+runSeqExecutor(zmq::context_t &ctx, Pulser::Controller &ctrl, SeqQueue &queue,
+               const Pulser::ThreadConfig &config)
+{
+    config.apply("Sequence runner");
+    zmq::socket_t sock(ctx, ZMQ_PAIR);
+    sock.connect(seq_reply_addr);
+    zmq::message_t empty(0);
+    auto make_seq = [&] (SeqJob &&job) {
+        auto addr = std::make_shared<std::vector<zmq::message_t> >(
+            std::move(job.addr));
+        auto request_id = job.request_id;
+        return ByteCodeSeq{job.len_ns, std::move(job.code), job.ttl_mask,
+                [&sock, &empty, addr, request_id] {
+                    ZMQ::send_addr(sock, *addr, empty);
+                    ZMQ::send(sock, ZMQ::bits_msg(uint64_t(1)));
+                    Log::log("==== Finish ZMQ sequence %d ====\n\n",
+                             request_id);
+                }, std::move(job.raw)};
+    };
+    while (true) {
+        handleRunByteCodes(ctrl, make_seq(queue.pop()), [&] (ByteCodeSeq &seq) {
+                SeqJob job;
+                if (!queue.tryPop(job))
+                    return false;
+                seq = make_seq(std::move(job));
+                return true;
+            });
+    }
+}
+
+// Save the sequence for `test-lead`, the format is the `len_ns` (`uint64_t`)
+// and the `ttl_mask` (`uint32_t`) followed by the bytecode.
+static void
+recordSeq(const std::string &dir, int request_id, uint64_t len_ns,
+          uint32_t ttl_mask, const uint8_t *code, size_t code_len)
+{
+    auto fname = dir + "/seq-" + std::to_string(request_id) + ".bin";
+    FILE *fp = fopen(fname.c_str(), "wb");
+    if (!fp) {
+        Log::error("Cannot record sequence to %s\n", fname.c_str());
+        return;
+    }
+    fwrite(&len_ns, 8, 1, fp);
+    fwrite(&ttl_mask, 4, 1, fp);
+    fwrite(code, 1, code_len, fp);
+    fclose(fp);
+}
+
+// Reply format: number of sequences, number of samples, number of samples
+// below the threshold, histogram (`uint32_t` each), then the threshold and
+// the minimum slack in ns (`int64_t` each).
+static zmq::message_t
+slackStatsMsg(uint32_t nseq, const Pulser::SlackStats &stats)
+{
+    uint32_t counts[3 + Pulser::SlackStats::NBins] = {
+        nseq, stats.nsamples, stats.nlow};
+    memcpy(&counts[3], stats.hist.data(), sizeof(stats.hist));
+    int64_t times[2] = {int64_t(stats.threshold_ns), stats.min_slack};
+    zmq::message_t msg(sizeof(counts) + sizeof(times));
+    memcpy(msg.data(), counts, sizeof(counts));
+    memcpy((char*)msg.data() + sizeof(counts), times, sizeof(times));
+    return msg;
+}
+
+// Parse `CPU[:PRIORITY]`, a CPU of `-1` means any CPU.
+static Pulser::ThreadConfig
+parseThreadConfig(const std::string &str)
+{
+    Pulser::ThreadConfig config;
+    if (sscanf(str.c_str(), "%d:%d", &config.cpu, &config.priority) < 1)
+        Log::error("Invalid thread config: %s\n", str.c_str());
+    return config;
+}
+
+static void
+forwardMsg(zmq::socket_t &from, zmq::socket_t &to)
+{
+    zmq::message_t msg;
+    while (true) {
+        from.recv(&msg);
+        bool more = msg.more();
+        to.send(msg, more ? ZMQ_SNDMORE : 0);
+        if (!more) {
+            break;
+        }
+    }
+}
+
 }
 
 using namespace NaCs;
@@ -187,9 +367,76 @@ main(int argc, char *argv[])
 
     setProgramStatus("Initializing");
 
-    auto &ctrl = init_system();
+    if (cla.FindString("-lock-memory") >= 0 && Pulser::lockMemory())
+        Pulser::prefaultStack();
+    std::string notify_queue = cla.GetStringAfter("-notify-queue", "");
+    auto &ctrl = init_system(notify_queue.empty() ? 1024 :
+                             size_t(atoi(notify_queue.c_str())));
+    ctrl.setThreadConfig(
+        parseThreadConfig(cla.GetStringAfter("-reader-thread", "-1")),
+        parseThreadConfig(cla.GetStringAfter("-writer-thread", "-1")));
+    std::string reader_spin = cla.GetStringAfter("-reader-spin", "");
+    if (!reader_spin.empty()) {
+        ctrl.setReaderSpin(uint64_t(atof(reader_spin.c_str()) * 1e3));
+        Log::log("Reader spin time: %s us\n", reader_spin.c_str());
+    }
+    auto net_config =
+        parseThreadConfig(cla.GetStringAfter("-net-thread", "-1"));
     FCGX_Init();
 
+    std::string dds_cache_mode = cla.GetStringAfter("-dds-cache", "on");
+    if (dds_cache_mode == "off") {
+        dds_cache->setMode(Pulser::DDSCache::Disabled);
+    } else if (dds_cache_mode == "verify") {
+        dds_cache->setMode(Pulser::DDSCache::Verify);
+    } else if (dds_cache_mode != "on") {
+        Log::error("Unknown DDS cache mode: %s\n", dds_cache_mode.c_str());
+    }
+    Log::log("DDS cache mode: %s\n", dds_cache_mode.c_str());
+
+    std::string epilogue = cla.GetStringAfter("-epilogue", "full");
+    if (epilogue == "deferred") {
+        setEpiloguePolicy(EpiloguePolicy::Deferred);
+    } else if (epilogue == "minimal") {
+        setEpiloguePolicy(EpiloguePolicy::Minimal);
+    } else if (epilogue != "full") {
+        Log::error("Unknown epilogue policy: %s\n", epilogue.c_str());
+    }
+
+    std::string seq_cache_size = cla.GetStringAfter("-seq-cache", "");
+    if (!seq_cache_size.empty()) {
+        setSeqCacheSize(size_t(atoi(seq_cache_size.c_str())) * 1024 * 1024);
+    }
+
+    std::string txt_stream = cla.GetStringAfter("-txt-stream", "");
+    if (!txt_stream.empty()) {
+        setTextSeqStream(size_t(atoi(txt_stream.c_str())));
+    }
+    if (cla.FindString("-txt-optimize") >= 0)
+        setTextSeqOptimize(true);
+
+    std::string lead = cla.GetStringAfter("-lead", "fixed");
+    if (lead == "adaptive") {
+        setAdaptiveLead(true);
+    } else if (lead != "fixed") {
+        Log::error("Unknown lead policy: %s\n", lead.c_str());
+    }
+
+    std::string slack_threshold = cla.GetStringAfter("-slack-threshold", "");
+    if (!slack_threshold.empty()) {
+        setSlackThreshold(uint64_t(atof(slack_threshold.c_str()) * 1e6));
+    }
+
+    std::string trace_file = cla.GetStringAfter("-trace-file", "");
+    if (!trace_file.empty()) {
+#if PULSER_TRACE
+        setTraceFile(trace_file);
+        Log::log("Instruction trace file: %s\n", trace_file.c_str());
+#else
+        Log::error("Instruction trace is not enabled in this build.\n");
+#endif
+    }
+
     // run startup sequence
     std::string fnameStartup = cla.GetStringAfter("-s", "");
     if (fnameStartup.length()) {
@@ -247,19 +494,42 @@ main(int argc, char *argv[])
     std::vector<std::thread> workers;
     for (size_t i = 0;i < numWorkers;i++) {
         workers.emplace_back(processRequests);
+        auto name = "FastCGI worker " + std::to_string(i);
+        net_config.apply(workers.back(), name.c_str());
     }
     std::string zmqaddr = cla.GetStringAfter("-z", "");
+    auto runner_config =
+        parseThreadConfig(cla.GetStringAfter("-runner-thread", "-1"));
+    std::string decode_thread = cla.GetStringAfter("-decode-thread", "");
+    if (!decode_thread.empty())
+        setDecodeThread(parseThreadConfig(decode_thread));
+    std::string record_dir = cla.GetStringAfter("-record-seq", "");
     if (!zmqaddr.empty()) {
         auto processZMQ = [&] {
             zmq::context_t ctx;
             zmq::socket_t sock(ctx, ZMQ_ROUTER);
             sock.bind(zmqaddr);
+            zmq::socket_t seq_reply_sock(ctx, ZMQ_PAIR);
+            seq_reply_sock.bind(seq_reply_addr);
+            SeqQueue seq_queue;
+            std::thread executor([&] {
+                    runSeqExecutor(ctx, ctrl, seq_queue, runner_config);
+                });
             zmq::message_t empty(0);
             auto send_reply = [&] (auto &addr, auto &&msg) {
                 ZMQ::send_addr(sock, addr, empty);
                 ZMQ::send(sock, msg);
             };
+            zmq::pollitem_t poll_items[] = {
+                {(void*)sock, 0, ZMQ_POLLIN, 0},
+                {(void*)seq_reply_sock, 0, ZMQ_POLLIN, 0},
+            };
             while (true) {
+                zmq::poll(poll_items, 2);
+                if (poll_items[1].revents & ZMQ_POLLIN)
+                    forwardMsg(seq_reply_sock, sock);
+                if (!(poll_items[0].revents & ZMQ_POLLIN))
+                    continue;
                 auto addr = ZMQ::recv_addr(sock);
 
                 auto request_id = getRequestId();
@@ -276,6 +546,12 @@ main(int argc, char *argv[])
                     uint32_t hi = ctrl.getTTLHighMask();
                     send_reply(addr, ZMQ::bits_msg(uint32_t(lo | hi)));
                 }
+                else if (ZMQ::match(msg, "seq_stats")) {
+                    // Slack of the sequences run since the last request.
+                    Pulser::SlackStats stats;
+                    uint32_t nseq = takeSlackStats(stats);
+                    send_reply(addr, slackStatsMsg(nseq, stats));
+                }
                 else if (ZMQ::match(msg, "run_seq")) {
                     if (!ZMQ::recv_more(sock, msg) || msg.size() != 4) {
                         // No version
@@ -313,9 +589,35 @@ main(int argc, char *argv[])
                         msg_data += 4;
                         msg_sz -= 4;
                     }
-                    handleRunByteCode(ctrl, len_ns, msg_data, msg_sz, [&] {
-                            send_reply(addr, ZMQ::bits_msg(uint64_t(1)));
-                        }, ttl_mask);
+                    if (!record_dir.empty())
+                        recordSeq(record_dir, request_id, len_ns, ttl_mask,
+                                  msg_data, msg_sz);
+                    // The message is not needed anymore once encoded.
+                    std::shared_ptr<const Pulser::EncodedByteCode> code;
+                    try {
+                        code = loadByteCode(msg_data, msg_sz);
+                    } catch (const std::runtime_error &err) {
+                        Log::error("Invalid bytecode in request %d: %s\n",
+                                   request_id, err.what());
+                        send_reply(addr, ZMQ::bits_msg(uint64_t(0)));
+                        goto out;
+                    }
+                    RawByteCode raw;
+                    if (!code) {
+                        // Otherwise the bytecode is run from the message.
+                        // Small messages are stored inline so the data
+                        // pointer has to be taken again after the move.
+                        auto offset = msg_data - (const uint8_t*)msg.data();
+                        auto owner = std::make_shared<zmq::message_t>(
+                            std::move(msg));
+                        auto data = (const uint8_t*)owner->data() + offset;
+                        raw = RawByteCode{std::move(owner), data, msg_sz};
+                    }
+                    SeqJob job{std::move(addr), std::move(code), len_ns,
+                               ttl_mask, request_id, std::move(raw)};
+                    auto npending = seq_queue.push(std::move(job));
+                    Log::log("Queued sequence %d (%zu pending)\n",
+                             request_id, npending);
                 }
                 else {
                     Log::log("Unknown request %d\n", request_id);
@@ -327,6 +629,7 @@ main(int argc, char *argv[])
             }
         };
         workers.emplace_back(std::move(processZMQ));
+        net_config.apply(workers.back(), "ZMQ server");
     }
     for (auto &t: workers) {
         t.join();
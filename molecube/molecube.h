@@ -7,9 +7,13 @@
 #include <mutex>
 
 namespace NaCs {
+namespace Pulser {
+class DDSCache;
+}
 
 extern volatile bool g_stop_curr_seq;
 extern std::vector<unsigned> active_dds; // all DDS that are available
+extern Pulser::DDSCache *dds_cache;
 
 }
 
@@ -1,12 +1,12 @@
 #include "parseMisc.h"
 
 #include <nacs-pulser/controller.h>
+#include <nacs-pulser/dds_state.h>
 
 #include <nacs-utils/number.h>
 #include <nacs-utils/log.h>
 
 #include <iostream>
-#include <mutex>
 
 #include "parseTxtSeq.h"
 #include "saveloadmap.h"
@@ -52,47 +52,25 @@ parseParamsCGI(txtmap_t& params, cgicc::Cgicc& cgi)
 }
 
 static void
-getDeviceParams(Pulser::Controller &ctrl, const std::string &page,
-                txtmap_t &params)
+getDeviceParams(const std::string &page, txtmap_t &params)
 {
     if (page == "dds") {
-        // use threads before we have better ways to deal with multiple
-        // requests
-        std::thread ts[PULSER_NDDS * 3];
-        std::mutex lock;
-        auto requester = [&] (unsigned iDDS) {
-            char key[32];
-            char val[32];
-            double f = 1e-6 * ctrl.reqSync(Pulser::DDSGetFreqF(iDDS));
-            snprintf(key, 32, "freq%d", iDDS);
-            snprintf(val, 32, "%.6f MHz", f);
-            {
-                std::lock_guard<std::mutex> locker(lock);
-                params[key] = val;
-            }
-
-            double A = ctrl.reqSync(Pulser::DDSGetAmpF(iDDS));
-            snprintf(key, 32, "tude%d", iDDS);
-            snprintf(val, 32, "%.4f", A);
-            {
-                std::lock_guard<std::mutex> locker(lock);
-                params[key] = val;
-            }
-
-            double phase = ctrl.reqSync(Pulser::DDSGetPhaseF(iDDS));
-            snprintf(key, 32, "phase%d", iDDS);
-            snprintf(val, 32, "%.3f deg", phase);
-            {
-                std::lock_guard<std::mutex> locker(lock);
-                params[key] = val;
-            }
-        };
-
-        for (unsigned iDDS = 0;iDDS < PULSER_NDDS;iDDS++) {
-            ts[iDDS] = std::thread(requester, iDDS);
-        }
-        for (unsigned iDDS = 0;iDDS < PULSER_NDDS;iDDS++) {
-            ts[iDDS].join();
+        char key[32];
+        char val[32];
+        // Only the active channels are read from the hardware. The inactive
+        // ones keep the values saved in @params (if any).
+        for (auto &state: dds_cache->read(active_dds)) {
+            snprintf(key, 32, "freq%u", state.id);
+            snprintf(val, 32, "%.6f MHz", 1e-6 * state.freqF());
+            params[key] = val;
+
+            snprintf(key, 32, "tude%u", state.id);
+            snprintf(val, 32, "%.4f", state.ampF());
+            params[key] = val;
+
+            snprintf(key, 32, "phase%u", state.id);
+            snprintf(val, 32, "%.3f deg", state.phaseF());
+            params[key] = val;
         }
     }
 }
@@ -112,8 +90,9 @@ setDeviceParams(Pulser::Controller &ctrl, const std::string &page,
             if (pos != params.end()) {
                 double f = 1e6 * atof(pos->second.c_str());
                 Log::log("DDS setfreq(%d): %12.3f\n", iDDS, f);
-                ctrl.reqSync(Pulser::DDSSetFreqF(iDDS, f));
-                unsigned ftw = ctrl.reqSync(Pulser::DDSGetFreq(iDDS));
+                dds_cache->setFreq(iDDS, Pulser::DDSCvt::freq2num(
+                                       f, PULSER_AD9914_CLK));
+                unsigned ftw = dds_cache->read(iDDS).freq;
                 double freq_get =
                     Pulser::DDSCvt::num2freq(ftw, PULSER_AD9914_CLK);
                 Log::log("DDS getfreq(%d): %12.3f  (ftw = %08X)\n",
@@ -126,7 +105,8 @@ setDeviceParams(Pulser::Controller &ctrl, const std::string &page,
             if (pos != params.end()) {
                 double amp = limit(atof(pos->second.c_str()), 1);
                 Log::log("DDS setamp (%d): %6.3f %%\n", iDDS, amp * 100);
-                ctrl.reqSync(Pulser::DDSSetAmpF(iDDS, amp));
+                dds_cache->setAmp(iDDS,
+                                  uint16_t(Pulser::DDSCvt::amp2num(amp)));
             }
 
             sprintf(buff, "phase%d", iDDS);
@@ -134,7 +114,7 @@ setDeviceParams(Pulser::Controller &ctrl, const std::string &page,
             if (pos != params.end()) {
                 double phase = atof(pos->second.c_str());
                 Log::log("DDS setphase(%d): %9.3f degrees\n", iDDS, phase);
-                ctrl.reqSync(Pulser::DDSSetPhaseF(iDDS, phase));
+                dds_cache->setPhase(iDDS, Pulser::DDSCvt::phase2num(phase));
             }
 
             sprintf(buff, "reset%d", iDDS);
@@ -238,7 +218,7 @@ bool parseQueryCGI(Pulser::Controller &ctrl, cgicc::Cgicc &cgi, std::ostream &re
                 txtmap_t params;
                 // TODO FIX absolute path
                 loadMap(params, "/srv/http/userdata/params_" + sPage);
-                getDeviceParams(ctrl, sPage, params);
+                getDeviceParams(sPage, params);
                 dumpMapHTML(params, reply);
                 return true;
             } else {
@@ -14,10 +14,14 @@
 #include "parseTxtSeq.h"
 
 #include <nacs-pulser/instruction.h>
+#include <nacs-pulser/dds_state.h>
+#include <nacs-pulser/text_seq.h>
 #include <nacs-utils/log.h>
 #include <nacs-utils/timer.h>
 #include <nacs-seq/seq.h>
 
+#include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <string>
 #include <stdexcept>
@@ -31,181 +35,14 @@
 #include "linux_file_util.h"
 
 #include "molecube.h"
+#include "seqCache.h"
 
 namespace NaCs {
 
-using Inst = Pulser::InstWriter;
-
 //parse text-encoded pulse sequence
 static bool parseSeqTxt(Pulser::Controller &pulser, unsigned reps, const std::string &seqTxt,
                         bool bForever, std::ostream &reply);
 
-static bool
-get_channel_and_operand(std::string &arg1, std::istream &s, int *channel,
-                        double *operand)
-{
-    std::string line;
-    getline(s, line);
-
-    if (!line.length())
-        return false;
-
-    if (operand)
-        if (!sscanf(line.c_str(), " = %le", operand))
-            return false;
-
-    if (sscanf(arg1.c_str(), " %d", channel))
-        return true;
-
-    return false;
-}
-
-// eat stream up to character == to.  put prior chars into strPrior
-static bool
-eatStreamTo(std::istream &is, char to, std::string &strPrior)
-{
-    while (!is.eof()) {
-        char c;
-        is.get(c);
-
-        if (!is.eof()) {
-            strPrior.push_back(c);
-
-            if (c == to) {
-                return true;
-            }
-        }
-    }
-
-    return false;
-}
-
-static auto
-parseError(Pulser::BlockBuilder &builder, std::string &&text)
-{
-    return std::runtime_error("L" + std::to_string(builder.lineNum) +
-                              ": " + text);
-}
-
-static Pulser::Instruction
-parseReset(Pulser::BlockBuilder &builder, std::string &arg1, std::istream &s,
-           uint64_t *tp)
-{
-    std::string line;
-    getline(s, line);
-    int channel = -1;
-
-    if (!line.length() || !sscanf(arg1.c_str(), " %d", &channel)) {
-        throw parseError(builder, "Failed to parse reset command.");
-    }
-    return Inst::DDS::reset(channel, tp);
-}
-
-static Pulser::Instruction
-parseClockOut(Pulser::BlockBuilder &builder, std::string &arg1, uint64_t *tp)
-{
-    int divider = 0;
-
-    if (arg1.find("off") == 0) {
-        divider = 255;
-    } else {
-        divider = atoi(arg1.c_str()) - 1;
-    }
-
-    if (divider < 0 || divider > 255) {
-        throw parseError(builder, "Bad CLOCK_OUT parameter");
-    }
-    return Inst::clockOut(divider, tp);
-}
-
-static Pulser::Instruction
-parseDACSetVolt(Pulser::BlockBuilder &builder, std::string &arg1,
-                std::istream &s, uint64_t *tp)
-{
-    int chn = -1;
-    double operand = 0;
-
-    if (get_channel_and_operand(arg1, s, &chn, &operand)) {
-        if (chn > 3)
-            throw parseError(builder,
-                             "Invalid DAC (" + std::to_string(chn) + ")");
-        return Inst::dacSetVolt(uint8_t(chn), operand, tp);
-    }
-    throw parseError(builder, "Failed to parse DAC command.");
-}
-
-static Pulser::Instruction
-parseTTL(Pulser::BlockBuilder &builder, std::string &arg1, std::istream &s,
-         uint64_t *tp)
-{
-    std::string line;
-    getline(s, line);
-    unsigned ttl;
-
-    if (!line.length() || !sscanf(line.c_str(), " = %x", &ttl)) {
-        throw parseError(builder, "Failed to parse TTL command.");
-    }
-
-    int channel = -1;
-    if (sscanf(arg1.c_str(), " %d", &channel)) {
-        return Inst::ttl(uint8_t(channel), ttl, tp);
-    } else {
-        if (arg1.find("all") != std::string::npos) {
-            return Inst::ttlAll(ttl, tp);
-        }
-    }
-    throw parseError(builder, "Failed to parse TTL command.");
-}
-
-template<typename Func>
-static Pulser::Instruction
-parseDDS(Pulser::BlockBuilder &builder, std::string &arg1, std::istream &s,
-         Func &&cb, uint64_t *tp)
-{
-    int chn = -1;
-    double operand = 0;
-
-    if (get_channel_and_operand(arg1, s, &chn, &operand)) {
-        if (chn > PULSER_NDDS - 1) {
-            throw parseError(builder,
-                             "Invalid DDS (" + std::to_string(chn) + ")");
-        }
-        return cb(chn, operand, tp);
-    }
-    throw parseError(builder, "Failed to parse DDS command.");
-}
-
-static Pulser::Instruction
-parseCommand(Pulser::BlockBuilder &builder, std::string &cmd,
-             std::string &arg1, std::istream &s, uint64_t *tp)
-{
-    if (cmd.find("TTL") != std::string::npos)
-        return parseTTL(builder, arg1, s, tp);
-
-    if (cmd.find("freq") != std::string::npos)
-        return parseDDS(builder, arg1, s, Inst::DDS::setFreq, tp);
-
-    if (cmd.find("amp") != std::string::npos)
-        return parseDDS(builder, arg1, s, Inst::DDS::setAmp, tp);
-
-    if (cmd.find("phase") != std::string::npos)
-        return parseDDS(builder, arg1, s, Inst::DDS::setPhase, tp);
-
-    if (cmd.find("shiftp") != std::string::npos)
-        return parseDDS(builder, arg1, s, Inst::DDS::shiftPhase, tp);
-
-    if (cmd.find("reset") != std::string::npos)
-        return parseReset(builder, arg1, s, tp);
-
-    if (cmd.find("CLOCK_OUT") != std::string::npos)
-        return parseClockOut(builder, arg1, tp);
-
-    if (cmd.find("dac") != std::string::npos)
-        return parseDACSetVolt(builder, arg1, s, tp);
-
-    throw parseError(builder, "Unknown command.");
-}
-
 // parse URL-encoded pulse sequence
 // Only used for startup
 bool parseSeqURL(Pulser::Controller &ctrl, std::string &seq, std::ostream &reply)
@@ -222,7 +59,7 @@ bool parseSeqURL(Pulser::Controller &ctrl, std::string &seq, std::ostream &reply
         end_pos = seq.length();
 
     std::string seqTxt = seq.substr(start_pos + L, end_pos - start_pos - L);
-    html2txt(seqTxt, 1); //this is a slow function
+    seqTxt.resize(urlDecode(&seqTxt[0], seqTxt.size()));
 
     parseSeqTxt(ctrl, 1, seqTxt, false, reply);
 
@@ -242,11 +79,12 @@ bool parseSeqCGI(Pulser::Controller &ctrl, cgicc::Cgicc &cgi, std::ostream &repl
         Log::log("%zd files attached\n", cgi.getFiles().size());
 
         cgicc::file_iterator i = cgi.getFile("seqtext");
-        if (i != cgi.getFiles().end()) {
-            seqTxt = i->getData();
-        } else {
+        if (i == cgi.getFiles().end())
             return false;
-        }
+        // `getData()` returns a copy of the uploaded data.
+        // Run that copy instead of copying it again into `seqTxt`.
+        parseSeqTxt(ctrl, reps, i->getData(), bForever, reply);
+        return true;
     }
 
     parseSeqTxt(ctrl, reps, seqTxt, bForever, reply);
@@ -254,77 +92,110 @@ bool parseSeqCGI(Pulser::Controller &ctrl, cgicc::Cgicc &cgi, std::ostream &repl
     return true;
 }
 
-static void parsePlainTxt(const std::string &seqTxt,
-                          Pulser::BlockBuilder &builder)
-{
-    // first parse and load up the pulses vector
-    std::stringstream ss0(seqTxt);
-
-    while (!ss0.eof()) {
-        // read line
-        std::string line;
-        getline(ss0, line);
+namespace {
+
+struct TxtSeq {
+    size_t ninsts;
+    uint64_t len;
+    Pulser::CompiledSeq compiled;
+    // Sequences with loops are run from the instruction list instead
+    // so that the loops are not unrolled.
+    Pulser::PackedInstList insts;
+    Pulser::OptimizeStats opt;
+    inline size_t
+    cacheSize() const
+    {
+        return (compiled.cacheSize() + insts.cacheSize() + sizeof(*this) -
+                sizeof(compiled) - sizeof(insts));
+    }
+};
 
-        builder.lineNum++;
+}
 
-        // ignore everything after '#' comment symbol
-        size_t posC = line.find("#");
-        if (posC != std::string::npos)
-            line = line.substr(0, posC);
+static SeqCache<TxtSeq> txt_seq_cache(32 * 1024 * 1024);
+static SeqCache<Pulser::EncodedByteCode> bytecode_cache(32 * 1024 * 1024);
 
-        // ignore blank lines
-        if (line.length() == 0)
-            continue;
+void setSeqCacheSize(size_t size)
+{
+    txt_seq_cache.setMaxSize(size);
+    bytecode_cache.setMaxSize(size);
+}
 
-        // otherwise parse the line
-        std::stringstream ssL(line);
+static size_t txt_stream_lines = 0;
+static bool txt_optimize = false;
 
-        std::string strPrior;
+void setTextSeqOptimize(bool optimize)
+{
+    txt_optimize = optimize;
+}
 
-        // valid lines will start with "dt = " or "t = "
+void setTextSeqStream(size_t validate_lines)
+{
+    txt_stream_lines = validate_lines;
+}
 
-        if (!eatStreamTo(ssL, '=', strPrior)) {
-            continue;
-        }
+static std::string trace_file;
 
-        bool use_dt;
-        double __new_t;
-        ssL >> __new_t;
-        uint64_t new_t = uint64_t(__new_t * PULSER_DT_per_us);
-        if (strPrior.find("dt") != std::string::npos) {
-            use_dt = true;
-        } else if (strPrior.find("t") != std::string::npos) {
-            use_dt = false;
-        } else {
-            throw parseError(builder, "Invalid time spec.");
-        }
+void setTraceFile(const std::string &fname)
+{
+    trace_file = fname;
+}
 
-        // next comes the time unit (not used), then a comma
-        std::string timeunit;
-        getline(ssL, timeunit, ',');
+// Save the instructions of the sequence that just had a timing failure.
+// Only the first failure of any kind of sequence is saved so that it is not
+// overwritten by the later ones.
+static void
+dumpTrace()
+{
+#if PULSER_TRACE
+    static std::atomic<bool> dumped{false};
+    if (trace_file.empty() || dumped.exchange(true))
+        return;
+    if (Pulser::pulseTrace().dump(trace_file.c_str())) {
+        Log::log("Instruction trace written to %s.\n", trace_file.c_str());
+    }
+#endif
+}
 
-        if (ssL.eof()) {
-            throw parseError(builder, "No action.");
-        }
+template<typename T>
+static void
+logSeqCache(const SeqCache<T> &cache, bool hit)
+{
+    Log::log("Sequence cache %s (%zu hits, %zu misses, %zu sequences, "
+             "%zu bytes)\n", hit ? "hit" : "miss", cache.hits(),
+             cache.misses(), cache.count(), cache.size());
+}
 
-        // then comes the command name, followed by '(arg1)'
-        std::string cmd;
-        getline(ssL, cmd, '(');
-        if (ssL.eof()) {
-            throw parseError(builder, "Incomplete action.");
-        }
+// The notification queue should be large enough to never fill up during a
+// sequence since the RT writer then has to notify the requesters itself.
+// Log it when it does so that the size (`-notify-queue`) can be adjusted.
+static void
+logQueueFull(Pulser::Controller &ctrl, size_t prev_count)
+{
+    auto full_count = ctrl.notifyQueueFullCount();
+    if (full_count != prev_count) {
+        Log::log("Notification queue was full %zu times during the sequence "
+                 "(%zu total).\n", full_count - prev_count, full_count);
+    }
+}
 
-        std::string arg1;
-        getline(ssL, arg1, ')');
-        if (ssL.eof()) {
-            throw parseError(builder, "Incomplete action (2).");
-        }
+static void
+replyOptimized(std::ostream &reply, const Pulser::OptimizeStats &opt)
+{
+    if (!opt.removed && !opt.merged_waits)
+        return;
+    reply << "Optimized: removed " << opt.removed << " redundant pulses ("
+          << double(opt.removed_t) * PULSER_DT_us << " us), merged "
+          << opt.merged_waits << " waits." << std::endl;
+}
 
-        if (use_dt) {
-            builder.pulseDT(new_t, parseCommand, builder, cmd, arg1, ssL);
-        } else {
-            builder.pulseAbsT(new_t, parseCommand, builder, cmd, arg1, ssL);
-        }
+// Reinitialize the DDS's that were reset (e.g. by a glitch).
+static void
+checkDDS(Pulser::Controller &ctrl)
+{
+    for (auto i: AD9914::init_all(ctrl, active_dds, AD9914::LogAction)) {
+        Log::log("DDS %d reinit\n", i);
+        AD9914::print_registers(ctrl, i);
     }
 }
 
@@ -338,22 +209,62 @@ static bool parseSeqTxt(Pulser::Controller &ctrl, unsigned reps, const std::stri
 
     Log::log("Parsing pulse sequence\n");
 
-    for (auto i: active_dds) {
-        if (AD9914::init(ctrl, i, AD9914::LogAction)) {
-            Log::log("DDS %d reinit\n", i);
-            AD9914::print_registers(ctrl, i);
-        }
-    }
+    checkDDS(ctrl);
 
     Timer timer;
 
-    Pulser::BlockBuilder builder;
-
     uint64_t parse_time;
-    parsePlainTxt(seqTxt, builder);
+    auto seq = txt_seq_cache.find(seqTxt.data(), seqTxt.size());
+    bool cache_hit = bool(seq);
+    // Long sequences not in the cache start running once the first
+    // `txt_stream_lines` lines are parsed and are cached after the first run.
+    // The ones too large for the cache are streamed again for each repetition
+    // instead of being kept in memory.
+    std::unique_ptr<Pulser::TextSeqStream> stream;
+    Pulser::TextSeqStream::Config stream_config;
+    stream_config.validate_lines = txt_stream_lines;
+    // Each chunk of a streamed sequence is optimized on its own.
+    stream_config.optimize = txt_optimize;
+    auto max_cached = txt_seq_cache.maxSize();
+    stream_config.max_compiled = (max_cached > seqTxt.size() ?
+                                  max_cached - seqTxt.size() : 0);
+    unsigned stream_lines = 0;
+    if (!cache_hit && txt_stream_lines &&
+        size_t(std::count(seqTxt.begin(), seqTxt.end(), '\n')) > txt_stream_lines &&
+        !Pulser::hasLoops(seqTxt.data(), seqTxt.size())) {
+        stream.reset(new Pulser::TextSeqStream(seqTxt.data(), seqTxt.size(),
+                                               stream_config));
+        stream_lines = stream->start();
+    }
+    else if (!cache_hit) {
+        Pulser::BlockBuilder builder;
+        Pulser::parseTextSeq(seqTxt, builder);
+        Pulser::OptimizeStats opt;
+        if (txt_optimize)
+            opt = Pulser::optimizeInstructionList(builder);
+        TxtSeq txt_seq{builder.size(), builder.currT, {}, {}, opt};
+        if (builder.numLoops) {
+            txt_seq.insts = Pulser::packInstructionList(builder);
+        } else {
+            // Lower the sequence once and reuse it for all repetitions.
+            txt_seq.compiled = Pulser::compileInstructionList(builder);
+        }
+        seq = txt_seq_cache.insert(seqTxt.data(), seqTxt.size(),
+                                   std::move(txt_seq));
+    }
     parse_time = timer.elapsed();
+    logSeqCache(txt_seq_cache, cache_hit);
 
-    reply << "Parsed into " << builder.size() << " pulses." << std::endl;
+    if (stream) {
+        reply << "Streaming sequence after " << stream_lines
+              << " lines." << std::endl;
+    } else {
+        reply << "Parsed into " << seq->ninsts << " pulses." << std::endl;
+        replyOptimized(reply, seq->opt);
+    }
+    reply << "Sequence cache " << (cache_hit ? "hit" : "miss") << " ("
+          << txt_seq_cache.hits() << " hits, " << txt_seq_cache.misses()
+          << " misses)" << std::endl;
 
     if (bForever) {
         Log::log("Start continuous run.\n");
@@ -365,13 +276,17 @@ static bool parseSeqTxt(Pulser::Controller &ctrl, unsigned reps, const std::stri
 
     // now run the pulses
     // update status string every 500 ms
-    auto seq_len_ms = double(builder.currT) * PULSER_DT_us * 1e-3;
+    // The length of a streamed sequence is only known after the first run.
+    auto seq_len_ms = stream ? 0 : double(seq->len) * PULSER_DT_us * 1e-3;
 
     unsigned nTimingErrors = 0;
     unsigned iRep;
     Pulser::CtrlLocker locker(ctrl);
+    auto full_count = ctrl.notifyQueueFullCount();
+    // The sequence can change any DDS register.
+    dds_cache->invalidateAll();
     for (iRep = 0;iRep < reps || bForever;iRep++) {
-        if (reps != 1 || seq_len_ms > 500) {
+        if (reps != 1 || stream || seq_len_ms > 500) {
             char buff[64] = {'\0'};
             if (bForever) {
                 snprintf(buff, 64, "Running sequence %d", iRep);
@@ -385,13 +300,47 @@ static bool parseSeqTxt(Pulser::Controller &ctrl, unsigned reps, const std::stri
         // ctrl.waitFinish() is called
         ctrl.setHold();
         ctrl.toggleInit();
-        Pulser::CtrlState state;
-        Pulser::runInstructionList(&ctrl, &state, builder);
+        bool stream_ok = true;
+        if (stream) {
+            stream_ok = stream->run(&ctrl);
+        } else if (!seq->insts.words.empty()) {
+            Pulser::CtrlState state{};
+            Pulser::runInstructionList(&ctrl, &state, seq->insts);
+        } else {
+            Pulser::runCompiledSeq(&ctrl, seq->compiled);
+        }
 
         // wait for pulses finished.
         ctrl.waitFinish();
 
+        if (!stream_ok) {
+            // The part before the error has already run.
+            ctrl.run(Pulser::ClearTimingCheck());
+            dds_cache->invalidateAll();
+            setProgramStatus("Idle");
+            throw std::runtime_error("Sequence stopped at " + stream->error());
+        }
+        if (stream) {
+            seq_len_ms = double(stream->length()) * PULSER_DT_us * 1e-3;
+            // The optimizer only knows what it removed after the first run.
+            if (iRep == 0)
+                replyOptimized(reply, stream->optimizeStats());
+            if (stream->hasCompiled()) {
+                seq = txt_seq_cache.insert(
+                    seqTxt.data(), seqTxt.size(),
+                    TxtSeq{stream->numInsts(), stream->length(),
+                           std::move(stream->compiled()), {},
+                           stream->optimizeStats()});
+                stream.reset();
+            } else if (iRep + 1 < reps || bForever) {
+                stream.reset(new Pulser::TextSeqStream(
+                                 seqTxt.data(), seqTxt.size(), stream_config));
+                stream->start();
+            }
+        }
+
         if (!ctrl.timingOK()) {
+            dumpTrace();
             ctrl.run(Pulser::ClearTimingCheck());
             nTimingErrors++;
         }
@@ -404,6 +353,8 @@ static bool parseSeqTxt(Pulser::Controller &ctrl, unsigned reps, const std::stri
     }
 
     auto run_time = timer.elapsed();
+    dds_cache->invalidateAll();
+    logQueueFull(ctrl, full_count);
 
     reply << "Finished " << iRep << "/" << reps << " pulse sequences." << std::endl;
 
@@ -420,11 +371,151 @@ static bool parseSeqTxt(Pulser::Controller &ctrl, unsigned reps, const std::stri
     return true;
 }
 
+static std::mutex slack_lock;
+static uint64_t slack_threshold = 50000000;
+static Pulser::SlackStats slack_stats;
+static uint32_t slack_nseq = 0;
+
+void setSlackThreshold(uint64_t threshold_ns)
+{
+    std::lock_guard<std::mutex> locker(slack_lock);
+    slack_threshold = threshold_ns;
+    slack_stats.threshold_ns = threshold_ns;
+}
+
+uint32_t takeSlackStats(Pulser::SlackStats &stats)
+{
+    std::lock_guard<std::mutex> locker(slack_lock);
+    stats = slack_stats;
+    slack_stats = Pulser::SlackStats(slack_threshold);
+    auto nseq = slack_nseq;
+    slack_nseq = 0;
+    return nseq;
+}
+
+// Only used by the thread running the sequences.
+static std::unique_ptr<Pulser::LeadController> lead_ctrl;
+
+void setAdaptiveLead(bool adaptive)
+{
+    lead_ctrl.reset(adaptive ? new Pulser::LeadController() : nullptr);
+}
+
+static Pulser::SlackStats
+newSlackStats()
+{
+    std::lock_guard<std::mutex> locker(slack_lock);
+    return Pulser::SlackStats(slack_threshold);
+}
+
+static void
+recordSlack(const Pulser::SlackStats &stats, uint32_t nseq=1)
+{
+    if (stats.nsamples) {
+        std::ostringstream hist;
+        for (auto n: stats.hist)
+            hist << " " << n;
+        Log::log("Slack: min %.3f ms, %u/%u samples below %.1f ms, "
+                 "histogram [%s ]\n", double(stats.min_slack) * 1e-6,
+                 stats.nlow, stats.nsamples, double(stats.threshold_ns) * 1e-6,
+                 hist.str().c_str());
+        if (lead_ctrl) {
+            Log::log("Lead: %.3f ms (%u backoffs)\n",
+                     double(lead_ctrl->lead()) * 1e-6,
+                     lead_ctrl->numBackoffs());
+        }
+    }
+    std::lock_guard<std::mutex> locker(slack_lock);
+    slack_stats.merge(stats);
+    slack_nseq += nseq;
+}
+
+// Only used by the thread running the sequences.
+static std::unique_ptr<Pulser::ByteCodePipeline> decode_pipeline;
+
+void setDecodeThread(const Pulser::ThreadConfig &config)
+{
+    decode_pipeline.reset(new Pulser::ByteCodePipeline(config));
+}
+
+bool hasDecodeThread()
+{
+    return bool(decode_pipeline);
+}
+
+std::shared_ptr<const Pulser::EncodedByteCode>
+loadByteCode(const uint8_t *code, size_t code_len)
+{
+    auto encoded = bytecode_cache.find(code, code_len);
+    bool cache_hit = bool(encoded);
+    if (!cache_hit && !decode_pipeline && bytecode_cache.fits(code_len)) {
+        encoded = bytecode_cache.insert(code, code_len,
+                                        Pulser::encodeByteCode(code, code_len));
+    }
+    else if (!cache_hit) {
+        // Only decoded while it runs. Check it now so that a bad sequence
+        // is rejected before anything is written to the FPGA.
+        Pulser::checkByteCode(code, code_len);
+    }
+    logSeqCache(bytecode_cache, cache_hit);
+    return encoded;
+}
+
+// Run the bytecode of @seq. A sequence that is not in the cache is decoded
+// on the decoder thread while it runs and the result is saved to @encoded
+// if it can be cached. Without the decoder thread it is interpreted directly.
+// @end_t is the expected end time of the previous sequence (`0` if the FPGA
+// is held) and is updated to the end time of this one.
+static uint32_t
+runSeqCode(Pulser::Controller &ctrl, const ByteCodeSeq &seq, bool short_seq,
+           const uint32_t *cur_ttl, Pulser::SlackStats *slack,
+           Pulser::EncodedByteCode *encoded, uint64_t *end_t)
+{
+    if (seq.code)
+        return Pulser::runByteCode(&ctrl, *seq.code, seq.ttl_mask, short_seq,
+                                   cur_ttl, slack, lead_ctrl.get(), end_t);
+    if (!decode_pipeline)
+        return Pulser::runByteCode(&ctrl, seq.raw.data, seq.raw.size,
+                                   seq.ttl_mask, short_seq, cur_ttl, slack,
+                                   lead_ctrl.get(), end_t);
+    if (!bytecode_cache.fits(seq.raw.size))
+        encoded = nullptr;
+    return decode_pipeline->run(&ctrl, seq.raw.data, seq.raw.size,
+                                seq.ttl_mask, short_seq, cur_ttl, slack,
+                                lead_ctrl.get(), encoded, end_t);
+}
+
+static void
+runSingle(Pulser::Controller &ctrl, const ByteCodeSeq &seq);
+
 void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
                        const uint8_t *code, size_t code_len,
                        const std::function<void()> &send_reply,
                        uint32_t ttl_mask)
 {
+    auto encoded = loadByteCode(code, code_len);
+    // @code is alive until the sequence finishes.
+    runSingle(ctrl, ByteCodeSeq{seq_len_ns, std::move(encoded), ttl_mask,
+                send_reply, RawByteCode{nullptr, code, code_len}});
+}
+
+void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
+                       const Pulser::EncodedByteCode &encoded,
+                       const std::function<void()> &send_reply,
+                       uint32_t ttl_mask)
+{
+    // Not owned by the pointer
+    std::shared_ptr<const Pulser::EncodedByteCode> code(
+        std::shared_ptr<const Pulser::EncodedByteCode>(), &encoded);
+    runSingle(ctrl, ByteCodeSeq{seq_len_ns, std::move(code), ttl_mask,
+                send_reply, RawByteCode()});
+}
+
+static void
+runSingle(Pulser::Controller &ctrl, const ByteCodeSeq &seq)
+{
+    auto seq_len_ns = seq.len_ns;
+    auto &send_reply = seq.send_reply;
     Timer timer;
     Log::log("Start sequence %" PRIu64 " ns.\n", seq_len_ns);
 
@@ -435,11 +526,16 @@ void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
         setProgramStatus("Running sequence 1 / 1");
 
     Pulser::CtrlLocker locker(ctrl);
+    auto full_count = ctrl.notifyQueueFullCount();
+    // The sequence can change any DDS register.
+    dds_cache->invalidateAll();
     // hold the sequnce until pulse buffer is full or
     // ctrl.waitFinish() is called
     ctrl.setHold();
     ctrl.toggleInit();
-    Pulser::runByteCode(&ctrl, code, code_len, ttl_mask, short_seq);
+    auto slack = newSlackStats();
+    Pulser::EncodedByteCode encoded;
+    runSeqCode(ctrl, seq, short_seq, nullptr, &slack, &encoded, nullptr);
     ctrl.releaseHold();
 
     if (short_seq) {
@@ -449,12 +545,20 @@ void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
     }
     // wait for pulses finished.
     ctrl.waitFinish();
+    dds_cache->invalidateAll();
     if (!short_seq)
         send_reply();
 
     auto run_time = timer.elapsed();
-    if (!ctrl.timingOK())
+    if (!ctrl.timingOK()) {
         Log::log("Warning: timing failures.\n");
+        dumpTrace();
+    }
+    logQueueFull(ctrl, full_count);
+    recordSlack(slack);
+    // Empty if the sequence wasn't encoded while running.
+    if (!encoded.words.empty())
+        bytecode_cache.insert(seq.raw.data, seq.raw.size, std::move(encoded));
 
     Pulser::runEpilogue(&ctrl);
     Log::log("Exe time: %9.3f ms\n", (double)run_time * 1e-6);
@@ -463,12 +567,99 @@ void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
     // more likely to work. However, that increase the latency and the DDS
     // reset only happen very infrequently so let's do it after the sequence
     // for better efficiency.
-    for (auto i: active_dds) {
-        if (AD9914::init(ctrl, i, AD9914::LogAction)) {
-            Log::log("DDS %d reinit\n", i);
-            AD9914::print_registers(ctrl, i);
+    checkDDS(ctrl);
+    setProgramStatus("Idle");
+}
+
+static EpiloguePolicy epilogue_policy = EpiloguePolicy::Full;
+
+void setEpiloguePolicy(EpiloguePolicy policy)
+{
+    epilogue_policy = policy;
+}
+
+void handleRunByteCodes(Pulser::Controller &ctrl, ByteCodeSeq seq,
+                        const std::function<bool(ByteCodeSeq&)> &next)
+{
+    if (epilogue_policy == EpiloguePolicy::Full) {
+        runSingle(ctrl, seq);
+        return;
+    }
+
+    Timer timer;
+    Pulser::CtrlLocker locker(ctrl);
+    auto full_count = ctrl.notifyQueueFullCount();
+    dds_cache->invalidateAll();
+    ctrl.setHold();
+    ctrl.toggleInit();
+
+    // Keep appending short sequences to the FIFO as long as there are more
+    // in the queue. The hold is released after the first one so the later
+    // ones start right after the previous one without any gap.
+    // Only the last sequence can be a long one since its reply has to wait
+    // for the sequence to finish.
+    unsigned nseq = 0;
+    uint64_t total_ns = 0;
+    uint32_t cur_ttl = 0;
+    // When the FPGA is expected to finish the sequences written so far.
+    // The next sequence starts then instead of when it is written.
+    uint64_t end_t = 0;
+    bool replied = false;
+    // Logged once the queue is empty to not delay the next sequence.
+    auto slack = newSlackStats();
+    // Sequences decoded while running, cached once the queue is empty.
+    std::vector<std::pair<RawByteCode, Pulser::EncodedByteCode> > new_codes;
+    while (true) {
+        bool short_seq = seq.len_ns <= 1000 * 1000 * 1000;
+        Log::log("Start sequence %" PRIu64 " ns.\n", seq.len_ns);
+        if (!short_seq)
+            setProgramStatus("Running sequence 1 / 1");
+        // A sequence that arrives after the previous ones have (almost)
+        // finished is held until it is buffered, like the first one.
+        bool queued = nseq && Pulser::prepareQueuedSeq(&ctrl, end_t);
+        Pulser::EncodedByteCode encoded;
+        cur_ttl = runSeqCode(ctrl, seq, short_seq, queued ? &cur_ttl : nullptr,
+                             &slack, &encoded, &end_t);
+        ctrl.releaseHold();
+        if (!encoded.words.empty())
+            new_codes.emplace_back(seq.raw, std::move(encoded));
+        nseq++;
+        total_ns += seq.len_ns;
+        if (!short_seq)
+            break;
+        seq.send_reply();
+        if (!next(seq)) {
+            replied = true;
+            break;
         }
     }
+
+    ctrl.waitFinish();
+    dds_cache->invalidateAll();
+    if (!replied)
+        seq.send_reply();
+
+    auto run_time = timer.elapsed();
+    if (!ctrl.timingOK()) {
+        Log::log("Warning: timing failures.\n");
+        dumpTrace();
+    }
+    logQueueFull(ctrl, full_count);
+    recordSlack(slack, nseq);
+    for (auto &code: new_codes)
+        bytecode_cache.insert(code.first.data, code.first.size,
+                              std::move(code.second));
+    if (epilogue_policy == EpiloguePolicy::Deferred) {
+        Pulser::runEpilogue(&ctrl);
+    } else {
+        ctrl.run(Pulser::ClearTimingCheck());
+    }
+    Log::log("Ran %u sequences (%.3f ms) in %9.3f ms\n", nseq,
+             (double)total_ns * 1e-6, (double)run_time * 1e-6);
+
+    // The queue was empty when we stopped so this won't delay
+    // the next sequence much.
+    checkDDS(ctrl);
     setProgramStatus("Idle");
 }
 
@@ -3,11 +3,16 @@
 
 #include <cgicc/Cgicc.h>
 #include <functional>
+#include <memory>
 #include <ostream>
+#include <vector>
 
 namespace NaCs {
 namespace Pulser {
 class Controller;
+struct EncodedByteCode;
+struct SlackStats;
+struct ThreadConfig;
 }
 
 // parse URL-encoded pulse sequence in string
@@ -15,9 +20,90 @@ class Controller;
 bool parseSeqURL(Pulser::Controller &ctrl, std::string &seq, std::ostream &reply);
 bool parseSeqCGI(Pulser::Controller &ctrl, cgicc::Cgicc &cgi, std::ostream &reply);
 
+// Maximum memory used by each of the text and bytecode sequence caches.
+void setSeqCacheSize(size_t size);
+
+// Start running text sequences longer than @validate_lines lines
+// after parsing only the first @validate_lines lines, `0` to disable.
+void setTextSeqStream(size_t validate_lines);
+
+// Remove the redundant DDS and TTL writes from the text sequences
+// (see `Pulser::optimizeInstructionList`).
+void setTextSeqOptimize(bool optimize);
+
+// Where to save the instruction trace when a sequence has timing failures.
+// Only used when the pulser library is built with `ENABLE_PULSER_TRACE`.
+void setTraceFile(const std::string &fname);
+
+// Decode the bytecode sequences not in the cache on a separate thread while
+// they are running instead of before they are queued.
+void setDecodeThread(const Pulser::ThreadConfig &config);
+bool hasDecodeThread();
+
+// Encode the bytecode or find it in the cache.
+// Does not need the controller so it can be done ahead of time.
+// Returns `nullptr` if it is not in the cache and is either decoded while
+// it runs (with the decoder thread) or too large to be cached.
+// Throws if the bytecode is invalid in either case.
+std::shared_ptr<const Pulser::EncodedByteCode>
+loadByteCode(const uint8_t *code, size_t code_len);
+
 void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
                        const uint8_t *code, size_t code_len,
                        const std::function<void()> &send_reply, uint32_t ttl_mask);
+void handleRunByteCode(Pulser::Controller &ctrl, uint64_t seq_len_ns,
+                       const Pulser::EncodedByteCode &encoded,
+                       const std::function<void()> &send_reply, uint32_t ttl_mask);
+
+/**
+ * What to do between consecutive bytecode sequences.
+ *
+ * Full: Each sequence is run on its own and is followed by the epilogue
+ *     and the DDS checks.
+ * Deferred: Sequences that are already queued are appended to the FIFO
+ *     while the previous one is still running. The epilogue and
+ *     the DDS checks are run once the queue is empty.
+ * Minimal: Same as `Deferred` but only the timing check is cleared
+ *     when the queue is empty instead of running the full epilogue.
+ */
+enum class EpiloguePolicy {
+    Full,
+    Deferred,
+    Minimal
+};
+void setEpiloguePolicy(EpiloguePolicy policy);
+
+// Slack below @threshold_ns is counted as low in the bytecode sequence stats.
+void setSlackThreshold(uint64_t threshold_ns);
+// Get and reset the slack stats of the bytecode sequences run since
+// the last call. Returns the number of sequences.
+uint32_t takeSlackStats(Pulser::SlackStats &stats);
+
+// Use `Pulser::LeadController` instead of the fixed 0.5s lead
+// for the bytecode sequences.
+void setAdaptiveLead(bool adaptive);
+
+// Bytecode that is used in place. The memory is kept alive by `owner`,
+// e.g. the message it was received in, or by the caller if it is `nullptr`.
+struct RawByteCode {
+    std::shared_ptr<const void> owner;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+};
+
+struct ByteCodeSeq {
+    uint64_t len_ns;
+    std::shared_ptr<const Pulser::EncodedByteCode> code;
+    uint32_t ttl_mask;
+    std::function<void()> send_reply;
+    // The bytecode, only used when `code` is `nullptr`.
+    RawByteCode raw;
+};
+
+// Run @seq and, depending on the epilogue policy, the sequences returned
+// by @next. @next should return `false` when no sequence is ready.
+void handleRunByteCodes(Pulser::Controller &ctrl, ByteCodeSeq seq,
+                        const std::function<bool(ByteCodeSeq&)> &next);
 
 }
 
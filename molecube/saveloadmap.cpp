@@ -12,9 +12,8 @@
 
 #include <nacs-utils/log.h>
 
-#include <sstream>
-#include <iostream>
-#include <iomanip>
+#include <stdint.h>
+#include <string.h>
 
 void saveMap(const txtmap_t &params, const std::string &fname)
 {
@@ -107,56 +106,139 @@ void dumpMapHTML(const txtmap_t &m, std::ostream &os)
     }
 }
 
-//url_encode is copied from stackexchange:
-// http://stackoverflow.com/questions/154536/encode-decode-urls-in-c
-static std::string
-url_encode(const std::string &value)
+namespace {
+
+// Byte classes for the URL encoding.
+// Unreserved: kept as is by the encoder.
+// Hex digits: their value, `-1` for other bytes.
+struct URLTables {
+    bool unreserved[256];
+    int8_t hex[256];
+    // Decoded value of the bytes other than '%' ('+' is a space).
+    char plain[256];
+    URLTables()
+    {
+        for (int c = 0;c < 256;c++) {
+            unreserved[c] = ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                             (c >= 'A' && c <= 'Z') || c == '-' || c == '_' ||
+                             c == '.' || c == '~');
+            plain[c] = c == '+' ? ' ' : char(c);
+            if (c >= '0' && c <= '9') {
+                hex[c] = int8_t(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                hex[c] = int8_t(c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                hex[c] = int8_t(c - 'A' + 10);
+            } else {
+                hex[c] = -1;
+            }
+        }
+    }
+};
+
+static const URLTables url_tables;
+
+// Check a machine word at a time for the bytes the decoder needs to handle
+// ('%' and '+'). Most of a sequence text is unescaped, e.g. the letters,
+// digits and '.' of the numbers.
+typedef size_t url_word_t;
+static constexpr url_word_t url_ones = ~url_word_t(0) / 255;
+
+static inline url_word_t
+byteMask(url_word_t v, uint8_t c)
 {
-    std::ostringstream escaped;
-    escaped.fill('0'); //pad numbers w/ 0 to reach width
-    escaped << std::hex; //numbers will be in hex format
+    // The lowest set bit is exact, higher ones can be false positives.
+    v ^= url_ones * c;
+    return (v - url_ones) & ~v & (url_ones * 0x80);
+}
 
-    for (std::string::const_iterator i = value.begin(), n = value.end();
-         i != n; ++i) {
+// Offset of the first '%' or '+' in the (little endian) word,
+// `sizeof(url_word_t)` if there's none.
+static inline size_t
+escapeOffset(url_word_t v)
+{
+    auto mask = byteMask(v, '%') | byteMask(v, '+');
+    if (!mask)
+        return sizeof(url_word_t);
+    return size_t(__builtin_ctzll(mask)) / 8;
+}
 
-        std::string::value_type c = (*i);
+}
 
-        // Keep alphanumeric and other accepted characters intact
-        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
-            escaped << c;
-            continue;
+// Decode one byte or escape.
+static inline void
+decodeOne(const char *&in, char *&out, const char *end)
+{
+    char c = *in;
+    if (c == '%') {
+        int hi = end - in >= 3 ? url_tables.hex[uint8_t(in[1])] : -1;
+        int lo = hi >= 0 ? url_tables.hex[uint8_t(in[2])] : -1;
+        if (lo >= 0) {
+            *out++ = char((hi << 4) | lo);
+            in += 3;
+            return;
         }
-
-        // Any other characters are percent-encoded
-        escaped << '%' << std::setw(2) << int((unsigned char) c);
+        // Not a valid escape, keep the '%'.
     }
+    *out++ = url_tables.plain[uint8_t(c)];
+    in++;
+}
 
-    return escaped.str();
+size_t
+urlDecode(char *str, size_t len)
+{
+    const char *in = str;
+    const char *end = str + len;
+    char *out = str;
+    constexpr size_t word_size = sizeof(url_word_t);
+    while (size_t(end - in) >= 5 * word_size) {
+        url_word_t v;
+        memcpy(&v, in, sizeof(v));
+        auto n = escapeOffset(v);
+        if (n == word_size) {
+            memcpy(out, &v, sizeof(v));
+            in += word_size;
+            out += word_size;
+            continue;
+        }
+        // `out` may be right behind `in`, only write what is consumed.
+        for (size_t i = 0;i < n;i++)
+            out[i] = in[i];
+        in += n;
+        out += n;
+        // Escapes usually come in clusters (e.g. every space and '=' in
+        // a form body), do the next few words a byte at a time.
+        auto stop = in + 4 * word_size;
+        while (in < stop) {
+            decodeOne(in, out, end);
+        }
+    }
+    while (in < end)
+        decodeOne(in, out, end);
+    return size_t(out - str);
 }
 
-// url_decode is copied from stackexchange:
-// http://stackoverflow.com/questions/154536/encode-decode-urls-in-c
-static std::string
-url_decode(std::string &SRC)
+std::string
+urlEncode(const char *str, size_t len)
 {
-    std::string ret;
-    char ch;
-    for (unsigned i = 0;i < SRC.length();i++) {
-        if (SRC[i] == '+') {
-            ret += ' ';
-        } else {
-            if (SRC[i] == '%') {
-                int ii;
-                sscanf(SRC.substr(i + 1, 2).c_str(), "%x", &ii);
-                ch = static_cast<char>(ii);
-                ret += ch;
-                i = i + 2;
-            } else {
-                ret += SRC[i];
-            }
+    static const char digits[] = "0123456789abcdef";
+    // Room for the worst case, trimmed at the end.
+    std::string res(len * 3, '\0');
+    char *out = &res[0];
+    for (size_t i = 0;i < len;i++) {
+        auto c = uint8_t(str[i]);
+        if (url_tables.unreserved[c]) {
+            *out++ = char(c);
+            continue;
         }
+        // Any other characters are percent-encoded
+        out[0] = '%';
+        out[1] = digits[c >> 4];
+        out[2] = digits[c & 0xf];
+        out += 3;
     }
-    return ret;
+    res.resize(size_t(out - res.data()));
+    return res;
 }
 
 // convert html to text or visa-versa
@@ -169,8 +251,8 @@ html2txt(std::string &seq, int dir)
     //see: http://www.w3schools.com/tags/ref_urlencode.asp
 
     if (dir == 1) {
-        seq = url_decode(seq);
+        seq.resize(urlDecode(&seq[0], seq.size()));
     } else {
-        seq = url_encode(seq);
+        seq = urlEncode(seq.data(), seq.size());
     }
 }
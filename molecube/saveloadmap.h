@@ -11,6 +11,8 @@
  *
  **/
 
+#include <stddef.h>
+
 #include <map>
 #include <string>
 #include <fstream>
@@ -23,6 +25,12 @@ void saveMap(const txtmap_t &m, const std::string &fname);
 // dump out the map to an ostream as key = value lines after conversion to HTML
 void dumpMapHTML(const txtmap_t &m, std::ostream &os);
 
+// Percent-decode @str in place ('+' is decoded as a space).
+// Returns the new length. Invalid escapes are kept as is.
+size_t urlDecode(char *str, size_t len);
+// Percent-encode everything but the unreserved characters (RFC 3986).
+std::string urlEncode(const char *str, size_t len);
+
 // convert html to text or visa-versa
 // dir=1 is html to text
 // dir=-1 is text to html
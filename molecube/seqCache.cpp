@@ -0,0 +1,27 @@
+#include "seqCache.h"
+
+#include <string.h>
+
+namespace NaCs {
+
+// FNV-1a, 8 bytes at a time with the tail processed bytewise.
+// This only needs to be good enough to spread the keys in the hash table
+// since the content is always compared on lookup.
+uint64_t
+hashSeq(const void *data, size_t len)
+{
+    constexpr uint64_t prime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull ^ len;
+    auto p = (const uint8_t*)data;
+    for (;len >= 8;len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        hash = (hash ^ v) * prime;
+        hash ^= hash >> 29;
+    }
+    for (;len > 0;len--, p++)
+        hash = (hash ^ *p) * prime;
+    return hash;
+}
+
+}
@@ -0,0 +1,164 @@
+#ifndef SEQ_CACHE_H
+#define SEQ_CACHE_H
+
+#include <nacs-utils/utils.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <string.h>
+
+namespace NaCs {
+
+uint64_t hashSeq(const void *data, size_t len);
+
+/**
+ * LRU cache of processed sequences keyed by the content of the sequence.
+ *
+ * The value type needs a `cacheSize()` method returning its memory usage.
+ * The total size (including the keys) is kept below the limit by evicting
+ * the least recently used entries. Values are returned as `shared_ptr`
+ * so that an entry can be evicted while it is still being run.
+ */
+template<typename T>
+class SeqCache {
+    SeqCache(const SeqCache&) = delete;
+    void operator=(const SeqCache&) = delete;
+    struct Entry {
+        uint64_t hash;
+        std::string key;
+        std::shared_ptr<const T> val;
+        size_t size;
+    };
+    typedef typename std::list<Entry>::iterator iterator;
+
+public:
+    SeqCache(size_t max_size)
+        : m_max_size(max_size)
+    {}
+
+    std::shared_ptr<const T>
+    find(const void *key, size_t len)
+    {
+        auto hash = hashSeq(key, len);
+        std::lock_guard<std::mutex> locker(m_lock);
+        auto range = m_map.equal_range(hash);
+        for (auto it = range.first;it != range.second;++it) {
+            auto entry = it->second;
+            if (entry->key.size() != len ||
+                memcmp(entry->key.data(), key, len) != 0)
+                continue;
+            // Move to the front
+            m_entries.splice(m_entries.begin(), m_entries, entry);
+            m_hits++;
+            return entry->val;
+        }
+        m_misses++;
+        return nullptr;
+    }
+    std::shared_ptr<const T>
+    insert(const void *key, size_t len, T &&val)
+    {
+        auto hash = hashSeq(key, len);
+        auto ptr = std::make_shared<const T>(std::move(val));
+        auto size = ptr->cacheSize() + len + sizeof(Entry);
+        std::lock_guard<std::mutex> locker(m_lock);
+        if (size > m_max_size)
+            return ptr;
+        auto range = m_map.equal_range(hash);
+        for (auto it = range.first;it != range.second;++it) {
+            auto entry = it->second;
+            if (entry->key.size() == len &&
+                memcmp(entry->key.data(), key, len) == 0) {
+                // Inserted by another thread.
+                m_entries.splice(m_entries.begin(), m_entries, entry);
+                return entry->val;
+            }
+        }
+        while (m_size + size > m_max_size)
+            evict();
+        m_entries.push_front(Entry{hash, std::string((const char*)key, len),
+                                   ptr, size});
+        m_map.emplace(hash, m_entries.begin());
+        m_size += size;
+        return ptr;
+    }
+    void
+    setMaxSize(size_t max_size)
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        m_max_size = max_size;
+        while (m_size > m_max_size) {
+            evict();
+        }
+    }
+
+    size_t
+    hits() const
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        return m_hits;
+    }
+    size_t
+    misses() const
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        return m_misses;
+    }
+    // Whether a value with a key of @len bytes could be cached at all.
+    bool
+    fits(size_t len) const
+    {
+        return len + sizeof(T) + sizeof(Entry) <= maxSize();
+    }
+    size_t
+    maxSize() const
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        return m_max_size;
+    }
+    // Current memory usage and number of entries
+    size_t
+    size() const
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        return m_size;
+    }
+    size_t
+    count() const
+    {
+        std::lock_guard<std::mutex> locker(m_lock);
+        return m_entries.size();
+    }
+
+private:
+    void
+    evict()
+    {
+        auto entry = std::prev(m_entries.end());
+        auto range = m_map.equal_range(entry->hash);
+        for (auto it = range.first;it != range.second;++it) {
+            if (it->second == entry) {
+                m_map.erase(it);
+                break;
+            }
+        }
+        m_size -= entry->size;
+        m_entries.erase(entry);
+    }
+
+    mutable std::mutex m_lock;
+    std::list<Entry> m_entries;
+    std::unordered_multimap<uint64_t, iterator> m_map;
+    size_t m_max_size;
+    size_t m_size = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,33 @@
+//
+
+#ifndef __NACS_TEST_BENCH_H__
+#define __NACS_TEST_BENCH_H__
+
+#include <nacs-utils/timer.h>
+
+#include <algorithm>
+#include <iostream>
+
+/**
+ * Run @func @nrun times and print the shortest time together with the rate
+ * of processing the @n items (in @unit) it handles in each run.
+ * Returns the shortest time in seconds.
+ */
+template<typename Func>
+static double
+bench(const char *name, size_t n, const char *unit, Func &&func,
+      unsigned nrun=5)
+{
+    double tmin = 0;
+    for (unsigned i = 0;i < nrun;i++) {
+        NaCs::Timer timer;
+        func();
+        auto t = double(timer.elapsed()) * 1e-9;
+        tmin = i == 0 ? t : std::min(tmin, t);
+    }
+    std::cout << name << ": " << tmin * 1e3 << " ms, "
+              << double(n) / tmin * 1e-6 << " M " << unit << "/s" << std::endl;
+    return tmin;
+}
+
+#endif
@@ -0,0 +1,309 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+#include <nacs-pulser/instruction.h>
+
+#include <assert.h>
+#include <array>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+using namespace NaCs;
+using Inst = Pulser::InstWriter;
+using Pulser::ControlBit;
+
+// Loops compile to the same pulses as the unrolled list,
+// with the TTL and phase states carried over between the iterations.
+static void
+test_loops()
+{
+    auto body = [] (Pulser::BlockBuilder &builder, int i) {
+        builder.pushPulse(Inst::ttl, 3, bool(i & 1));
+        builder.pushPulse(Inst::DDS::shiftPhase, 2, 45);
+        builder.pushPulse(Inst::wait, i == 0 ? 2000 : 10);
+    };
+    Pulser::BlockBuilder looped;
+    looped.pushPulse(Inst::ttlAll, 0x4);
+    looped.beginLoop(3);
+    looped.beginLoop(5);
+    body(looped, 1);
+    looped.endLoop();
+    body(looped, 0);
+    looped.endLoop();
+    // Empty loops are dropped
+    looped.beginLoop(0);
+    body(looped, 1);
+    looped.endLoop();
+    looped.beginLoop(10);
+    looped.endLoop();
+    looped.pushPulse(Inst::ttlAll, 0x1);
+
+    Pulser::BlockBuilder unrolled;
+    unrolled.pushPulse(Inst::ttlAll, 0x4);
+    for (int i = 0;i < 3;i++) {
+        for (int j = 0;j < 5;j++)
+            body(unrolled, 1);
+        body(unrolled, 0);
+    }
+    unrolled.pushPulse(Inst::ttlAll, 0x1);
+
+    assert(looped.numLoops == 2);
+    assert(looped.loopDepth() == 0);
+    assert(looped.size() == 1 + 2 + 3 * 2 + 2 + 1);
+    assert(looped.currT == unrolled.currT);
+    auto seq = Pulser::compileInstructionList(looped);
+    auto expected = Pulser::compileInstructionList(unrolled);
+    assert(seq.pulses.size() == expected.pulses.size());
+    for (size_t i = 0;i < seq.pulses.size();i++) {
+        assert(seq.pulses[i].ctrl == expected.pulses[i].ctrl);
+        assert(seq.pulses[i].op == expected.pulses[i].op);
+    }
+    assert(seq.waits.size() == 3);
+    assert(seq.waits.size() == expected.waits.size());
+    for (size_t i = 0;i < seq.waits.size();i++)
+        assert(seq.waits[i].idx == expected.waits[i].idx);
+
+    // A loop that runs zero times is removed with the loops in it.
+    Pulser::BlockBuilder removed;
+    removed.beginLoop(2);
+    body(removed, 1);
+    removed.endLoop();
+    removed.beginLoop(0);
+    removed.beginLoop(3);
+    body(removed, 1);
+    removed.endLoop();
+    removed.endLoop();
+    assert(removed.numLoops == 1);
+    assert(removed.size() == 2 + 3);
+}
+
+static void
+test_pack()
+{
+    Pulser::BlockBuilder builder;
+    builder.pushPulse(Inst::wait, 100);
+    for (int i = 0;i < 1000;i++) {
+        builder.pulseDT(100, Inst::ttlAll, i & 1);
+    }
+    builder.pushPulse(Inst::wait, 100);
+    builder.pushPulse(Inst::wait, uint64_t(1) << 40);
+    builder.beginLoop(3);
+    builder.pulseDT(100, Inst::DDS::setFreq, 1, 1e6);
+    builder.endLoop();
+    builder.pushPulse(Inst::clockOut, 2);
+    auto packed = Pulser::packInstructionList(builder);
+    assert(packed.ninsts == builder.size());
+    // The waits after the pulses are merged
+    assert(packed.words.size() == 2 + 1000 * 3 + 2 + 2 + 2 + 3 + 2 + 2);
+    assert(packed.words[2] ==
+           (Inst::ttlAll(0).ctrl | Pulser::PackedInstList::WaitFollows));
+    assert(packed.words[4] == 100 - Seq::PulseTime::Min);
+    // Loop end counts the words in the body.
+    assert(packed.words[packed.words.size() - 3] == 3);
+    std::cout << "Packed " << builder.cacheSize() << " bytes into "
+              << packed.cacheSize() << " bytes" << std::endl;
+}
+
+// Time, register and value of each output change of a compiled sequence.
+static std::vector<std::array<uint64_t, 3> >
+outputChanges(const Pulser::CompiledSeq &seq)
+{
+    std::vector<std::array<uint64_t, 3> > res;
+    std::map<uint32_t, uint32_t> regs;
+    uint64_t t = 0;
+    size_t wait_idx = 0;
+    for (size_t i = 0;;i++) {
+        for (;wait_idx < seq.waits.size() && seq.waits[wait_idx].idx == i;
+             wait_idx++)
+            t += seq.waits[wait_idx].t;
+        if (i == seq.pulses.size())
+            break;
+        auto ctrl = seq.pulses[i].ctrl & ~ControlBit::TimingCheck;
+        auto op = seq.pulses[i].op;
+        uint32_t key = ctrl;
+        uint64_t len = ctrl & 0xffffff;
+        if ((ctrl >> 28) == 2) {
+            t += len;
+            continue;
+        } else if ((ctrl >> 28) == 0) {
+            key = 0;
+        } else {
+            len = Seq::PulseTime::_DDS;
+        }
+        auto it = regs.find(key);
+        if (it == regs.end() || it->second != op) {
+            res.push_back({t, key, op});
+            regs[key] = op;
+        }
+        t += len;
+    }
+    res.push_back({t, 0xffffffff, 0});
+    return res;
+}
+
+// Total length of the wait instructions in the list (loop bodies counted once)
+static uint64_t
+waitLength(const Pulser::BlockBuilder &builder)
+{
+    uint64_t t = 0;
+    for (auto &inst: builder) {
+        if ((inst.ctrl & ControlBit::InstMask) == ControlBit::MetaCmd &&
+            (inst.ctrl & ControlBit::MetaInstMask) == ControlBit::WaitMeta) {
+            t += (uint64_t(inst.ctrl & ControlBit::MetaContentMask) << 32 |
+                  inst.op);
+        }
+    }
+    return t;
+}
+
+static void
+test_optimize()
+{
+    Pulser::BlockBuilder builder;
+    builder.pulseDT(100, Inst::ttlAll, 0x1);
+    builder.pulseDT(100, Inst::ttl, 0, true); // removed
+    builder.pulseDT(100, Inst::ttl, 1, false); // removed
+    builder.pulseDT(100, Inst::ttl, 1, true);
+    builder.pulseDT(100, Inst::ttlAll, 0x3); // removed
+    builder.pulseDT(100, Inst::DDS::setFreq, 1, 10e6);
+    builder.pulseDT(100, Inst::DDS::setFreq, 1, 10e6); // removed
+    builder.pulseDT(100, Inst::DDS::setFreq, 2, 10e6);
+    builder.pulseDT(100, Inst::DDS::setAmp, 1, 0.5);
+    builder.pulseDT(100, Inst::DDS::setAmp, 1, 0.5); // removed
+    builder.pulseDT(100, Inst::DDS::setPhase, 2, 90);
+    builder.pulseDT(100, Inst::DDS::shiftPhase, 2, 0); // removed
+    builder.pulseDT(100, Inst::DDS::setPhase, 2, 90); // removed
+    builder.pulseDT(100, Inst::DDS::shiftPhase, 2, 90);
+    builder.pulseDT(100, Inst::DDS::reset, 2);
+    builder.pulseDT(100, Inst::DDS::setPhase, 2, 0);
+    builder.beginLoop(3);
+    builder.pulseDT(100, Inst::DDS::setFreq, 1, 10e6);
+    builder.pulseDT(100, Inst::DDS::setFreq, 1, 10e6); // removed
+    builder.pulseDT(100, Inst::ttl, 0, false);
+    builder.endLoop();
+    builder.pulseDT(100, Inst::DDS::setFreq, 1, 10e6);
+    builder.pulseDT(100, Inst::ttl, 0, false);
+
+    auto wait_len = waitLength(builder);
+    auto seq = Pulser::compileInstructionList(builder);
+    auto stats = Pulser::optimizeInstructionList(builder);
+    assert(stats.removed == 8);
+    assert(stats.removed_t == 3 * Seq::PulseTime::Min +
+           5 * uint64_t(Seq::PulseTime::_DDS));
+    // The waits before and after each removed pulse are merged.
+    assert(stats.merged_waits == 8);
+    auto opt = Pulser::compileInstructionList(builder);
+    assert(opt.pulses.size() < seq.pulses.size());
+    // The removed pulses are now waits.
+    assert(waitLength(builder) == wait_len + stats.removed_t);
+    assert(outputChanges(opt) == outputChanges(seq));
+    std::cout << "Optimized " << seq.pulses.size() << " pulses into "
+              << opt.pulses.size() << std::endl;
+
+    // Random writes of a few values
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<int> dist(0, 1023);
+    for (int n = 0;n < 1000;n++) {
+        Pulser::BlockBuilder builder;
+        for (int i = 0;i < 40;i++) {
+            int r = dist(gen);
+            int chn = r % 2;
+            double val = r / 2 % 3;
+            switch (r / 8 % 9) {
+            case 0:
+                builder.pulseDT(100, Inst::ttlAll, r / 2 % 3);
+                break;
+            case 1:
+                builder.pulseDT(100, Inst::ttl, uint8_t(chn), (r / 2) & 1);
+                break;
+            case 2:
+                builder.pulseDT(100, Inst::DDS::setFreq, chn, val * 1e6);
+                break;
+            case 3:
+                builder.pulseDT(100, Inst::DDS::setAmp, chn, val * 0.1);
+                break;
+            case 4:
+                builder.pulseDT(100, Inst::DDS::setPhase, chn, val * 90);
+                break;
+            case 5:
+                builder.pulseDT(100, Inst::DDS::shiftPhase, chn, val * 180);
+                break;
+            case 6:
+                builder.pulseDT(100, Inst::DDS::reset, chn);
+                break;
+            case 7:
+                if (builder.loopDepth() < 3)
+                    builder.beginLoop(r % 3 + 1);
+                break;
+            default:
+                if (builder.loopDepth())
+                    builder.endLoop();
+                break;
+            }
+        }
+        while (builder.loopDepth())
+            builder.endLoop();
+        auto seq = Pulser::compileInstructionList(builder);
+        Pulser::optimizeInstructionList(builder);
+        assert(outputChanges(Pulser::compileInstructionList(builder)) ==
+               outputChanges(seq));
+    }
+}
+
+int
+main()
+{
+    test_loops();
+    test_pack();
+    test_optimize();
+
+    Pulser::BlockBuilder builder;
+    builder.pushPulse(Inst::ttl, 3, true);
+    builder.pushPulse(Inst::ttl, 5, true);
+    builder.pushPulse(Inst::DDS::setPhase, 1, 90);
+    builder.pushPulse(Inst::DDS::shiftPhase, 1, 90);
+    builder.pushPulse(Inst::wait, 10);
+    builder.pushPulse(Inst::wait, 2000);
+    builder.pushPulse(Inst::DDS::reset, 1);
+    builder.pushPulse(Inst::DDS::shiftPhase, 1, 90);
+    builder.pushPulse(Inst::wait, 100000);
+    builder.pushPulse(Inst::ttlAll, 0x10);
+
+    auto seq = Pulser::compileInstructionList(builder);
+    for (size_t i = 0;i < seq.pulses.size() - 1;i++)
+        assert(seq.pulses[i].ctrl & ControlBit::TimingCheck);
+    // The TTL pulses carry the full TTL state
+    assert(seq.pulses[0].op == (1 << 3));
+    assert(seq.pulses[1].op == ((1 << 3) | (1 << 5)));
+    auto phase = Pulser::DDSSetPhase(1, Pulser::DDSCvt::phase2num(90));
+    assert(seq.pulses[2].ctrl == (phase.control() | ControlBit::TimingCheck));
+    assert(seq.pulses[2].op == phase.operand());
+    // Shifted phase
+    auto phase2 = Pulser::DDSSetPhase(
+        1, uint16_t(Pulser::DDSCvt::phase2num(90) * 2));
+    assert(seq.pulses[3].op == phase2.operand());
+    // Short wait
+    assert(seq.pulses[4].ctrl == (0x20000000 | 10 | ControlBit::TimingCheck));
+    // Wait points
+    assert(seq.waits.size() == 2);
+    assert(seq.waits[0].idx == 5);
+    assert(seq.waits[0].t == 2000);
+    assert(seq.waits[0].max_requests > 0);
+    // Phase is reset
+    assert(seq.pulses[6].op == phase.operand());
+    assert(seq.waits[1].idx == 7);
+    assert(seq.waits[1].t == 100000);
+    assert(seq.waits[1].max_requests == 0);
+    assert(seq.pulses[7].op == 0x10);
+    // Final padding
+    assert(seq.pulses.size() == 9);
+    std::cout << "Compiled " << builder.size() << " instructions into "
+              << seq.pulses.size() << " pulses and " << seq.waits.size()
+              << " wait points (" << seq.cacheSize() << " bytes)" << std::endl;
+    return 0;
+}
@@ -36,5 +36,25 @@ main()
     assert(req4.res == 40);
     t.join();
 
+    Pulser::RequestBatch batch(ctrl);
+    auto res1 = batch.add(Pulser::LoopBack(1));
+    auto res2 = batch.add(Pulser::DDSGetFreq(3));
+    auto res3 = batch.add(Pulser::DDSSetFreq(3, 10));
+    assert(batch.size() == 4);
+    assert(!batch.ready());
+    // Not submitted to the controller to avoid writing to the dummy registers
+    std::thread t2([&] {
+            std::this_thread::sleep_for(100ms);
+            ctrl.setRes(batch[0], 1);
+            ctrl.setRes(batch[1], 0x1234);
+            ctrl.setRes(batch[2], 0xabcd);
+            ctrl.setRes(batch[3], 0);
+        });
+    batch.wait();
+    assert(res1.get() == 1);
+    assert(res2.get() == 0xabcd1234);
+    (void)res3;
+    t2.join();
+
     return 0;
 }
@@ -12,6 +12,8 @@
 #include <thread>
 #include <chrono>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 using namespace NaCs;
 using namespace std::literals;
@@ -31,6 +33,45 @@ struct LoopBack2 : Pulser::CompositeCmd<std::tuple<Pulser::LoopBack,
     }
 };
 
+// Measure the `reqSync` round trip latency with `nthreads` concurrent
+// requesters and how many times a requester is woken up per finished request.
+static void
+bench_reqsync(Pulser::Controller &ctrl, unsigned nthreads, unsigned nreqs)
+{
+    std::vector<uint64_t> latencies(nthreads * nreqs);
+    auto wakeups0 = ctrl.numWakeups();
+    auto completions0 = ctrl.numCompletions();
+    std::vector<std::thread> ts;
+    for (unsigned i = 0;i < nthreads;i++) {
+        ts.emplace_back([&, i] {
+                auto lat = &latencies[i * nreqs];
+                for (uint32_t j = 0;j < nreqs;j++) {
+                    auto t0 = getTime();
+                    uint32_t res = ctrl.reqSync(Pulser::LoopBack(j));
+                    lat[j] = getTime() - t0;
+                    assert(j == res);
+                }
+            });
+    }
+    for (auto &t: ts)
+        t.join();
+    auto wakeups = ctrl.numWakeups() - wakeups0;
+    auto completions = ctrl.numCompletions() - completions0;
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (auto lat: latencies)
+        sum += double(lat);
+    auto nlat = latencies.size();
+    std::cout << nthreads << " threads: "
+              << double(wakeups) / double(completions)
+              << " wakeups per completion, reqSync latency (us): mean "
+              << sum / double(nlat) / 1e3
+              << ", median " << double(latencies[nlat / 2]) / 1e3
+              << ", 99% " << double(latencies[nlat * 99 / 100]) / 1e3
+              << ", max " << double(latencies[nlat - 1]) / 1e3
+              << std::endl;
+}
+
 int
 main()
 {
@@ -92,5 +133,39 @@ main()
         }
     }
 
+    for (uint32_t i = 0;i < 128;i++) {
+        Pulser::RequestBatch batch(ctrl);
+        std::vector<Pulser::RequestBatch::Result<Pulser::LoopBack> > res1;
+        std::vector<Pulser::RequestBatch::Result<LoopBack2> > res2;
+        for (uint32_t j = 0;j < 32;j++) {
+            res1.push_back(batch.add(Pulser::LoopBack(i * 32 + j)));
+            res2.push_back(batch.add(LoopBack2(i, j)));
+        }
+        batch.submit();
+        batch.wait();
+        for (uint32_t j = 0;j < 32;j++) {
+            assert(res1[j].get() == i * 32 + j);
+            assert(res2[j].get() == (i | (uint64_t(j) << 32)));
+        }
+    }
+
+    // A batch larger than the request queue is written while it is pushed.
+    {
+        Pulser::RequestBatch batch(ctrl, 5000);
+        std::vector<Pulser::RequestBatch::Result<Pulser::LoopBack> > res;
+        for (uint32_t i = 0;i < 5000;i++)
+            res.push_back(batch.add(Pulser::LoopBack(i)));
+        batch.submit();
+        batch.wait();
+        for (uint32_t i = 0;i < 5000;i++) {
+            assert(res[i].get() == i);
+        }
+    }
+
+    bench_reqsync(ctrl, 1, 4096);
+    bench_reqsync(ctrl, 4, 1024);
+    // Same number of threads as the old `getDeviceParams`
+    bench_reqsync(ctrl, 66, 64);
+
     return 0;
 }
@@ -0,0 +1,117 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+#include "../bench.h"
+
+#include <nacs-pulser/dds_state.h>
+
+#include <assert.h>
+#include <thread>
+#include <mutex>
+#include <iostream>
+#include <vector>
+
+using namespace NaCs;
+
+// The old implementation in `getDeviceParams`:
+// one thread per DDS doing three `reqSync` each.
+static std::vector<Pulser::DDSState>
+readDDSStatesThreads(Pulser::Controller &ctrl, const std::vector<unsigned> &dds)
+{
+    std::vector<Pulser::DDSState> res(dds.size());
+    std::vector<std::thread> ts;
+    for (size_t i = 0;i < dds.size();i++) {
+        ts.emplace_back([&, i] {
+                res[i].id = dds[i];
+                res[i].freq = ctrl.reqSync(Pulser::DDSGetFreq(int(dds[i])));
+                res[i].amp = uint16_t(ctrl.reqSync(Pulser::DDSGetAmp(int(dds[i]))));
+                res[i].phase = uint16_t(ctrl.reqSync(
+                                            Pulser::DDSGetPhase(int(dds[i]))));
+            });
+    }
+    for (auto &t: ts)
+        t.join();
+    return res;
+}
+
+int
+main()
+{
+    Pulser::Controller ctrl(Pulser::mapPulserAddr());
+
+    std::vector<unsigned> dds;
+    {
+        Pulser::CtrlLocker locker(ctrl);
+        for (unsigned i = 0;i < PULSER_NDDS;i++) {
+            if (ctrl.run(Pulser::DDSExists(i))) {
+                dds.push_back(i);
+            }
+        }
+    }
+    std::cout << dds.size() << " DDS found" << std::endl;
+
+    for (auto i: dds) {
+        ctrl.reqSync(Pulser::DDSSetFreq(i, 0x12345678 + i));
+        ctrl.reqSync(Pulser::DDSSetAmp(i, 0x123 + i));
+        ctrl.reqSync(Pulser::DDSSetPhase(i, uint16_t(0x1234 + i)));
+    }
+    auto states = Pulser::readDDSStates(ctrl, dds);
+    auto states2 = readDDSStatesThreads(ctrl, dds);
+    assert(states.size() == dds.size());
+    for (size_t i = 0;i < dds.size();i++) {
+        assert(states[i].id == dds[i]);
+        assert(states[i].freq == 0x12345678 + dds[i]);
+        assert(states[i].amp == 0x123 + dds[i]);
+        assert(states[i].phase == 0x1234 + dds[i]);
+        assert(states2[i].freq == states[i].freq);
+        assert(states2[i].amp == states[i].amp);
+        assert(states2[i].phase == states[i].phase);
+    }
+
+    bench("Threads", dds.size(), "DDS",
+          [&] { readDDSStatesThreads(ctrl, dds); }, 256);
+    bench("Batch", dds.size(), "DDS",
+          [&] { Pulser::readDDSStates(ctrl, dds); }, 256);
+
+    Pulser::DDSCache cache(ctrl);
+    for (auto i: dds)
+        cache.setFreq(i, 0x23456789 + i);
+    // Amplitude and phase are not known yet.
+    auto cached = cache.read(dds);
+    assert(cache.hits() == 0);
+    assert(cache.misses() == dds.size());
+    for (size_t i = 0;i < dds.size();i++) {
+        assert(cached[i].freq == 0x23456789 + dds[i]);
+        assert(cached[i].amp == states[i].amp);
+        assert(cached[i].phase == states[i].phase);
+    }
+    cached = cache.read(dds);
+    assert(cache.hits() == dds.size());
+    if (!dds.empty()) {
+        cache.invalidate(dds[0]);
+        cache.read(dds);
+        assert(cache.misses() == dds.size() + 1);
+    }
+    // Change the hardware behind the cache's back.
+    for (auto i: dds)
+        ctrl.reqSync(Pulser::DDSSetAmp(i, 0x234 + i));
+    cache.setMode(Pulser::DDSCache::Verify);
+    cache.read(dds);
+    assert(cache.mismatches() == 0);
+    cache.read(dds);
+    assert(cache.mismatches() == 0);
+    for (auto i: dds)
+        ctrl.reqSync(Pulser::DDSSetAmp(i, 0x123 + i));
+    cached = cache.read(dds);
+    assert(cache.mismatches() == dds.size());
+    for (size_t i = 0;i < dds.size();i++)
+        assert(cached[i].amp == 0x123 + dds[i]);
+
+    cache.setMode(Pulser::DDSCache::Enabled);
+    cache.read(dds);
+    bench("Cache", dds.size(), "DDS", [&] { cache.read(dds); }, 256);
+    return 0;
+}
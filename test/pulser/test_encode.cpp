@@ -0,0 +1,115 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+#include "../bench.h"
+
+#include <nacs-pulser/instruction.h>
+
+#include <assert.h>
+#include <iostream>
+#include <random>
+
+using namespace NaCs;
+using Pulser::ControlBit;
+using Pulser::DecodedByteCode;
+
+static void
+test_encode()
+{
+    DecodedByteCode decoded;
+    decoded.pulses.push_back({DecodedByteCode::TTL, 0, 0x3, 100});
+    decoded.pulses.push_back({DecodedByteCode::DDSFreq, 2, 0x1234, 0});
+    decoded.pulses.push_back({DecodedByteCode::Wait, 0, 0, 1000});
+    // Split into a TTL pulse and a long wait
+    decoded.pulses.push_back({DecodedByteCode::TTL, 0, 0x5, 100000});
+    decoded.pulses.push_back({DecodedByteCode::DDSAmp, 1, 0x321, 0});
+    auto encoded = Pulser::encodeByteCode(decoded);
+
+    assert(encoded.has_ttl);
+    assert(encoded.last_ttl == 0x5);
+    assert(encoded.words.size() == 6);
+    assert(encoded.words[0].ctrl == (100 | ControlBit::TimingCheck));
+    assert(encoded.words[0].op == 0x3);
+    auto freq = Pulser::DDSSetFreq(2, 0x1234);
+    assert(encoded.words[1].ctrl == (freq.control() | ControlBit::TimingCheck));
+    assert(encoded.words[1].op == freq.operand());
+    assert(encoded.words[2].ctrl == (0x20000000 | 1000 |
+                                     ControlBit::TimingCheck));
+    assert(encoded.words[3].op == 0x5);
+    assert(encoded.words[5].ctrl == (0x20000000 | Seq::PulseTime::Min));
+    assert(encoded.waits.size() == 1);
+    assert(encoded.waits[0].idx == 4);
+    assert(encoded.waits[0].start == 100 + Seq::PulseTime::DDSFreq + 1000 + 100);
+    assert(encoded.waits[0].t == 100000 - 100);
+
+    uint32_t merged[12];
+    Pulser::mergeTTL(merged, encoded.words.data(), 6, 0x100);
+    assert(merged[1] == 0x103);
+    assert(merged[3] == freq.operand());
+    assert(merged[5] == 0);
+    assert(merged[7] == 0x105);
+}
+
+static DecodedByteCode
+randomSeq(size_t n)
+{
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<uint32_t> dist;
+    DecodedByteCode decoded;
+    for (size_t i = 0;i < n;i++) {
+        auto r = dist(gen);
+        switch (r % 8) {
+        case 0:
+            decoded.pulses.push_back({DecodedByteCode::DDSFreq,
+                        uint8_t(r % 22), r, 0});
+            break;
+        case 1:
+            decoded.pulses.push_back({DecodedByteCode::Wait, 0, 0, 3 + r % 500});
+            break;
+        default:
+            decoded.pulses.push_back({DecodedByteCode::TTL, 0, r & 0xffff,
+                        3 + r % 20});
+            break;
+        }
+    }
+    return decoded;
+}
+
+int
+main()
+{
+    test_encode();
+
+    auto decoded = randomSeq(1000000);
+    auto encoded = Pulser::encodeByteCode(decoded);
+    auto nwords = encoded.words.size();
+    std::cout << decoded.pulses.size() << " pulses, " << nwords << " words"
+              << std::endl;
+
+    bench("Encode", nwords, "words", [&] {
+            auto res = Pulser::encodeByteCode(decoded);
+            assert(res.words.size() == nwords);
+        }, 10);
+    std::vector<uint32_t> buff(nwords * 2);
+    bench("Merge TTL", nwords, "words", [&] {
+            Pulser::mergeTTL(buff.data(), encoded.words.data(), nwords, 0x10000);
+        }, 10);
+
+    // Write the sequence to the controller, either with the callbacks or with
+    // the encoded words. The FIFO is not held so that the writes don't block.
+    Pulser::Controller ctrl(Pulser::mapPulserAddr());
+    Pulser::CtrlLocker locker(ctrl);
+    auto run = [&] (auto &code) {
+        ctrl.releaseHold();
+        ctrl.toggleInit();
+        Pulser::runByteCode(&ctrl, code, 0xffff, false);
+        ctrl.waitFinish();
+        ctrl.run(Pulser::ClearTimingCheck());
+    };
+    bench("Run decoded", nwords, "words", [&] { run(decoded); }, 3);
+    bench("Run encoded", nwords, "words", [&] { run(encoded); }, 3);
+    return 0;
+}
@@ -214,6 +214,93 @@ test_fifo()
     std::cout << "Total size: " << fifo.capacity() << std::endl;
 }
 
+template<size_t nthreads, size_t init_size=256>
+static inline void
+test_mpsc_fifo()
+{
+    Pulser::FIFO<size_t, Pulser::MPSCLockFree> fifo(init_size);
+    static constexpr size_t nper = N / nthreads;
+    Timer timer;
+    std::vector<std::thread> ts;
+    for (size_t t = 0;t < nthreads;t++) {
+        ts.emplace_back([&, t] {
+                std::this_thread::yield();
+                size_t buff[2];
+                for (size_t i = 0;i < nper;i += 2) {
+                    // Encode the thread id in the value
+                    buff[0] = i * nthreads + t;
+                    buff[1] = (i + 1) * nthreads + t;
+                    fifo.push(buff, 2);
+                }
+            });
+    }
+    // Values from each producer should be received in order.
+    size_t next[nthreads] = {};
+    size_t buff[16];
+    for (size_t i = 0;i < nper * nthreads;) {
+        size_t size;
+        while (!(size = fifo.pop(buff, 16)))
+            std::this_thread::yield();
+        for (size_t j = 0;j < size;j++) {
+            auto t = buff[j] % nthreads;
+            assert(buff[j] / nthreads == next[t]);
+            next[t]++;
+        }
+        i += size;
+    }
+    for (auto &t: ts)
+        t.join();
+    auto write_time = timer.elapsed();
+    std::cout << "Average time per write: "
+              << double(write_time) / double(nper * nthreads) / 1e3 << " us"
+              << std::endl;
+    assert(fifo.size() == 0);
+    assert(fifo.capacity() == init_size);
+}
+
+template<size_t init_size=256>
+static inline void
+test_paged_fifo()
+{
+    Pulser::FIFO<size_t, Pulser::SPSCPaged<> > fifo(init_size);
+    assert(fifo.size() == 0);
+    assert(fifo.capacity() >= init_size);
+    const auto cap = fifo.capacity();
+
+    // Filling up the pages then fails instead of allocating.
+    size_t n = 0;
+    while (fifo.tryPush(n))
+        n++;
+    assert(n >= init_size && n <= cap);
+    assert(fifo.growCount() == 1);
+    for (size_t i = 0;i < n;i++)
+        assert(fifo.pop() == i);
+    assert(fifo.capacity() == cap);
+
+    // Pages are recycled so the requested size always fits.
+    for (int j = 0;j < 3;j++) {
+        for (size_t i = 0;i < init_size;i++)
+            assert(fifo.tryPush(i));
+        assert(fifo.growCount() == 1);
+        for (size_t i = 0;i < init_size;i++)
+            assert(fifo.pop() == i);
+    }
+
+    // `push` waits for the consumer.
+    Timer timer;
+    std::thread t1([&] {
+            fifo_list_pusher<3>(fifo);
+        });
+    fifo_poper<1>(fifo);
+    t1.join();
+    auto write_time = timer.elapsed();
+    std::cout << "Average time per write: "
+              << double(write_time) / double(N) / 1e3 << " us"
+              << std::endl;
+    assert(fifo.capacity() == cap);
+    assert(fifo.growCount() == 1);
+}
+
 int
 main()
 {
@@ -225,5 +312,19 @@ main()
     test_fifo<std::mutex, 256>();
     std::cout << "<std::mutex, 8192>: " << std::endl;
     test_fifo<std::mutex, 8192>();
+    std::cout << "<SPSCLockFree, 256>: " << std::endl;
+    test_fifo<Pulser::SPSCLockFree, 256>();
+    std::cout << "<SPSCLockFree, 8192>: " << std::endl;
+    test_fifo<Pulser::SPSCLockFree, 8192>();
+    std::cout << "<MPSCLockFree, 256>: " << std::endl;
+    test_fifo<Pulser::MPSCLockFree, 256>();
+    std::cout << "<MPSCLockFree, 8192>: " << std::endl;
+    test_fifo<Pulser::MPSCLockFree, 8192>();
+    std::cout << "<MPSCLockFree, 256> 4 producers: " << std::endl;
+    test_mpsc_fifo<4, 256>();
+    std::cout << "<SPSCPaged, 256>: " << std::endl;
+    test_paged_fifo<256>();
+    std::cout << "<SPSCPaged, 8192>: " << std::endl;
+    test_paged_fifo<8192>();
     return 0;
 }
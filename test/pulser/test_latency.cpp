@@ -3,9 +3,11 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <vector>
 
 using namespace NaCs;
 
@@ -67,6 +69,41 @@ test_latencies(Pulser::Controller &ctrl, unsigned ncycles)
     }
 }
 
+// Round trip time of sequential requests for different reader spin times,
+// with and without a gap between the requests.
+void
+test_round_trip(Pulser::Controller &ctrl, unsigned nrun)
+{
+    for (uint64_t spin: {0, 20000, 1000000}) {
+        ctrl.setReaderSpin(spin);
+        for (uint64_t gap: {0, 100000}) {
+            std::vector<double> times(nrun);
+            for (auto &t: times) {
+                auto start = getTime();
+                while (getTime() - start < gap) {
+                }
+                Timer timer;
+                ctrl.run(Pulser::LoopBack(1));
+                t = double(timer.elapsed()) / 1e3;
+            }
+            std::sort(times.begin(), times.end());
+            auto percentile = [&] (double p) {
+                return times[size_t(p * double(nrun - 1))];
+            };
+            std::cout << "Round trip (us) with reader spin "
+                      << std::setw(4) << spin / 1000 << " us, gap "
+                      << std::setw(3) << gap / 1000 << " us: "
+                      << std::fixed << std::setprecision(2)
+                      << "median " << std::setw(7) << percentile(0.5)
+                      << ", 90% " << std::setw(7) << percentile(0.9)
+                      << ", 99% " << std::setw(7) << percentile(0.99)
+                      << ", max " << std::setw(7) << times.back()
+                      << std::endl;
+        }
+    }
+    ctrl.setReaderSpin(0);
+}
+
 int
 main()
 {
@@ -74,5 +111,6 @@ main()
     Pulser::CtrlLocker locker(ctrl);
     test_latencies<true>(ctrl, 4096);
     test_latencies<false>(ctrl, 4096);
+    test_round_trip(ctrl, 4096);
     return 0;
 }
@@ -0,0 +1,212 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+// Compare the fixed 0.5s lead with `LeadController` on recorded sequences
+// (saved with `molecube -record-seq`) or on a few synthetic ones.
+// Usage: test-lead [seq-file...]
+
+#include <nacs-pulser/instruction.h>
+
+#include <nacs-utils/timer.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace NaCs;
+using namespace std::literals;
+
+static constexpr uint64_t min_lead = 10000000;
+static constexpr uint64_t max_lead = 500000000;
+
+// The lead follows the time between the updates within its bounds
+// and doubles when the slack runs low.
+static void
+test_lead()
+{
+    Pulser::LeadController lead(min_lead, max_lead);
+    assert(lead.lead() == max_lead);
+    lead.startSeq();
+    // Frequent updates: the lead shrinks towards the lower bound.
+    uint64_t t = 1000000000;
+    for (int i = 0;i < 1000;i++) {
+        t += 100000;
+        lead.update(t, true, int64_t(lead.lead()));
+        assert(lead.lead() >= min_lead && lead.lead() <= max_lead);
+    }
+    assert(lead.lead() < min_lead * 2);
+    assert(lead.numBackoffs() == 0);
+
+    // An underrun backs off.
+    auto prev = lead.lead();
+    t += 100000;
+    lead.update(t, true, 0);
+    assert(lead.numBackoffs() == 1);
+    assert(lead.lead() == prev * 2);
+    // The slack before the hold is released doesn't count.
+    t += 100000;
+    lead.update(t, false, 0);
+    assert(lead.numBackoffs() == 1);
+    // But never above the upper bound.
+    for (int i = 0;i < 10;i++) {
+        t += 100000;
+        lead.update(t, true, -1000000);
+    }
+    assert(lead.numBackoffs() == 11);
+    assert(lead.lead() == max_lead);
+
+    // A long gap between the updates raises the target.
+    lead.startSeq();
+    for (int i = 0;i < 1000;i++) {
+        t += 100000;
+        lead.update(t, true, int64_t(lead.lead()));
+    }
+    t += 5000000;
+    lead.update(t, true, int64_t(lead.lead()));
+    assert(lead.lead() == 5000000 * 8);
+}
+
+struct TestSeq {
+    std::string name;
+    uint64_t len_ns;
+    uint32_t ttl_mask;
+    Pulser::DecodedByteCode code;
+};
+
+static bool
+loadSeq(const char *fname, TestSeq &seq)
+{
+    FILE *fp = fopen(fname, "rb");
+    if (!fp)
+        return false;
+    std::vector<uint8_t> code;
+    uint8_t buff[4096];
+    bool res = (fread(&seq.len_ns, 8, 1, fp) == 1 &&
+                fread(&seq.ttl_mask, 4, 1, fp) == 1);
+    while (res) {
+        auto n = fread(buff, 1, sizeof(buff), fp);
+        if (n == 0)
+            break;
+        code.insert(code.end(), buff, buff + n);
+    }
+    fclose(fp);
+    if (!res)
+        return false;
+    seq.name = fname;
+    seq.code = Pulser::decodeByteCode(code.data(), code.size());
+    return true;
+}
+
+static TestSeq
+syntheticSeq(const char *name, unsigned nburst, unsigned npulse,
+             uint64_t pulse_t, uint64_t wait_t)
+{
+    TestSeq seq{name, 0, 0xffffffff, {}};
+    uint64_t t = 0;
+    for (unsigned i = 0;i < nburst;i++) {
+        for (unsigned j = 0;j < npulse;j++) {
+            seq.code.pulses.push_back({Pulser::DecodedByteCode::TTL, 0,
+                        j & 1, pulse_t});
+            t += pulse_t;
+        }
+        seq.code.pulses.push_back({Pulser::DecodedByteCode::Wait, 0, 0, wait_t});
+        t += wait_t;
+    }
+    seq.len_ns = t * 10;
+    return seq;
+}
+
+static void
+runSeq(Pulser::Controller &ctrl, const TestSeq &seq,
+       Pulser::LeadController *lead)
+{
+    // Requests from another thread while the sequence is running.
+    std::atomic<bool> done{false};
+    std::vector<double> lat;
+    std::thread reqs([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+                Timer timer;
+                ctrl.reqSync(Pulser::LoopBack(1));
+                lat.push_back(double(timer.elapsed()) * 1e-6);
+                std::this_thread::sleep_for(5ms);
+            }
+        });
+
+    Pulser::SlackStats stats;
+    Timer timer;
+    {
+        Pulser::CtrlLocker locker(ctrl);
+        ctrl.setHold();
+        ctrl.toggleInit();
+        Pulser::runByteCode(&ctrl, seq.code, seq.ttl_mask, true, nullptr,
+                            &stats, lead);
+        ctrl.releaseHold();
+        auto reply_t = double(timer.elapsed()) * 1e-6;
+        ctrl.waitFinish();
+        auto total_t = double(timer.elapsed()) * 1e-6;
+        std::cout << "  " << (lead ? "adaptive" : "fixed   ")
+                  << ": returned " << reply_t << " ms, latency "
+                  << total_t - double(seq.len_ns) * 1e-6 << " ms, "
+                  << "min slack " << double(stats.min_slack) * 1e-6 << " ms, "
+                  << (ctrl.timingOK() ? "timing OK" : "timing failed");
+        if (lead) {
+            assert(lead->lead() >= min_lead && lead->lead() <= max_lead);
+            std::cout << ", lead " << double(lead->lead()) * 1e-6 << " ms, "
+                      << lead->numBackoffs() << " backoffs";
+        }
+        std::cout << std::endl;
+        ctrl.run(Pulser::ClearTimingCheck());
+    }
+    done.store(true, std::memory_order_relaxed);
+    reqs.join();
+
+    double sum = 0;
+    double tmax = 0;
+    for (auto t: lat) {
+        sum += t;
+        tmax = max(tmax, t);
+    }
+    std::cout << "    " << lat.size() << " requests, mean latency "
+              << sum / double(max(lat.size(), size_t(1))) << " ms, max "
+              << tmax << " ms" << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    test_lead();
+
+    std::vector<TestSeq> seqs;
+    for (int i = 1;i < argc;i++) {
+        seqs.emplace_back();
+        if (!loadSeq(argv[i], seqs.back())) {
+            std::cerr << "Cannot read sequence " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+    if (seqs.empty()) {
+        // 2s of 10ms TTL pulses
+        seqs.push_back(syntheticSeq("slow", 200, 1, 1000000, 0));
+        // 20 bursts of 2000 x 300ns pulses, every 50ms
+        seqs.push_back(syntheticSeq("bursts", 20, 2000, 30, 5000000));
+    }
+
+    Pulser::Controller ctrl(Pulser::mapPulserAddr());
+    Pulser::LeadController lead(min_lead, max_lead);
+    for (auto &seq: seqs) {
+        std::cout << seq.name << " (" << double(seq.len_ns) * 1e-6 << " ms)"
+                  << std::endl;
+        runSeq(ctrl, seq, nullptr);
+        // The second run uses what the controller learned from the first one.
+        runSeq(ctrl, seq, &lead);
+        runSeq(ctrl, seq, &lead);
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+// Pulse rate of dense sequences run on one thread or with the decoder on
+// another thread.
+// Usage: test-pipeline [decoder_cpu decoder_prio [runner_cpu runner_prio]]
+
+#include "../bench.h"
+
+#include <nacs-pulser/instruction.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+using namespace NaCs;
+using Pulser::DecodedByteCode;
+
+// Bursts of short TTL pulses with DDS updates in between.
+static DecodedByteCode
+denseSeq(unsigned nburst, unsigned npulse)
+{
+    DecodedByteCode decoded;
+    for (unsigned i = 0;i < nburst;i++) {
+        for (unsigned j = 0;j < npulse;j++) {
+            decoded.pulses.push_back({DecodedByteCode::TTL, 0, j & 0xff, 3});
+            if (j % 64 == 0) {
+                decoded.pulses.push_back({DecodedByteCode::DDSFreq,
+                            uint8_t(j % 22), j, 0});
+            }
+        }
+        decoded.pulses.push_back({DecodedByteCode::Wait, 0, 0, 10000});
+    }
+    return decoded;
+}
+
+int
+main(int argc, char **argv)
+{
+    Pulser::ThreadConfig decoder_config;
+    Pulser::ThreadConfig runner_config;
+    if (argc >= 3)
+        decoder_config = Pulser::ThreadConfig(atoi(argv[1]), atoi(argv[2]));
+    if (argc >= 5)
+        runner_config = Pulser::ThreadConfig(atoi(argv[3]), atoi(argv[4]));
+    runner_config.apply("Sequence runner");
+
+    auto decoded = denseSeq(100, 10000);
+    auto encoded = Pulser::encodeByteCode(decoded);
+    auto nwords = encoded.words.size();
+    std::cout << nwords << " words" << std::endl;
+
+    Pulser::Controller ctrl(Pulser::mapPulserAddr());
+    Pulser::CtrlLocker locker(ctrl);
+    Pulser::ByteCodePipeline pipeline(decoder_config);
+    uint32_t expected = 0;
+    auto run = [&] (auto &&func) {
+        ctrl.releaseHold();
+        ctrl.toggleInit();
+        auto ttl = func();
+        ctrl.waitFinish();
+        ctrl.run(Pulser::ClearTimingCheck());
+        assert(ttl == expected);
+    };
+
+    // A decoding error stops the sequence and is thrown from `run`
+    // instead of on the decoder thread. The pipeline can be used again.
+    {
+        std::vector<uint8_t> bad(4096, 0xff);
+        bool check_ok = true;
+        try {
+            Pulser::checkByteCode(bad.data(), bad.size());
+        }
+        catch (const std::exception&) {
+            check_ok = false;
+        }
+        bool run_ok = true;
+        Pulser::EncodedByteCode bad_encoded;
+        ctrl.releaseHold();
+        ctrl.toggleInit();
+        try {
+            pipeline.run(&ctrl, bad.data(), bad.size(), 0xffffffff, false,
+                         nullptr, nullptr, nullptr, &bad_encoded);
+        }
+        catch (const std::exception&) {
+            run_ok = false;
+        }
+        ctrl.waitFinish();
+        ctrl.run(Pulser::ClearTimingCheck());
+        assert(run_ok == check_ok);
+        expected = 9999 & 0xff;
+        run([&] {
+                return pipeline.run(&ctrl, decoded, 0xffffffff, false);
+            });
+    }
+
+    for (uint32_t ttl_mask: {0xffffffffu, 0xffffu}) {
+        // Preserve the high channels
+        ctrl.run(Pulser::TTLPulse(100, 0x30000));
+        ctrl.waitFinish();
+        expected = (9999 & 0xff) | (0x30000 & ~ttl_mask);
+        std::cout << "TTL mask 0x" << std::hex << ttl_mask << std::dec
+                  << std::endl;
+        bench("  One thread", nwords, "words", [&] {
+                run([&] {
+                        return Pulser::runByteCode(&ctrl, decoded, ttl_mask,
+                                                   false);
+                    });
+            });
+        bench("  Pipeline", nwords, "words", [&] {
+                run([&] {
+                        return pipeline.run(&ctrl, decoded, ttl_mask, false);
+                    });
+            });
+        bench("  Encoded", nwords, "words", [&] {
+                run([&] {
+                        return Pulser::runByteCode(&ctrl, encoded, ttl_mask,
+                                                   false);
+                    });
+            });
+    }
+    return 0;
+}
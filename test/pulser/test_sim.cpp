@@ -0,0 +1,376 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+#include <nacs-pulser/simulator.h>
+#include <nacs-pulser/instruction.h>
+#include <nacs-pulser/text_seq.h>
+
+#include <nacs-utils/timer.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace NaCs;
+using namespace std::literals;
+using Inst = Pulser::InstWriter;
+
+static void
+test_requests()
+{
+    // Run as fast as possible
+    Pulser::Simulator sim(0);
+    Pulser::Controller ctrl(sim.base());
+
+    assert(ctrl.reqSync(Pulser::LoopBack(3)) == 3);
+    assert(ctrl.reqSync(Pulser::LoopBack(5)) == 5);
+
+    for (int i = 0;i < PULSER_NDDS;i++)
+        assert(ctrl.reqSync(Pulser::DDSExists(i)));
+    ctrl.reqSync(Pulser::DDSSetFreq(2, 0x12345678));
+    ctrl.reqSync(Pulser::DDSSetAmp(2, 0x234));
+    ctrl.reqSync(Pulser::DDSSetPhase(2, 0x3456));
+    assert(ctrl.reqSync(Pulser::DDSGetFreq(2)) == 0x12345678);
+    assert(ctrl.reqSync(Pulser::DDSGetAmp(2)) == 0x234);
+    assert(ctrl.reqSync(Pulser::DDSGetPhase(2)) == 0x3456);
+    ctrl.reqSync(Pulser::DDSReset(2));
+    assert(ctrl.reqSync(Pulser::DDSGetFreq(2)) == 0);
+
+    ctrl.setTTLHighMask(0x10);
+    assert(ctrl.getTTLHighMask() == 0x10);
+    Pulser::CtrlLocker locker(ctrl);
+    ctrl.run(Pulser::TTLPulse(100, 0x5));
+    ctrl.waitFinish();
+    assert(ctrl.getCurTTL() == 0x15);
+    ctrl.setTTLLowMask(0x1);
+    assert(ctrl.getCurTTL() == 0x14);
+    ctrl.setTTLHighMask(0);
+    ctrl.setTTLLowMask(0);
+    assert(ctrl.getCurTTL() == 0x5);
+
+    // More reads than the result buffer holds, with the controller locked.
+    Pulser::RequestBatch batch(ctrl);
+    std::vector<Pulser::RequestBatch::Result<Pulser::DDSGetTwoBytes> > res;
+    for (int i = 0;i < PULSER_NDDS;i++) {
+        batch.add(Pulser::DDSSetTwoBytes(i, 0x10, uint32_t(i + 100)));
+        res.push_back(batch.add(Pulser::DDSGetTwoBytes(i, 0x10)));
+        res.push_back(batch.add(Pulser::DDSGetTwoBytes(i, 0x12)));
+    }
+    batch.run();
+    batch.wait();
+    for (int i = 0;i < PULSER_NDDS;i++) {
+        assert(res[i * 2].get() == uint32_t(i + 100));
+        assert(res[i * 2 + 1].get() == 0);
+    }
+}
+
+static void
+test_timing()
+{
+    Pulser::Simulator sim(1e8);
+    Pulser::Controller ctrl(sim.base());
+    Pulser::CtrlLocker locker(ctrl);
+
+    // 10ms
+    Pulser::BlockBuilder builder;
+    for (int i = 0;i < 10000;i++)
+        builder.pulseDT(100, Inst::ttlAll, i & 1);
+    auto seq = Pulser::compileInstructionList(builder);
+
+    ctrl.run(Pulser::ClearTimingCheck());
+    ctrl.setHold();
+    ctrl.toggleInit();
+    Pulser::runCompiledSeq(&ctrl, seq);
+    Timer timer;
+    ctrl.waitFinish();
+    auto t = double(timer.elapsed()) * 1e-6;
+    std::cout << "10ms sequence finished in " << t << " ms" << std::endl;
+    assert(t > 9.5);
+    assert(ctrl.timingOK());
+
+    // Feed the FIFO too slowly
+    ctrl.toggleInit();
+    for (int i = 0;i < 10;i++) {
+        ctrl.shortPulse(100 | Pulser::ControlBit::TimingCheck, 0);
+        std::this_thread::sleep_for(100us);
+    }
+    ctrl.waitFinish();
+    assert(!ctrl.timingOK());
+    ctrl.run(Pulser::ClearTimingCheck());
+    assert(ctrl.timingOK());
+    std::cout << sim.numInsts() << " instructions simulated" << std::endl;
+}
+
+static void
+test_slack()
+{
+    Pulser::Simulator sim(1e8);
+    Pulser::Controller ctrl(sim.base());
+    Pulser::CtrlLocker locker(ctrl);
+
+    // 1s of 10ms TTL pulses
+    Pulser::DecodedByteCode code;
+    for (int i = 0;i < 100;i++)
+        code.pulses.push_back({Pulser::DecodedByteCode::TTL, 0,
+                    uint32_t(i & 1), 1000000});
+    Pulser::SlackStats stats(100000000);
+    ctrl.run(Pulser::ClearTimingCheck());
+    ctrl.setHold();
+    ctrl.toggleInit();
+    uint64_t end_t = 0;
+    Pulser::runByteCode(&ctrl, code, 0xffffffff, true, nullptr, &stats,
+                        nullptr, &end_t);
+    ctrl.releaseHold();
+    assert(end_t > getTime());
+    // A second copy queued behind the first one starts when it ends.
+    auto end_t1 = end_t;
+    Pulser::SlackStats queued(100000000);
+    Pulser::runByteCode(&ctrl, Pulser::encodeByteCode(code), 0xffffffff, true,
+                        nullptr, &queued, nullptr, &end_t);
+    assert(end_t - end_t1 == (1000000 * 100 + Seq::PulseTime::Min) * 10);
+    ctrl.waitFinish();
+    assert(ctrl.timingOK());
+    auto tend = getTime();
+    std::cout << "Queued sequence finished "
+              << (double(tend) - double(end_t)) * 1e-6
+              << " ms after the expected time" << std::endl;
+    assert(tend + 50000000 > end_t && tend < end_t + 50000000);
+    assert(queued.nsamples > 0);
+    assert(queued.min_slack > 0);
+    std::cout << "Slack: " << stats.nsamples << " samples, min "
+              << double(stats.min_slack) * 1e-6 << " ms, " << stats.nlow
+              << " below 100 ms" << std::endl;
+    assert(stats.nsamples > 0);
+    assert(stats.min_slack > 0);
+    uint32_t total = 0;
+    for (auto n: stats.hist)
+        total += n;
+    assert(total == stats.nsamples);
+
+    Pulser::SlackStats merged;
+    merged.add(-10);
+    merged.merge(stats);
+    assert(merged.min_slack == -10);
+    assert(merged.hist[0] == stats.hist[0] + 1);
+    assert(merged.nsamples == stats.nsamples + 1);
+}
+
+// A sequence that arrives after the previous one has finished is not
+// appended to it but held until it is buffered.
+static void
+test_late_seq()
+{
+    Pulser::Simulator sim(1e8);
+    Pulser::Controller ctrl(sim.base());
+    Pulser::CtrlLocker locker(ctrl);
+
+    // 1ms
+    Pulser::DecodedByteCode first;
+    for (int i = 0;i < 10;i++)
+        first.pulses.push_back({Pulser::DecodedByteCode::TTL, 0,
+                    uint32_t(i & 1), 10000});
+    // 20000 dense pulses
+    Pulser::DecodedByteCode dense;
+    for (int i = 0;i < 20000;i++)
+        dense.pulses.push_back({Pulser::DecodedByteCode::TTL, 0,
+                    uint32_t(i & 1), Seq::PulseTime::Min});
+
+    ctrl.run(Pulser::ClearTimingCheck());
+    ctrl.setHold();
+    ctrl.toggleInit();
+    uint64_t end_t = 0;
+    Pulser::runByteCode(&ctrl, first, 0xffffffff, true, nullptr, nullptr,
+                        nullptr, &end_t);
+    ctrl.releaseHold();
+    // Still running
+    auto end_t1 = end_t;
+    assert(Pulser::prepareQueuedSeq(&ctrl, end_t, 0));
+    assert(end_t == end_t1);
+
+    // Finished or about to
+    assert(!Pulser::prepareQueuedSeq(&ctrl, end_t));
+    assert(end_t == 0);
+    Pulser::runByteCode(&ctrl, dense, 0xffffffff, true, nullptr, nullptr,
+                        nullptr, &end_t);
+    ctrl.releaseHold();
+    ctrl.waitFinish();
+    assert(ctrl.timingOK());
+    assert(ctrl.getCurTTL() == 1);
+}
+
+static std::string
+textSeq(unsigned nlines, unsigned bad_line=0)
+{
+    std::string text;
+    for (unsigned i = 1;i <= nlines;i++) {
+        if (i == bad_line) {
+            text += "dt = 1 us, TTL(all) 0x3\n";
+        } else if (i % 100 == 0) {
+            text += "dt = 2000 us, freq(3) = 10e6 # long wait\n";
+        } else {
+            char buff[64];
+            snprintf(buff, sizeof(buff), "dt = 1 us, TTL(all) = 0x%x\n", i & 0xff);
+            text += buff;
+        }
+    }
+    return text;
+}
+
+static void
+test_text_stream()
+{
+    Pulser::Simulator sim(0);
+    Pulser::Controller ctrl(sim.base());
+    Pulser::CtrlLocker locker(ctrl);
+    Pulser::TextSeqStream::Config config;
+    config.validate_lines = 100;
+    config.min_lead = 0;
+    config.chunk_lines = 64;
+    config.max_chunks = 2;
+    auto run = [&] (Pulser::TextSeqStream &stream) {
+        ctrl.setHold();
+        ctrl.toggleInit();
+        bool res = stream.run(&ctrl);
+        ctrl.waitFinish();
+        return res;
+    };
+
+    // Same result as parsing the whole sequence first.
+    auto text = textSeq(5000);
+    Pulser::BlockBuilder builder;
+    Pulser::parseTextSeq(text, builder);
+    auto seq = Pulser::compileInstructionList(builder);
+    Pulser::TextSeqStream stream(text.data(), text.size(), config);
+    assert(stream.start() >= 100);
+    assert(run(stream));
+    assert(stream.hasCompiled());
+    assert(ctrl.getCurTTL() == (4999 & 0xff));
+    auto &streamed = stream.compiled();
+    assert(stream.numInsts() == builder.size());
+    assert(stream.length() == builder.currT);
+    assert(streamed.pulses.size() == seq.pulses.size());
+    for (size_t i = 0;i < seq.pulses.size();i++) {
+        assert(streamed.pulses[i].ctrl == seq.pulses[i].ctrl);
+        assert(streamed.pulses[i].op == seq.pulses[i].op);
+    }
+    assert(streamed.waits.size() == seq.waits.size());
+    for (size_t i = 0;i < seq.waits.size();i++) {
+        assert(streamed.waits[i].idx == seq.waits[i].idx);
+        assert(streamed.waits[i].t == seq.waits[i].t);
+    }
+
+    // The sequence isn't kept if it is too large.
+    {
+        auto small = config;
+        small.max_compiled = seq.cacheSize() / 2;
+        Pulser::TextSeqStream large(text.data(), text.size(), small);
+        large.start();
+        assert(run(large));
+        assert(ctrl.getCurTTL() == (4999 & 0xff));
+        assert(!large.hasCompiled());
+        assert(large.compiled().pulses.empty());
+        assert(large.length() == builder.currT);
+    }
+
+    // Each chunk is optimized on its own.
+    {
+        std::string same;
+        for (unsigned i = 0;i < 1000;i++)
+            same += "dt = 1 us, TTL(all) = 0x3\n";
+        auto opt_config = config;
+        opt_config.optimize = true;
+        Pulser::TextSeqStream opt(same.data(), same.size(), opt_config);
+        opt.start();
+        assert(run(opt));
+        assert(ctrl.getCurTTL() == 0x3);
+        assert(opt.length() == 1000 * 100);
+        auto &stats = opt.optimizeStats();
+        // The first write of each chunk is kept.
+        assert(stats.removed > 900 && stats.removed < 1000);
+        assert(stats.removed_t == stats.removed * Seq::PulseTime::Min);
+    }
+
+    // Errors in the validation window are thrown before the sequence starts.
+    text = textSeq(5000, 50);
+    {
+        Pulser::TextSeqStream bad(text.data(), text.size(), config);
+        bool thrown = false;
+        try {
+            bad.start();
+        } catch (const std::runtime_error &err) {
+            thrown = std::string(err.what()).find("L50:") == 0;
+        }
+        assert(thrown);
+    }
+
+    // Later errors stop the sequence.
+    text = textSeq(5000, 3000);
+    Pulser::TextSeqStream late(text.data(), text.size(), config);
+    late.start();
+    assert(!run(late));
+    assert(late.error().find("L3000:") == 0);
+    // Only the chunks before the one with the error ran.
+    assert(ctrl.getCurTTL() == ((3000 / 64 * 64) & 0xff));
+
+    // Destroyed without running
+    Pulser::TextSeqStream unused(text.data(), text.size(), config);
+    unused.start();
+}
+
+static void
+test_loops()
+{
+    Pulser::Simulator sim(0);
+    Pulser::Controller ctrl(sim.base());
+    Pulser::CtrlLocker locker(ctrl);
+    Pulser::BlockBuilder builder;
+    Pulser::parseTextSeq("dt = 1 us, TTL(all) = 0x1\n"
+                         "loop(1000)\n"
+                         "dt = 1 us, TTL(2) = 1\n"
+                         "dt = 1 us, shiftp(1) = 0.36\n"
+                         "dt = 1 us, TTL(2) = 0\n"
+                         "endloop\n", builder);
+    assert(builder.size() == 10);
+    auto unrolled = Pulser::compileInstructionList(builder);
+    auto ninsts = sim.numInsts();
+    ctrl.setHold();
+    ctrl.toggleInit();
+    Pulser::CtrlState state{};
+    Pulser::runInstructionList(&ctrl, &state, builder);
+    ctrl.waitFinish();
+    // Each wait point is one instruction when there are no requests.
+    assert(sim.numInsts() - ninsts ==
+           unrolled.pulses.size() + unrolled.waits.size());
+    assert(ctrl.getCurTTL() == 0x1);
+    assert(state.dds_phases[1] ==
+           uint16_t(Pulser::DDSCvt::phase2num(0.36) * 1000));
+
+    // Same from the packed list
+    auto packed = Pulser::packInstructionList(builder);
+    ninsts = sim.numInsts();
+    ctrl.toggleInit();
+    Pulser::CtrlState state2{};
+    Pulser::runInstructionList(&ctrl, &state2, packed);
+    ctrl.waitFinish();
+    assert(sim.numInsts() - ninsts ==
+           unrolled.pulses.size() + unrolled.waits.size());
+    assert(ctrl.getCurTTL() == 0x1);
+    assert(state2.dds_phases[1] == state.dds_phases[1]);
+}
+
+int
+main()
+{
+    test_requests();
+    test_timing();
+    test_slack();
+    test_late_seq();
+    test_text_stream();
+    test_loops();
+    return 0;
+}
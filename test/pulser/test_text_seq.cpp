@@ -0,0 +1,296 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+// Check that `parseTextSeq` gives the same result as `parseTextSeqLegacy`
+// on a generated corpus (and on the sequence files given on the command
+// line), then compare the parse speed.
+// Usage: test-text_seq [seq-file...]
+
+#include "../bench.h"
+
+#include <nacs-pulser/text_seq.h>
+
+#include <assert.h>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace NaCs;
+using Pulser::BlockBuilder;
+
+struct ParseRes {
+    bool ok;
+    std::string error;
+    BlockBuilder builder;
+};
+
+template<typename Func>
+static ParseRes
+parse(Func &&func, const std::string &text)
+{
+    ParseRes res{true, "", {}};
+    try {
+        func(text, res.builder);
+    } catch (const std::runtime_error &e) {
+        res.ok = false;
+        res.error = e.what();
+    }
+    return res;
+}
+
+static bool
+sameRes(const ParseRes &a, const ParseRes &b)
+{
+    if (a.ok != b.ok || a.error != b.error)
+        return false;
+    auto &ba = a.builder;
+    auto &bb = b.builder;
+    if (ba.size() != bb.size() || ba.currT != bb.currT ||
+        ba.lineNum != bb.lineNum)
+        return false;
+    for (size_t i = 0;i < ba.size();i++) {
+        if (ba[i].ctrl != bb[i].ctrl || ba[i].op != bb[i].op) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+checkSame(const std::string &text)
+{
+    auto legacy = parse([] (const std::string &text, BlockBuilder &builder) {
+            Pulser::parseTextSeqLegacy(text, builder);
+        }, text);
+    auto fast = parse([] (const std::string &text, BlockBuilder &builder) {
+            Pulser::parseTextSeq(text, builder);
+        }, text);
+    if (!sameRes(legacy, fast)) {
+        std::cerr << "Mismatch on:" << std::endl << text << std::endl
+                  << "legacy: " << (legacy.ok ? "OK" : legacy.error) << ", "
+                  << legacy.builder.size() << " instructions" << std::endl
+                  << "fast: " << (fast.ok ? "OK" : fast.error) << ", "
+                  << fast.builder.size() << " instructions" << std::endl;
+        abort();
+    }
+}
+
+// Lines that are valid, invalid or accepted by accident.
+static const char *const edge_lines[] = {
+    "",
+    "   ",
+    "# only comment",
+    "no equal sign here",
+    "t = 1 us, TTL(all) = 0x1",
+    "t=2us,TTL(3)=1",
+    "  dt = 0.5 us , freq(2) = 100e6  # comment",
+    "dt = 1e-3 ms, amp(1) = 0.5",
+    "dt = .5, phase(0) = 90",
+    "dt = 5., shiftp(0) = -45.5",
+    "dt = 1.5e1 us, TTL(all) = 0xff\r",
+    "dt = 00001.2500, freq(1) = 000.1e+2",
+    "dt = 1, reset(3) x",
+    "dt = 1, reset(3)",
+    "dt = 1, reset(x) x",
+    "dt = 1, CLOCK_OUT(off)",
+    "dt = 1, CLOCK_OUT(10)",
+    "dt = 1, CLOCK_OUT( +7)",
+    "dt = 1, CLOCK_OUT(0)",
+    "dt = 1, CLOCK_OUT(300)",
+    "dt = 1, CLOCK_OUT(abc)",
+    "dt = 1, dac(2) = 1.5",
+    "dt = 1, dac(5) = 1.5",
+    "dt = 1, dac(a) = 1.5",
+    "dt = 1, freq(40) = 1e6",
+    "dt = 1, freq(-1) = 1e6",
+    "dt = 1, freq() = 1e6",
+    "dt = 1, freq(1)",
+    "dt = 1, freq(1) = ",
+    "dt = 1, freq(1) x 5",
+    "dt = 1, freq(1) = x",
+    "dt = 1, freq(1) = 1e",
+    "dt = 1, freq(1) = -.",
+    "dt = 1, freq(1) = 0x1p20",
+    "dt = 1, freq(1) = +0x10",
+    "dt = 1, freq(1) = 12345678901234567890123",
+    "dt = 1, freq(1) = 1.5e-40",
+    "dt = 1, TTL(x) = 0x1",
+    "dt = 1, TTL(all) = 0xg",
+    "dt = 1, TTL(all) = -1",
+    "dt = 1, TTL(all) = zz",
+    "dt = 1, TTL(all) = 123456789",
+    "dt = 1, TTL(99999999999) = 1",
+    "dt = 1, TTL (all) = 1",
+    "dt = 1, ttl(all) = 1",
+    "dt = 1, myfreqx(1) = 5",
+    "dt = 1, shiftphase(1) = 5",
+    "dt = 1, foo(1) = 5",
+    "x = 1, TTL(all) = 1",
+    "t = , TTL(all) = 1",
+    "t = 1e, TTL(all) = 1",
+    "t = 1e+, TTL(all) = 1",
+    "t = +, TTL(all) = 1",
+    "t = 1",
+    "t = 1 us",
+    "t = 1 us, TTL",
+    "t = 1 us,",
+    "t = 1 us, TTL(all",
+    "t = 0.5 us, TTL(all) = 1",
+    "dt = 0.001, TTL(all) = 1",
+    "loop(3)\ndt = 1 us, TTL(all) = 0x1\nendloop",
+    " loop ( 2 ) \n loop(2)\ndt = 1 us, TTL(2) = 1\n endloop\r\nendloop",
+    "loop(0)\ndt = 1 us, TTL(all) = 0x1\nendloop",
+    "loop(4)\nendloop",
+    "loop(3)\ndt = 1 us, TTL(all) = 0x1",
+    "endloop",
+    "loop()",
+    "loop(-1)",
+    "loop(99999999999)",
+    "loop(3) x",
+    "loopy",
+};
+
+// @long_digits: also generate numbers with more digits than a `double`
+static std::string
+randomNumber(std::mt19937 &gen, bool long_digits=true)
+{
+    std::uniform_int_distribution<int> dist(0, 1 << 30);
+    std::string str = std::to_string(dist(gen) % 100000);
+    switch (dist(gen) % (long_digits ? 4 : 3)) {
+    case 0:
+        break;
+    case 1:
+        str += "." + std::to_string(dist(gen) % 1000);
+        break;
+    case 2:
+        str = "0." + std::to_string(dist(gen)) + "e" +
+            std::to_string(dist(gen) % 31 - 15);
+        break;
+    default:
+        str += std::to_string(dist(gen)) + "." + std::to_string(dist(gen)) +
+            "E" + std::to_string(dist(gen) % 61 - 30);
+        break;
+    }
+    return str;
+}
+
+static std::string
+randomSeq(std::mt19937 &gen, size_t nlines, bool long_digits=true)
+{
+    static const char *const spaces[] = {"", " ", "  ", "\t"};
+    std::uniform_int_distribution<int> dist(0, 1 << 30);
+    auto sp = [&] { return spaces[dist(gen) % 4]; };
+    std::string seq;
+    for (size_t i = 0;i < nlines;i++) {
+        auto r = dist(gen);
+        if (r % 16 == 0) {
+            seq += "# comment\n";
+            continue;
+        }
+        seq += std::string(sp()) + "dt" + sp() + "=" + sp() +
+            std::to_string(r % 100 + 1) + "." + std::to_string(r % 7) +
+            sp() + "us" + sp() + "," + sp();
+        switch (r % 7) {
+        case 0:
+            seq += "TTL(all)" + std::string(sp()) + "=" + sp() + "0x" +
+                std::to_string(dist(gen) % 100000);
+            break;
+        case 1:
+            seq += "TTL(" + std::to_string(dist(gen) % 32) + ") = " +
+                std::to_string(dist(gen) % 2);
+            break;
+        case 2:
+            seq += "freq(" + std::to_string(dist(gen) % 22) + ") = " +
+                randomNumber(gen, long_digits);
+            break;
+        case 3:
+            seq += "amp(" + std::to_string(dist(gen) % 22) + ") = 0." +
+                std::to_string(dist(gen) % 1000);
+            break;
+        case 4:
+            seq += "phase(" + std::to_string(dist(gen) % 22) + ") = " +
+                randomNumber(gen, long_digits);
+            break;
+        case 5:
+            seq += "shiftp(" + std::to_string(dist(gen) % 22) + ") = -" +
+                randomNumber(gen, long_digits);
+            break;
+        default:
+            seq += "dac(" + std::to_string(dist(gen) % 4) + ") = " +
+                std::to_string(dist(gen) % 10) + ".5";
+            break;
+        }
+        if (r % 5 == 0)
+            seq += "  # comment";
+        seq += "\n";
+    }
+    return seq;
+}
+
+static void
+test_corpus(std::mt19937 &gen)
+{
+    static const std::string prefix = "t = 1 us, TTL(all) = 0x1\n";
+    for (auto line: edge_lines) {
+        checkSame(line);
+        checkSame(prefix + line);
+        checkSame(prefix + line + "\n");
+    }
+    for (int i = 0;i < 2000;i++) {
+        checkSame(randomSeq(gen, 8));
+    }
+    // The loop body is stored once.
+    BlockBuilder builder;
+    Pulser::parseTextSeq("loop(1000000)\ndt = 1 us, TTL(all) = 0x1\n"
+                         "dt = 1 us, TTL(all) = 0x0\nendloop\n", builder);
+    assert(builder.size() == 6);
+    assert(builder.currT == 1000000 * 2 * 100);
+    auto hasLoops = [] (const std::string &str) {
+        return Pulser::hasLoops(str.data(), str.size());
+    };
+    assert(hasLoops("dt = 1 us, TTL(all) = 0x1\n loop ( 2 ) \nendloop"));
+    assert(hasLoops("dt = 1 us, TTL(all) = 0x1\n endloop # end"));
+    assert(!hasLoops("dt = 1 us, TTL(all) = 0x1 # endloop\n# loop(2)\n"));
+    assert(!hasLoops("dt = 1 us, TTL(all) = 0x1\nloopy\n"));
+    // Times and frequencies with all kinds of rounding.
+    for (int i = 0;i < 20000;i++) {
+        auto num = randomNumber(gen);
+        checkSame("t = " + num + " us, freq(3) = " + num);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    std::mt19937 gen(1234);
+    test_corpus(gen);
+    for (int i = 1;i < argc;i++) {
+        std::ifstream fs(argv[i]);
+        if (!fs) {
+            std::cerr << "Cannot read sequence " << argv[i] << std::endl;
+            return 1;
+        }
+        std::stringstream ss;
+        ss << fs.rdbuf();
+        checkSame(ss.str());
+    }
+
+    auto seq = randomSeq(gen, 100000, false);
+    std::cout << "100000 lines (" << seq.size() << " bytes)" << std::endl;
+    bench("  Legacy", seq.size(), "bytes", [&] {
+            BlockBuilder builder;
+            Pulser::parseTextSeqLegacy(seq, builder);
+        });
+    bench("  Fast", seq.size(), "bytes", [&] {
+            BlockBuilder builder;
+            Pulser::parseTextSeq(seq, builder);
+        });
+    return 0;
+}
@@ -0,0 +1,111 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+#include <nacs-pulser/instruction.h>
+#include <nacs-pulser/trace.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+using namespace NaCs;
+using Inst = Pulser::InstWriter;
+
+static void
+test_ring()
+{
+    Pulser::TraceRing ring(10);
+    assert(ring.capacity() == 16);
+    ring.restart();
+    for (uint32_t i = 0;i < 20;i++)
+        ring.record(0x20000000 | 100, i);
+    ring.record(Pulser::DDSSetFreq(1, 2).control(), 2);
+    assert(ring.count() == 22);
+    auto entries = ring.entries();
+    assert(entries.size() == 16);
+    // Oldest first
+    assert(entries[0].op == 5);
+    assert(entries[0].seq_t == 500);
+    assert(entries[14].seq_t == 1900);
+    assert(entries[15].seq_t == 2000);
+    for (size_t i = 1;i < entries.size();i++)
+        assert(entries[i].host_ns >= entries[i - 1].host_ns);
+
+    ring.restart();
+    ring.record(10, 0x3);
+    entries = ring.entries();
+    assert(entries[14].ctrl == Pulser::TraceRing::StartMarker);
+    assert(entries[15].seq_t == 0);
+
+    const char *fname = "/tmp/nacs-test-trace.bin";
+    assert(ring.dump(fname));
+    FILE *fp = fopen(fname, "rb");
+    assert(fp);
+    char magic[8];
+    uint64_t n;
+    assert(fread(magic, 8, 1, fp) == 1);
+    assert(memcmp(magic, "NACSTRC1", 8) == 0);
+    assert(fread(&n, 8, 1, fp) == 1);
+    assert(n == 16);
+    std::vector<Pulser::TraceEntry> read(n);
+    assert(fread(read.data(), sizeof(Pulser::TraceEntry), n, fp) == n);
+    fclose(fp);
+    remove(fname);
+    assert(memcmp(read.data(), entries.data(),
+                  n * sizeof(Pulser::TraceEntry)) == 0);
+}
+
+#if PULSER_TRACE
+// Run a sequence and find out how far ahead of the FPGA the host was.
+static void
+test_driver()
+{
+    Pulser::Controller ctrl(Pulser::mapPulserAddr());
+    Pulser::CtrlLocker locker(ctrl);
+    Pulser::BlockBuilder builder;
+    for (int i = 0;i < 10000;i++)
+        builder.pulseDT(100, Inst::ttlAll, i & 1);
+    auto seq = Pulser::compileInstructionList(builder);
+
+    auto &trace = Pulser::pulseTrace();
+    trace.clear();
+    ctrl.setHold();
+    ctrl.toggleInit();
+    Pulser::runCompiledSeq(&ctrl, seq);
+    ctrl.waitFinish();
+    std::cout << "Timing " << (ctrl.timingOK() ? "OK" : "failed") << std::endl;
+
+    auto entries = trace.entries();
+    assert(entries[0].ctrl == Pulser::TraceRing::StartMarker);
+    assert(entries.size() > seq.pulses.size());
+    // The hold is released once the FIFO has enough instructions so the lead
+    // is relative to the first instruction that was written after that.
+    auto t0 = entries[1].host_ns;
+    int64_t min_lead = INT64_MAX;
+    size_t min_idx = 0;
+    for (size_t i = 1;i < entries.size();i++) {
+        auto lead = int64_t(t0 + entries[i].seq_t * 10) -
+            int64_t(entries[i].host_ns);
+        if (lead < min_lead) {
+            min_lead = lead;
+            min_idx = i;
+        }
+    }
+    std::cout << entries.size() << " instructions, minimum lead "
+              << double(min_lead) * 1e-3 << " us at #" << min_idx << std::endl;
+}
+#endif
+
+int
+main()
+{
+    test_ring();
+#if PULSER_TRACE
+    test_driver();
+#endif
+    return 0;
+}
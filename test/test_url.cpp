@@ -0,0 +1,169 @@
+//
+
+#ifdef NDEBUG
+#  undef NDEBUG
+#endif
+
+// Check the URL decoder and encoder used for the `seqtext` bodies against
+// the original `std::string` based versions and compare their speed
+// on a 10 MB sequence.
+
+#include "../molecube/saveloadmap.h"
+#include "bench.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+using namespace NaCs;
+
+static std::string
+url_encode_legacy(const std::string &value)
+{
+    std::ostringstream escaped;
+    escaped.fill('0');
+    escaped << std::hex;
+    for (auto c: value) {
+        if (isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' ||
+            c == '~') {
+            escaped << c;
+            continue;
+        }
+        escaped << '%' << std::setw(2) << int((unsigned char)c);
+    }
+    return escaped.str();
+}
+
+static std::string
+url_decode_legacy(const std::string &src)
+{
+    std::string ret;
+    for (unsigned i = 0;i < src.length();i++) {
+        if (src[i] == '+') {
+            ret += ' ';
+        } else if (src[i] == '%') {
+            int ii;
+            sscanf(src.substr(i + 1, 2).c_str(), "%x", &ii);
+            ret += static_cast<char>(ii);
+            i = i + 2;
+        } else {
+            ret += src[i];
+        }
+    }
+    return ret;
+}
+
+static std::string
+decode(std::string str)
+{
+    str.resize(urlDecode(&str[0], str.size()));
+    return str;
+}
+
+static std::string
+encode(const std::string &str)
+{
+    return urlEncode(str.data(), str.size());
+}
+
+// A form body as sent by the browser, i.e. with '+' for spaces.
+static std::string
+formEncode(const std::string &str)
+{
+    auto res = encode(str);
+    std::string out;
+    for (size_t i = 0;i < res.size();i++) {
+        if (res.compare(i, 3, "%20") == 0) {
+            out += '+';
+            i += 2;
+        } else {
+            out += res[i];
+        }
+    }
+    return out;
+}
+
+static std::string
+textSeq(std::mt19937 &gen, size_t size)
+{
+    std::uniform_int_distribution<int> dist(0, 99);
+    std::string text;
+    char buff[128];
+    while (text.size() < size) {
+        int r = dist(gen);
+        if (r < 60) {
+            snprintf(buff, sizeof(buff), "dt = %d.%d us, TTL(all) = 0x%x\n",
+                     r, dist(gen), dist(gen) * 4567);
+        } else if (r < 90) {
+            snprintf(buff, sizeof(buff), "t = %d us, freq(%d) = %de6 # comment\n",
+                     dist(gen) * 100, r % 22, dist(gen));
+        } else {
+            snprintf(buff, sizeof(buff), "dt = 1 us, amp(%d) = 0.%d\n",
+                     r % 22, dist(gen));
+        }
+        text += buff;
+    }
+    return text;
+}
+
+static void
+test_url()
+{
+    assert(decode("a+b%20c%2Cd%2c") == "a b c,d,");
+    assert(decode("") == "");
+    // Invalid escapes are kept
+    assert(decode("100%") == "100%");
+    assert(decode("%4") == "%4");
+    assert(decode("%zz%41") == "%zzA");
+    assert(encode("a b,c~") == "a%20b%2cc~");
+    assert(encode("\xff\x01") == "%ff%01");
+
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (int i = 0;i < 1000;i++) {
+        std::string str(size_t(byte(gen)), '\0');
+        for (auto &c: str)
+            c = char(byte(gen));
+        auto encoded = encode(str);
+        assert(encoded == url_encode_legacy(str));
+        assert(decode(encoded) == str);
+        assert(decode(encoded) == url_decode_legacy(encoded));
+        auto form = formEncode(str);
+        assert(decode(form) == url_decode_legacy(form));
+    }
+}
+
+int
+main()
+{
+    test_url();
+
+    std::mt19937 gen(4321);
+    auto text = textSeq(gen, 10 * 1024 * 1024);
+    auto body = formEncode(text);
+    std::cout << text.size() << " bytes, " << body.size() << " encoded"
+              << std::endl;
+    assert(decode(body) == text);
+
+    bench("Legacy decode", body.size(), "bytes", [&] {
+            auto res = url_decode_legacy(body);
+            assert(res.size() == text.size());
+        });
+    bench("Decode", body.size(), "bytes", [&] {
+            auto res = body;
+            res.resize(urlDecode(&res[0], res.size()));
+            assert(res.size() == text.size());
+        });
+    bench("Decode (copy only)", body.size(), "bytes", [&] {
+            auto res = body;
+            assert(res.size() == body.size());
+        });
+    bench("Legacy encode", text.size(), "bytes", [&] { url_encode_legacy(text); });
+    bench("Encode", text.size(), "bytes", [&] { encode(text); });
+    return 0;
+}